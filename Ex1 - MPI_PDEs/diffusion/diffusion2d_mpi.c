@@ -4,7 +4,17 @@
 #include <string.h>
 #include <mpi.h>
 
-
+/* With -DRMA, the ghost rows are filled with one-sided communication : each rank puts its first and last rows
+ * into the ghost rows of its neighbours (MPI_Put), in an access/exposure epoch restricted to the two
+ * neighbours (MPI_Win_post/start/complete/wait). There is one window over each of the two density buffers,
+ * and the epoch of each step uses the window of the current rho_, so the windows alternate as the buffers
+ * are swapped.
+ */
+
+// number of steps whose heat is reduced at once, with a single non-blocking reduction
+#ifndef DIAG_BATCH
+#define DIAG_BATCH 64
+#endif
 
 typedef struct Diagnostics_s
 {
@@ -21,6 +31,16 @@ typedef struct Diffusion2D_s
     int local_N_;
     double *rho_, *rho_tmp_;
     Diagnostics *diag_;
+    // the local heat of the current batch of steps, and of the batch being reduced (into heat_sum_ on rank 0)
+    double heat_local_[2][DIAG_BATCH], heat_sum_[2][DIAG_BATCH];
+    int diag_buf_, diag_count_, diag_step0_;        // buffer, size and first step of the current batch
+    int pending_count_, pending_step0_;             // size and first step of the batch being reduced
+    MPI_Request diag_req_;
+#if defined(RMA)
+    MPI_Win win_[2];            // windows over the two density buffers
+    MPI_Group nb_group_;        // the previous and the next rank (if any)
+    int cur_;                   // window of the current rho_
+#endif
 } Diffusion2D;
 
 void initialize_density(Diffusion2D *D2D)
@@ -94,6 +114,35 @@ void init(Diffusion2D *D2D,
     D2D->rho_ = (double *)calloc(D2D->Ntot_, sizeof(double));
     D2D->rho_tmp_ = (double *)calloc(D2D->Ntot_, sizeof(double));
     D2D->diag_ = (Diagnostics *)calloc(D2D->T_, sizeof(Diagnostics));
+    D2D->diag_buf_ = 0;
+    D2D->diag_count_ = 0;
+    D2D->pending_count_ = 0;
+    D2D->diag_req_ = MPI_REQUEST_NULL;
+
+#if defined(RMA)
+    // the windows are only accessed in PSCW epochs. A single rank has nothing to exchange, and does not
+    // create them (some MPI libraries cannot create a window without a neighbour to access it).
+    D2D->win_[0] = D2D->win_[1] = MPI_WIN_NULL;
+    D2D->cur_ = 0;
+    if (procs > 1) {
+        MPI_Info info;
+        MPI_Info_create(&info);
+        MPI_Info_set(info, "no_locks", "true");
+        MPI_Win_create(D2D->rho_, D2D->Ntot_ * sizeof(double), sizeof(double), info, MPI_COMM_WORLD, &D2D->win_[0]);
+        MPI_Win_create(D2D->rho_tmp_, D2D->Ntot_ * sizeof(double), sizeof(double), info, MPI_COMM_WORLD, &D2D->win_[1]);
+        MPI_Info_free(&info);
+    }
+
+    MPI_Group world_group;
+    int nb[2], nnb = 0;
+    if (rank > 0)
+        nb[nnb++] = rank - 1;
+    if (rank < procs - 1)
+        nb[nnb++] = rank + 1;
+    MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+    MPI_Group_incl(world_group, nnb, nb, &D2D->nb_group_);
+    MPI_Group_free(&world_group);
+#endif
 
     // Check that the timestep satisfies the restriction for stability.
     if (D2D->rank_ == 0)
@@ -113,11 +162,28 @@ void advance(Diffusion2D *D2D)
     int rank_ = D2D->rank_;
     int procs_ = D2D->procs_;
 
+#if !defined(RMA)
     MPI_Status status[2];
+#endif
 
     int prev_rank = rank_ - 1;
     int next_rank = rank_ + 1;
 
+#if defined(RMA)
+    /* Expose the ghost rows of rho_ to the neighbours and put the boundary rows into theirs. The previous rank
+     * is never the last one, so it has N_ / procs_ rows. The puts only read rho_, so the interior can be
+     * updated while they are in flight.
+     */
+    MPI_Win win = D2D->win_[D2D->cur_];
+    if (win != MPI_WIN_NULL) {
+        MPI_Win_post(D2D->nb_group_, 0, win);
+        MPI_Win_start(D2D->nb_group_, 0, win);
+    }
+    if (prev_rank >= 0)
+        MPI_Put(&rho_[1*real_N_+1], N_, MPI_DOUBLE, prev_rank, (N_/procs_+1)*real_N_+1, N_, MPI_DOUBLE, win);
+    if (next_rank < procs_)
+        MPI_Put(&rho_[local_N_*real_N_+1], N_, MPI_DOUBLE, next_rank, 0*real_N_+1, N_, MPI_DOUBLE, win);
+#else
     // Exchange ALL necessary ghost cells with neighboring ranks.
     if (prev_rank >= 0) {
         // TODO:MPI
@@ -138,6 +204,7 @@ void advance(Diffusion2D *D2D)
         // the purpose of this part will become 
         // clear when using asynchronous communication.
     }
+#endif
 
     // Central differences in space, forward Euler in time with Dirichlet
     // boundaries.
@@ -169,9 +236,16 @@ void advance(Diffusion2D *D2D)
     // neighboring nodes arrives, the first and last row are handled.
     // As this is a synchronous-only exercise, feel free to merge the
     // following for loops into the previous ones.
+#if defined(RMA)
+    // the puts of this rank are done, and so are the ones into its ghost rows
+    if (win != MPI_WIN_NULL) {
+        MPI_Win_complete(win);
+        MPI_Win_wait(win);
+    }
+#endif
 
     // Update the first and the last rows of each rank.
-    for (int i = 1; i <= local_N_; i += local_N_- 1) {
+    for (int i = 1; i <= local_N_; i += (local_N_ > 1) ? local_N_- 1 : 1) {
         for (int j = 1; j <= N_; ++j) {
             rho_tmp_[i*real_N_ + j] = rho_[i*real_N_ + j] +
                                      fac_
@@ -194,6 +268,45 @@ void advance(Diffusion2D *D2D)
     double *tmp_ = D2D->rho_tmp_;
     D2D->rho_tmp_ = D2D->rho_;
     D2D->rho_ = tmp_;
+#if defined(RMA)
+    D2D->cur_ = 1 - D2D->cur_;
+#endif
+}
+
+// complete the reduction in flight (if any), and store its result in diag_ on rank 0
+void complete_diagnostics(Diffusion2D *D2D)
+{
+    MPI_Wait(&D2D->diag_req_, MPI_STATUS_IGNORE);
+    if (D2D->rank_ == 0) {
+        double *heat_sum = D2D->heat_sum_[1 - D2D->diag_buf_];
+        for (int k = 0; k < D2D->pending_count_; ++k) {
+            D2D->diag_[D2D->pending_step0_ + k].heat = heat_sum[k];
+#if DEBUG
+            printf("t = %lf heat = %lf\n", D2D->diag_[D2D->pending_step0_ + k].time, heat_sum[k]);
+#endif
+        }
+    }
+    D2D->pending_count_ = 0;
+}
+
+/* Start the reduction of the current batch and switch to the other buffer. The previous reduction is only
+ * completed here, a batch later, so it does not synchronize the ranks at every step.
+ * The MPI library may order the sum of a vector differently than the sum of a single value, so the heat can
+ * differ from a reduction per step in the last bit (not in the diagnostics files, written with %f).
+ */
+void flush_diagnostics(Diffusion2D *D2D)
+{
+    if (D2D->diag_count_ == 0)
+        return;
+    complete_diagnostics(D2D);
+
+    int b = D2D->diag_buf_;
+    MPI_Ireduce(D2D->heat_local_[b], D2D->heat_sum_[b], D2D->diag_count_, MPI_DOUBLE, MPI_SUM, 0,
+                MPI_COMM_WORLD, &D2D->diag_req_);
+    D2D->pending_count_ = D2D->diag_count_;
+    D2D->pending_step0_ = D2D->diag_step0_;
+    D2D->diag_buf_ = 1 - b;
+    D2D->diag_count_ = 0;
 }
 
 void compute_diagnostics(Diffusion2D *D2D, const int step, const double t)
@@ -210,17 +323,29 @@ void compute_diagnostics(Diffusion2D *D2D, const int step, const double t)
         for(int j = 1; j <= N_; ++j)
             heat += rho_[i*real_N_ + j] * dr_ * dr_;
 
-    // TODO:MPI, reduce heat (sum)
-    MPI_Reduce(rank_ == 0? MPI_IN_PLACE: &heat, &heat, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD); 
+    // buffer the local heat, it is reduced with the other steps of the batch
+    if (D2D->diag_count_ == 0)
+        D2D->diag_step0_ = step;
+    D2D->heat_local_[D2D->diag_buf_][D2D->diag_count_++] = heat;
+    if (rank_ == 0)
+        D2D->diag_[step].time = t;
 
+    if (D2D->diag_count_ == DIAG_BATCH)
+        flush_diagnostics(D2D);
+}
 
-    if (rank_ == 0) {
-#if DEBUG
-        printf("t = %lf heat = %lf\n", t, heat);
-#endif
-        D2D->diag_[step].time = t;
-        D2D->diag_[step].heat = heat;
+void finalize(Diffusion2D *D2D)
+{
+#if defined(RMA)
+    if (D2D->win_[0] != MPI_WIN_NULL) {
+        MPI_Win_free(&D2D->win_[0]);
+        MPI_Win_free(&D2D->win_[1]);
     }
+    MPI_Group_free(&D2D->nb_group_);
+#endif
+    free(D2D->rho_);
+    free(D2D->rho_tmp_);
+    free(D2D->diag_);
 }
 
 void write_diagnostics(Diffusion2D *D2D, const char *filename)
@@ -263,6 +388,11 @@ int main(int argc, char* argv[])
         compute_diagnostics(&system, step, dt * step);
 #endif
     }
+#ifndef _PERF_
+    // reduce the last batch
+    flush_diagnostics(&system);
+    complete_diagnostics(&system);
+#endif
     double t1 = MPI_Wtime();
 
     if (rank == 0)
@@ -271,11 +401,16 @@ int main(int argc, char* argv[])
 #ifndef _PERF_
     if (rank == 0) {
         char diagnostics_filename[256];
+#if defined(RMA)
+        sprintf(diagnostics_filename, "diagnostics_mpi_rma_%d.dat", procs);
+#else
         sprintf(diagnostics_filename, "diagnostics_mpi_%d.dat", procs);
+#endif
         write_diagnostics(&system, diagnostics_filename);
     }
 #endif
 
+    finalize(&system);
     MPI_Finalize();
     return 0;
 }
@@ -0,0 +1,544 @@
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+
+/* Communication avoiding version of diffusion2d_mpi_square_nb, with a deep halo : each tile keeps w layers of
+ * ghost cells (including the corners) instead of one. They are exchanged once every w steps, and in between
+ * each rank also updates the part of its ghost region that is still valid, which shrinks by one layer per step.
+ * This redundant work divides the number of messages (and the latency paid) by w.
+ *
+ * The halo width is the optional 6th argument. When it is not given (or 0), it is chosen at startup from the
+ * measured latency and bandwidth of the network and the measured cost of a cell update.
+ */
+
+// largest halo width considered by the automatic choice
+#define MAX_HALO 32
+
+// number of steps whose heat is reduced at once, with a single non-blocking reduction
+#ifndef DIAG_BATCH
+#define DIAG_BATCH 64
+#endif
+
+typedef struct Diagnostics_s
+{
+        double time;
+        double heat;
+} Diagnostics;
+
+typedef struct Diffusion2D_s
+{
+        double D_, L_, T_;
+        int N_, Ntot_, real_N_;
+        double dr_, dt_, fac_;
+        int rank_, procs_;
+        int local_N_, local_M_;         // rows and columns of the tile of this rank
+        int row0_, col0_;               // global index of the row and of the column before the tile
+        MPI_Comm cart_comm_;            // 2D Cartesian grid of the ranks
+        int upper_rank_, below_rank_, left_rank_, right_rank_;
+        int w_;                         // halo width : ghost layers around the tile, and steps between exchanges
+        double *rho_, *rho_tmp_;
+        Diagnostics *diag_;
+        // the local heat of the current batch of steps, and of the batch being reduced (into heat_sum_ on rank 0)
+        double heat_local_[2][DIAG_BATCH], heat_sum_[2][DIAG_BATCH];
+        int diag_buf_, diag_count_, diag_step0_;        // buffer, size and first step of the current batch
+        int pending_count_, pending_step0_;             // size and first step of the batch being reduced
+        MPI_Request diag_req_;
+
+        // persistent halo exchange, one set of requests for each of the two (swapped) density buffers :
+        // the rows first (req[0..3]), then the columns over the full height, which carry the corners (req[4..7])
+        MPI_Datatype row_type_, column_type_;
+        MPI_Request halo_req_[2][8];
+        int cur_;               // set of requests matching the current rho_
+        double comm_time_;      // time spent in the halo exchange
+} Diffusion2D;
+
+void initialize_density(Diffusion2D *D2D)
+{
+        int real_N_ = D2D->real_N_;
+        int local_N_ = D2D->local_N_;
+        int local_M_ = D2D->local_M_;
+        int w_ = D2D->w_;
+        double *rho_ = D2D->rho_;
+        double dr_ = D2D->dr_;
+        double L_ = D2D->L_;
+        int gi, gj;
+
+        /// Initialize rho(x, y, t=0).
+        double bound = 0.25 * L_;
+
+        // the tile starts after w_ ghost rows and columns
+        for (int i = 1; i <= local_N_; ++i) // row traversal loop
+        {
+                // global matrix row index
+                gi = D2D->row0_ + i;
+
+                for (int j = 1; j <= local_M_; ++j) // column traversal loop
+                {
+                        gj = D2D->col0_ + j; // global matrix column index
+
+                        if (fabs((gi - 1) * dr_ - 0.5 * L_) < bound && fabs((gj - 1) * dr_ - 0.5 * L_) < bound)
+                        {
+                                rho_[(i - 1 + w_)*real_N_ + (j - 1 + w_)] = 1;
+                        }
+                        else
+                        {
+                                rho_[(i - 1 + w_)*real_N_ + (j - 1 + w_)] = 0;
+                        }
+                }
+        }
+}
+
+/* Set up the persistent exchange of the w_ deep halo of the buffer rho (rho_ or rho_tmp_) into req.
+ *
+ * The w_ first and last rows of the tile are exchanged with the upper and lower neighbours. The w_ first and
+ * last columns are then exchanged with the left and right neighbours over the full height of the buffer,
+ * ghost rows included, so that the corners come from the diagonal neighbours through them.
+ */
+void init_halo_requests(Diffusion2D *D2D, double *rho, MPI_Request *req)
+{
+        int real_N_ = D2D->real_N_;
+        int local_N_ = D2D->local_N_;
+        int local_M_ = D2D->local_M_;
+        int w_ = D2D->w_;
+        MPI_Comm comm = D2D->cart_comm_;
+
+        MPI_Recv_init(&rho[0*real_N_ + w_], 1, D2D->row_type_, D2D->upper_rank_, 101, comm, &req[0]);
+        MPI_Send_init(&rho[w_*real_N_ + w_], 1, D2D->row_type_, D2D->upper_rank_, 100, comm, &req[1]);
+
+        MPI_Recv_init(&rho[(local_N_ + w_)*real_N_ + w_], 1, D2D->row_type_, D2D->below_rank_, 100, comm, &req[2]);
+        MPI_Send_init(&rho[local_N_*real_N_ + w_], 1, D2D->row_type_, D2D->below_rank_, 101, comm, &req[3]);
+
+        MPI_Recv_init(&rho[local_M_ + w_], 1, D2D->column_type_, D2D->right_rank_, 102, comm, &req[4]);
+        MPI_Send_init(&rho[local_M_], 1, D2D->column_type_, D2D->right_rank_, 103, comm, &req[5]);
+
+        MPI_Recv_init(&rho[0], 1, D2D->column_type_, D2D->left_rank_, 103, comm, &req[6]);
+        MPI_Send_init(&rho[w_], 1, D2D->column_type_, D2D->left_rank_, 102, comm, &req[7]);
+}
+
+/* Choose the halo width which minimizes the modelled time per step
+ *
+ *      t(w) = ( 2 * latency + bytes(w) / bandwidth + cells(w) * t_cell ) / w
+ *
+ * where bytes(w) is the size of the halo of width w sent by a tile (two phases, rows then columns),
+ * and cells(w) the number of cell updates of the w steps between two exchanges, ghost regions included.
+ * The latency and bandwidth are measured with a ping-pong between the first two ranks, and t_cell by
+ * timing sweeps of a tile. All ranks use the values of rank 0 and the largest tile, so they agree on w.
+ */
+int choose_halo_width(Diffusion2D *D2D, int wmax, double *latency, double *bandwidth, double *t_cell)
+{
+        int rank_ = D2D->rank_;
+        MPI_Comm comm = D2D->cart_comm_;
+        int n = D2D->local_N_, m = D2D->local_M_;
+        int tiles[2] = {n, m};
+        MPI_Allreduce(MPI_IN_PLACE, tiles, 2, MPI_INT, MPI_MAX, comm);
+        n = tiles[0];
+        m = tiles[1];
+
+        // ping-pong of a small and a large message between ranks 0 and 1 (after a warm-up round)
+        const int reps = 50;
+        const int big = 1 << 16;
+        double *buf = (double *)calloc(big, sizeof(double));
+        double t[3] = {0.0, 0.0, 0.0};
+        int sizes[3] = {1, 1, big};
+        if (D2D->procs_ > 1 && rank_ < 2)
+        {
+                int other = 1 - rank_;
+                for (int k = 0; k < 3; k++)
+                {
+                        double t0 = MPI_Wtime();
+                        for (int r = 0; r < reps; r++)
+                        {
+                                if (rank_ == 0)
+                                {
+                                        MPI_Send(buf, sizes[k], MPI_DOUBLE, other, 200, comm);
+                                        MPI_Recv(buf, sizes[k], MPI_DOUBLE, other, 200, comm, MPI_STATUS_IGNORE);
+                                }
+                                else
+                                {
+                                        MPI_Recv(buf, sizes[k], MPI_DOUBLE, other, 200, comm, MPI_STATUS_IGNORE);
+                                        MPI_Send(buf, sizes[k], MPI_DOUBLE, other, 200, comm);
+                                }
+                        }
+                        t[k] = (MPI_Wtime() - t0) / (2 * reps);
+                }
+        }
+        free(buf);
+
+        // cost of a cell update, from a few sweeps of a tile
+        int real_m = m + 2;
+        double *a = (double *)calloc((size_t)(n + 2) * real_m, sizeof(double));
+        double *b = (double *)calloc((size_t)(n + 2) * real_m, sizeof(double));
+        double fac_ = D2D->fac_;
+        const int sweeps = 4;
+        double t0 = MPI_Wtime();
+        for (int s = 0; s < sweeps; s++)
+        {
+                for (int i = 1; i <= n; ++i)
+                        for (int j = 1; j <= m; ++j)
+                                b[i*real_m + j] = a[i*real_m + j] + fac_ * (a[i*real_m + j + 1] + a[i*real_m + j - 1]
+                                                + a[(i+1)*real_m + j] + a[(i-1)*real_m + j] - 4.*a[i*real_m + j]);
+                double *tmp = a;
+                a = b;
+                b = tmp;
+        }
+        double tc = (MPI_Wtime() - t0) / sweeps / ((double)n * m);
+        free(a);
+        free(b);
+
+        double params[3];
+        params[0] = t[1];
+        params[1] = (t[2] > t[1]) ? (big - 1) * sizeof(double) / (t[2] - t[1]) : 1e12;
+        params[2] = tc;
+        MPI_Bcast(params, 2, MPI_DOUBLE, 0, comm);
+        MPI_Allreduce(MPI_IN_PLACE, &params[2], 1, MPI_DOUBLE, MPI_MAX, comm);
+        *latency = params[0];
+        *bandwidth = params[1];
+        *t_cell = params[2];
+
+        if (D2D->procs_ == 1)
+                return 1;
+
+        int best = 1;
+        double best_t = 0.0;
+        for (int w = 1; w <= wmax; w++)
+        {
+                double bytes = 2.0 * w * m * sizeof(double) + 2.0 * w * (n + 2 * w) * sizeof(double);
+                double cells = 0.0;
+                for (int s = 1; s <= w; s++)
+                        cells += (double)(n + 2 * (w - s)) * (m + 2 * (w - s));
+                double tw = (2 * (*latency) + bytes / (*bandwidth) + cells * (*t_cell)) / w;
+                if (w == 1 || tw < best_t)
+                {
+                        best = w;
+                        best_t = tw;
+                }
+        }
+        return best;
+}
+
+void init(Diffusion2D *D2D,
+                const double D,
+                const double L,
+                const int N,
+                const int T,
+                const double dt,
+                const int procs,
+                const int w)
+{
+        D2D->D_ = D;
+        D2D->L_ = L;
+        D2D->N_ = N;
+        D2D->T_ = T;
+        D2D->dt_ = dt;
+        D2D->procs_ = procs;
+
+        // Real space grid spacing.
+        D2D->dr_ = D2D->L_ / (D2D->N_ - 1);
+
+        // Stencil factor.
+        D2D->fac_ = D2D->dt_ * D2D->D_ / (D2D->dr_ * D2D->dr_);
+
+        /* Arrange the ranks in a 2D grid, as square as possible for any number of ranks, and allow MPI to
+         * reorder them to match the topology of the machine. The rank of this process is its rank in the grid.
+         */
+        int dims[2] = {0, 0}, periods[2] = {0, 0}, coords[2];
+        MPI_Dims_create(procs, 2, dims);
+        MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 1, &D2D->cart_comm_);
+        MPI_Comm_rank(D2D->cart_comm_, &D2D->rank_);
+        MPI_Cart_coords(D2D->cart_comm_, D2D->rank_, 2, coords);
+
+        // Neighbouring ranks, MPI_PROC_NULL at the boundaries of the domain
+        MPI_Cart_shift(D2D->cart_comm_, 0, 1, &D2D->upper_rank_, &D2D->below_rank_);
+        MPI_Cart_shift(D2D->cart_comm_, 1, 1, &D2D->left_rank_, &D2D->right_rank_);
+
+        if (N < dims[0] || N < dims[1])
+        {
+                if (D2D->rank_ == 0)
+                        printf("N = %d is too small for a %d x %d grid of ranks\n", N, dims[0], dims[1]);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+
+        // Rows and columns of the tile : when N is not divisible by the number of tiles in a direction,
+        // the first N % dims tiles get one more row (column).
+        D2D->local_N_ = N / dims[0] + (coords[0] < N % dims[0] ? 1 : 0);
+        D2D->local_M_ = N / dims[1] + (coords[1] < N % dims[1] ? 1 : 0);
+        D2D->row0_ = coords[0] * (N / dims[0]) + (coords[0] < N % dims[0] ? coords[0] : N % dims[0]);
+        D2D->col0_ = coords[1] * (N / dims[1]) + (coords[1] < N % dims[1] ? coords[1] : N % dims[1]);
+
+        // The halo of a tile must come from its direct neighbours only, so it cannot be wider than the
+        // smallest tile, and there is no point in making it wider than the number of steps.
+        int wmax = (D2D->local_N_ < D2D->local_M_) ? D2D->local_N_ : D2D->local_M_;
+        MPI_Allreduce(MPI_IN_PLACE, &wmax, 1, MPI_INT, MPI_MIN, D2D->cart_comm_);
+        if (wmax > T)
+                wmax = T;
+        if (wmax > MAX_HALO && w <= 0)
+                wmax = MAX_HALO;
+        if (wmax < 1)
+                wmax = 1;
+
+        if (w <= 0)
+        {
+                double latency, bandwidth, t_cell;
+                D2D->w_ = choose_halo_width(D2D, wmax, &latency, &bandwidth, &t_cell);
+                if (D2D->rank_ == 0)
+                        printf("Halo width %d (chosen from latency = %.2lf usec, bandwidth = %.2lf GB/s, cell update = %.2lf nsec)\n",
+                               D2D->w_, latency * 1e6, bandwidth / 1e9, t_cell * 1e9);
+        }
+        else
+        {
+                D2D->w_ = (w < wmax) ? w : wmax;
+                if (D2D->rank_ == 0)
+                        printf("Halo width %d%s\n", D2D->w_, (w > wmax) ? " (reduced to fit the smallest tile)" : "");
+        }
+
+        // Actual dimension of a row (+w_ ghost cells on each side).
+        D2D->real_N_ = D2D->local_M_ + 2 * D2D->w_;
+
+        // Total number of cells inside each tile, ghost cells included
+        D2D->Ntot_ = (D2D->local_N_ + 2 * D2D->w_) * (D2D->local_M_ + 2 * D2D->w_);
+
+        D2D->rho_ = (double *)calloc(D2D->Ntot_, sizeof(double));
+        D2D->rho_tmp_ = (double *)calloc(D2D->Ntot_, sizeof(double));
+        D2D->diag_ = (Diagnostics *)calloc(D2D->T_, sizeof(Diagnostics));
+        D2D->diag_buf_ = 0;
+        D2D->diag_count_ = 0;
+        D2D->pending_count_ = 0;
+        D2D->diag_req_ = MPI_REQUEST_NULL;
+
+        // w_ rows of the tile, and w_ columns of the whole buffer
+        MPI_Type_vector(D2D->w_, D2D->local_M_, D2D->real_N_, MPI_DOUBLE, &D2D->row_type_);
+        MPI_Type_commit(&D2D->row_type_);
+        MPI_Type_vector(D2D->local_N_ + 2 * D2D->w_, D2D->w_, D2D->real_N_, MPI_DOUBLE, &D2D->column_type_);
+        MPI_Type_commit(&D2D->column_type_);
+
+        // the buffers are swapped after each step, so the exchange is set up once for each of them
+        init_halo_requests(D2D, D2D->rho_, D2D->halo_req_[0]);
+        init_halo_requests(D2D, D2D->rho_tmp_, D2D->halo_req_[1]);
+        D2D->cur_ = 0;
+        D2D->comm_time_ = 0.0;
+
+        // Check that the timestep satisfies the restriction for stability.
+        if (D2D->rank_ == 0)
+                printf("timestep from stability condition is %lf\n", D2D->dr_ * D2D->dr_ / (4.0 * D2D->D_));
+
+        initialize_density(D2D);
+}
+
+// fill the w_ deep halo of rho_ (rows first, then the columns with the corners)
+void exchange_halo(Diffusion2D *D2D)
+{
+        MPI_Request *req = D2D->halo_req_[D2D->cur_];
+
+        double tc = MPI_Wtime();
+        MPI_Startall(4, &req[0]);
+        MPI_Waitall(4, &req[0], MPI_STATUSES_IGNORE);
+        MPI_Startall(4, &req[4]);
+        MPI_Waitall(4, &req[4], MPI_STATUSES_IGNORE);
+        D2D->comm_time_ += MPI_Wtime() - tc;
+}
+
+/* Advance one step, ext steps before the next halo exchange : the ghost cells are valid up to ext + 1 layers
+ * away from the tile, so the new values are computed for the tile and ext layers around it. The ghost layers
+ * beyond the boundaries of the domain are never updated (they hold the Dirichlet boundary values).
+ */
+void advance(Diffusion2D *D2D, const int ext)
+{
+        int real_N_ = D2D->real_N_;
+        int local_N_ = D2D->local_N_;
+        int local_M_ = D2D->local_M_;
+        int w_ = D2D->w_;
+        double *rho_ = D2D->rho_;
+        double *rho_tmp_ = D2D->rho_tmp_;
+        double fac_ = D2D->fac_;
+
+        int i0 = w_ - ((D2D->upper_rank_ != MPI_PROC_NULL) ? ext : 0);
+        int i1 = w_ + local_N_ + ((D2D->below_rank_ != MPI_PROC_NULL) ? ext : 0);
+        int j0 = w_ - ((D2D->left_rank_ != MPI_PROC_NULL) ? ext : 0);
+        int j1 = w_ + local_M_ + ((D2D->right_rank_ != MPI_PROC_NULL) ? ext : 0);
+
+        // Central differences in space, forward Euler in time with Dirichlet
+        // boundaries.
+        for (int i = i0; i < i1; ++i)
+        {
+                for (int j = j0; j < j1; ++j)
+                {
+                        rho_tmp_[i*real_N_ + j] = rho_[i*real_N_ + j] +
+                                                fac_
+                                                *
+                                                (
+                                                + rho_[i*real_N_ + (j+1)]
+                                                + rho_[i*real_N_ + (j-1)]
+                                                + rho_[(i+1)*real_N_ + j]
+                                                + rho_[(i-1)*real_N_ + j]
+                                                - 4.*rho_[i*real_N_ + j]
+                                                );
+                }
+        }
+
+        // Swap rho_ with rho_tmp_. This is much more efficient,
+        // because it does not copy element by element, just replaces storage
+        // pointers.
+        double *tmp_ = D2D->rho_tmp_;
+        D2D->rho_tmp_ = D2D->rho_;
+        D2D->rho_ = tmp_;
+        D2D->cur_ = 1 - D2D->cur_;
+}
+
+void finalize(Diffusion2D *D2D)
+{
+        for (int k = 0; k < 2; k++)
+                for (int i = 0; i < 8; i++)
+                        MPI_Request_free(&D2D->halo_req_[k][i]);
+        MPI_Type_free(&D2D->row_type_);
+        MPI_Type_free(&D2D->column_type_);
+        MPI_Comm_free(&D2D->cart_comm_);
+
+        free(D2D->rho_);
+        free(D2D->rho_tmp_);
+        free(D2D->diag_);
+}
+
+// complete the reduction in flight (if any), and store its result in diag_ on rank 0
+void complete_diagnostics(Diffusion2D *D2D)
+{
+        MPI_Wait(&D2D->diag_req_, MPI_STATUS_IGNORE);
+        if (D2D->rank_ == 0)
+        {
+                double *heat_sum = D2D->heat_sum_[1 - D2D->diag_buf_];
+                for (int k = 0; k < D2D->pending_count_; ++k)
+                {
+                        D2D->diag_[D2D->pending_step0_ + k].heat = heat_sum[k];
+                #if DEBUG
+                        printf("t = %lf heat = %lf\n", D2D->diag_[D2D->pending_step0_ + k].time, heat_sum[k]);
+                #endif
+                }
+        }
+        D2D->pending_count_ = 0;
+}
+
+/* Start the reduction of the current batch and switch to the other buffer. The previous reduction is only
+ * completed here, a batch later, so it does not synchronize the ranks at every step.
+ * The MPI library may order the sum of a vector differently than the sum of a single value, so the heat can
+ * differ from a reduction per step in the last bit (not in the diagnostics files, written with %f).
+ */
+void flush_diagnostics(Diffusion2D *D2D)
+{
+        if (D2D->diag_count_ == 0)
+                return;
+        complete_diagnostics(D2D);
+
+        int b = D2D->diag_buf_;
+        MPI_Ireduce(D2D->heat_local_[b], D2D->heat_sum_[b], D2D->diag_count_, MPI_DOUBLE, MPI_SUM, 0,
+                    D2D->cart_comm_, &D2D->diag_req_);
+        D2D->pending_count_ = D2D->diag_count_;
+        D2D->pending_step0_ = D2D->diag_step0_;
+        D2D->diag_buf_ = 1 - b;
+        D2D->diag_count_ = 0;
+}
+
+void compute_diagnostics(Diffusion2D *D2D, const int step, const double t)
+{
+        int real_N_ = D2D->real_N_;
+        int w_ = D2D->w_;
+        double *rho_ = D2D->rho_;
+        double dr_ = D2D->dr_;
+        int rank_ = D2D->rank_;
+
+        double heat = 0.0;
+        for(int i = w_; i < w_ + D2D->local_N_; ++i)
+                for(int j = w_; j < w_ + D2D->local_M_; ++j)
+                        heat += rho_[i*real_N_ + j] * dr_ * dr_;
+
+        // buffer the local heat, it is reduced with the other steps of the batch
+        if (D2D->diag_count_ == 0)
+                D2D->diag_step0_ = step;
+        D2D->heat_local_[D2D->diag_buf_][D2D->diag_count_++] = heat;
+        if (rank_ == 0)
+                D2D->diag_[step].time = t;
+
+        if (D2D->diag_count_ == DIAG_BATCH)
+                flush_diagnostics(D2D);
+}
+
+void write_diagnostics(Diffusion2D *D2D, const char *filename)
+{
+
+        FILE *out_file = fopen(filename, "w");
+        for (int i = 0; i < D2D->T_; i++)
+                fprintf(out_file, "%f\t%f\n", D2D->diag_[i].time, D2D->diag_[i].heat);
+        fclose(out_file);
+}
+
+
+int main(int argc, char* argv[])
+{
+        if (argc < 6)
+        {
+                printf("Usage: %s D L T N dt [halo_width]\n", argv[0]);
+                return 1;
+        }
+
+        int rank, procs;
+        MPI_Init(&argc, &argv); // initialize the MPI enviroment
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &procs);
+
+        const double D = atof(argv[1]);
+        const double L = atoi(argv[2]);
+        const int N = atoi(argv[3]);
+        const int T = atoi(argv[4]);
+        const double dt = atof(argv[5]);
+        const int w = (argc > 6) ? atoi(argv[6]) : 0;   // 0 : automatic choice
+
+        Diffusion2D system;
+
+        init(&system, D, L, N, T, dt, procs, w); // initialize the 2d diffusion system
+        rank = system.rank_; // rank in the Cartesian grid
+        int w_ = system.w_;
+
+        double t0 = MPI_Wtime();
+        for (int step = 0; step < T; step += w_)
+        {
+                // one exchange, then up to w_ steps on the shrinking valid region
+                exchange_halo(&system);
+                for (int s = step; s < step + w_ && s < T; ++s)
+                {
+                        advance(&system, w_ - 1 - (s - step));
+        #ifndef _PERF_
+                        compute_diagnostics(&system, s, dt * s);
+        #endif
+                }
+        }
+        #ifndef _PERF_
+        // reduce the last batch
+        flush_diagnostics(&system);
+        complete_diagnostics(&system);
+        #endif
+        double t1 = MPI_Wtime();
+
+        if (rank == 0)
+                printf("Timing: %d %lf\n", N, t1-t0);
+
+        // per step cost of the halo exchange, averaged and maximum over the ranks
+        double comm_sum, comm_max;
+        MPI_Reduce(&system.comm_time_, &comm_sum, 1, MPI_DOUBLE, MPI_SUM, 0, system.cart_comm_);
+        MPI_Reduce(&system.comm_time_, &comm_max, 1, MPI_DOUBLE, MPI_MAX, 0, system.cart_comm_);
+        if (rank == 0)
+                printf("Communication: %.3lf usec/step (average), %.3lf usec/step (max over ranks), %d exchanges\n",
+                       comm_sum / procs / T * 1e6, comm_max / T * 1e6, (T + w_ - 1) / w_);
+
+        #ifndef _PERF_
+        if (rank == 0)
+        {
+                char diagnostics_filename[256];
+                sprintf(diagnostics_filename, "diagnostics_mpi_deep_%d.dat", procs);
+                write_diagnostics(&system, diagnostics_filename);
+        }
+        #endif
+
+        finalize(&system);
+        MPI_Finalize();
+        return 0;
+}
@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+#include <omp.h>
+
+/* Hybrid MPI + OpenMP version of diffusion2d_mpi_square_nb : each rank updates its tile with a team of
+ * OpenMP threads. The master thread drives the halo exchange (MPI_THREAD_FUNNELED) while the other threads
+ * update the interior of the tile, and it joins them when the exchange is complete. The boundary rows and
+ * columns are updated by the whole team once the ghost cells have arrived.
+ */
+
+// number of steps whose heat is reduced at once, with a single non-blocking reduction
+#ifndef DIAG_BATCH
+#define DIAG_BATCH 64
+#endif
+
+typedef struct Diagnostics_s
+{
+        double time;
+        double heat;
+} Diagnostics;
+
+typedef struct Diffusion2D_s
+{
+        double D_, L_, T_;
+        int N_, Ntot_, real_N_;
+        double dr_, dt_, fac_;
+        int rank_, procs_;
+        int local_N_, local_M_;         // rows and columns of the tile of this rank
+        int row0_, col0_;               // global index of the row and of the column before the tile
+        MPI_Comm cart_comm_;            // 2D Cartesian grid of the ranks
+        int upper_rank_, below_rank_, left_rank_, right_rank_;
+        double *rho_, *rho_tmp_;
+        Diagnostics *diag_;
+        // the local heat of the current batch of steps, and of the batch being reduced (into heat_sum_ on rank 0)
+        double heat_local_[2][DIAG_BATCH], heat_sum_[2][DIAG_BATCH];
+        int diag_buf_, diag_count_, diag_step0_;        // buffer, size and first step of the current batch
+        int pending_count_, pending_step0_;             // size and first step of the batch being reduced
+        MPI_Request diag_req_;
+
+        // persistent halo exchange, one set of requests for each of the two (swapped) density buffers
+        MPI_Datatype column_type_;
+        MPI_Request halo_req_[2][8];
+        int cur_;               // set of requests matching the current rho_
+        double comm_time_;      // time spent by the master thread in the halo exchange
+} Diffusion2D;
+
+void initialize_density(Diffusion2D *D2D)
+{
+        int real_N_ = D2D->real_N_;
+        int local_N_ = D2D->local_N_;
+        int local_M_ = D2D->local_M_;
+        double *rho_ = D2D->rho_;
+        double dr_ = D2D->dr_;
+        double L_ = D2D->L_;
+        int gi, gj;
+
+        /// Initialize rho(x, y, t=0).
+        double bound = 0.25 * L_;
+
+        for (int i = 1; i <= local_N_; ++i) // row traversal loop
+        {
+                // global matrix row index
+                gi = D2D->row0_ + i;
+
+                for (int j = 1; j <= local_M_; ++j) // column traversal loop
+                {
+                        gj = D2D->col0_ + j; // global matrix column index
+
+                        /* initialize each cell of the rho_ matrix, to 0 or 1, depending on its position
+                         * with respect to the area defined by the bound constant
+                         */
+                        if (fabs((gi - 1) * dr_ - 0.5 * L_) < bound && fabs((gj - 1) * dr_ - 0.5 * L_) < bound)
+                        {
+                                rho_[i*real_N_ + j] = 1;
+                        }
+                        else
+                        {
+                                rho_[i*real_N_ + j] = 0;
+                        }
+                }
+        }
+}
+
+/* Set up the persistent halo exchange of the buffer rho (rho_ or rho_tmp_) into req.
+ *
+ * The first and last rows of the tile are contiguous, while its first and last columns are described by
+ * column_type_ (local_N_ doubles with a stride of real_N_), so they are sent and received in place, without
+ * any packing. Missing neighbours are MPI_PROC_NULL, for which the requests complete immediately.
+ * The tags identify the direction of each message, as seen by the sender.
+ */
+void init_halo_requests(Diffusion2D *D2D, double *rho, MPI_Request *req)
+{
+        int real_N_ = D2D->real_N_;
+        int local_N_ = D2D->local_N_;
+        int local_M_ = D2D->local_M_;
+        MPI_Comm comm = D2D->cart_comm_;
+
+        MPI_Recv_init(&rho[0 * real_N_ + 1], local_M_, MPI_DOUBLE, D2D->upper_rank_, 101, comm, &req[0]);
+        MPI_Send_init(&rho[1 * real_N_ + 1], local_M_, MPI_DOUBLE, D2D->upper_rank_, 100, comm, &req[1]);
+
+        MPI_Recv_init(&rho[(local_N_+1)*real_N_ + 1], local_M_, MPI_DOUBLE, D2D->below_rank_, 100, comm, &req[2]);
+        MPI_Send_init(&rho[local_N_*real_N_ + 1], local_M_, MPI_DOUBLE, D2D->below_rank_, 101, comm, &req[3]);
+
+        MPI_Recv_init(&rho[1*real_N_ + local_M_+1], 1, D2D->column_type_, D2D->right_rank_, 102, comm, &req[4]);
+        MPI_Send_init(&rho[1*real_N_ + local_M_], 1, D2D->column_type_, D2D->right_rank_, 103, comm, &req[5]);
+
+        MPI_Recv_init(&rho[1*real_N_ + 0], 1, D2D->column_type_, D2D->left_rank_, 103, comm, &req[6]);
+        MPI_Send_init(&rho[1*real_N_ + 1], 1, D2D->column_type_, D2D->left_rank_, 102, comm, &req[7]);
+}
+
+void init(Diffusion2D *D2D,
+                const double D,
+                const double L,
+                const int N,
+                const int T,
+                const double dt,
+                const int procs)
+{
+        D2D->D_ = D;
+        D2D->L_ = L;
+        D2D->N_ = N;
+        D2D->T_ = T;
+        D2D->dt_ = dt;
+        D2D->procs_ = procs;
+
+        // Real space grid spacing.
+        D2D->dr_ = D2D->L_ / (D2D->N_ - 1);
+
+        // Stencil factor.
+        D2D->fac_ = D2D->dt_ * D2D->D_ / (D2D->dr_ * D2D->dr_);
+
+        /* Arrange the ranks in a 2D grid, as square as possible for any number of ranks, and allow MPI to
+         * reorder them to match the topology of the machine. The rank of this process is its rank in the grid.
+         */
+        int dims[2] = {0, 0}, periods[2] = {0, 0}, coords[2];
+        MPI_Dims_create(procs, 2, dims);
+        MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 1, &D2D->cart_comm_);
+        MPI_Comm_rank(D2D->cart_comm_, &D2D->rank_);
+        MPI_Cart_coords(D2D->cart_comm_, D2D->rank_, 2, coords);
+
+        // Neighbouring ranks, MPI_PROC_NULL at the boundaries of the domain
+        MPI_Cart_shift(D2D->cart_comm_, 0, 1, &D2D->upper_rank_, &D2D->below_rank_);
+        MPI_Cart_shift(D2D->cart_comm_, 1, 1, &D2D->left_rank_, &D2D->right_rank_);
+
+        if (N < dims[0] || N < dims[1])
+        {
+                if (D2D->rank_ == 0)
+                        printf("N = %d is too small for a %d x %d grid of ranks\n", N, dims[0], dims[1]);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+
+        // Rows and columns of the tile : when N is not divisible by the number of tiles in a direction,
+        // the first N % dims tiles get one more row (column).
+        D2D->local_N_ = N / dims[0] + (coords[0] < N % dims[0] ? 1 : 0);
+        D2D->local_M_ = N / dims[1] + (coords[1] < N % dims[1] ? 1 : 0);
+        D2D->row0_ = coords[0] * (N / dims[0]) + (coords[0] < N % dims[0] ? coords[0] : N % dims[0]);
+        D2D->col0_ = coords[1] * (N / dims[1]) + (coords[1] < N % dims[1] ? coords[1] : N % dims[1]);
+
+        // Actual dimension of a row (+2 for the ghost cells). (**num_cols +2**)
+        D2D->real_N_ = D2D->local_M_ + 2;
+
+        // Total number of cells inside each tile
+        D2D->Ntot_ = (D2D->local_N_ + 2) * (D2D->local_M_ + 2);
+
+        D2D->rho_ = (double *)calloc(D2D->Ntot_, sizeof(double));
+        D2D->rho_tmp_ = (double *)calloc(D2D->Ntot_, sizeof(double));
+        D2D->diag_ = (Diagnostics *)calloc(D2D->T_, sizeof(Diagnostics));
+        D2D->diag_buf_ = 0;
+        D2D->diag_count_ = 0;
+        D2D->pending_count_ = 0;
+        D2D->diag_req_ = MPI_REQUEST_NULL;
+
+        // a column of the tile : local_N_ elements, each one a row (real_N_ elements) after the previous one
+        MPI_Type_vector(D2D->local_N_, 1, D2D->real_N_, MPI_DOUBLE, &D2D->column_type_);
+        MPI_Type_commit(&D2D->column_type_);
+
+        // the buffers are swapped after each step, so the exchange is set up once for each of them
+        init_halo_requests(D2D, D2D->rho_, D2D->halo_req_[0]);
+        init_halo_requests(D2D, D2D->rho_tmp_, D2D->halo_req_[1]);
+        D2D->cur_ = 0;
+        D2D->comm_time_ = 0.0;
+
+        // Check that the timestep satisfies the restriction for stability.
+        if (D2D->rank_ == 0)
+                printf("timestep from stability condition is %lf\n", D2D->dr_ * D2D->dr_ / (4.0 * D2D->D_));
+
+        initialize_density(D2D);
+}
+
+// one stencil update, as in the other variants
+#define STENCIL(i, j) \
+        rho_tmp_[(i)*real_N_ + (j)] = rho_[(i)*real_N_ + (j)] + \
+                                fac_ \
+                                * \
+                                ( \
+                                + rho_[(i)*real_N_ + ((j)+1)] \
+                                + rho_[(i)*real_N_ + ((j)-1)] \
+                                + rho_[((i)+1)*real_N_ + (j)] \
+                                + rho_[((i)-1)*real_N_ + (j)] \
+                                - 4.*rho_[(i)*real_N_ + (j)] \
+                                )
+
+void advance(Diffusion2D *D2D)
+{
+        int real_N_ = D2D->real_N_;
+        int local_N_ = D2D->local_N_;
+        int local_M_ = D2D->local_M_;
+        double *rho_ = D2D->rho_;
+        double *rho_tmp_ = D2D->rho_tmp_;
+        double fac_ = D2D->fac_;
+        MPI_Request *req = D2D->halo_req_[D2D->cur_];
+
+        #pragma omp parallel
+        {
+                // *************************************************************************
+                //                              COMMUNICATION PART
+                // *************************************************************************
+
+                // The master thread exchanges ALL necessary ghost cells with neighboring ranks,
+                // and only then joins the computation of the interior (no barrier here).
+                #pragma omp master
+                {
+                        double tc = MPI_Wtime();
+                        MPI_Startall(8, req);
+                        MPI_Waitall(8, req, MPI_STATUSES_IGNORE);
+                        D2D->comm_time_ += MPI_Wtime() - tc;
+                }
+
+                // *************************************************************************
+                //                              COMPUTATION PART
+                // *************************************************************************
+
+                // The interior does not need the ghost cells. The rows are handed out dynamically,
+                // so the threads start without waiting for the master thread, which takes what is left.
+                #pragma omp for schedule(dynamic, 4)
+                for (int i = 2; i < local_N_; ++i)
+                {
+                        for (int j = 2; j < local_M_; ++j)
+                        {
+                                STENCIL(i, j);
+                        }
+                }
+
+                // The implicit barrier above guarantees that the exchange is complete (and visible to all threads).
+                // Update the first and last column of each rank.
+                #pragma omp for nowait
+                for (int i = 1; i <= local_N_; ++i)
+                {
+                        STENCIL(i, 1);
+                        if (local_M_ > 1)
+                                STENCIL(i, local_M_);
+                }
+
+                // Update the first and the last rows of each rank. The corners belong to the columns above,
+                // which may still be updated by other threads (nowait), so they are skipped here.
+                #pragma omp for
+                for (int j = 2; j < local_M_; ++j)
+                {
+                        STENCIL(1, j);
+                        if (local_N_ > 1)
+                                STENCIL(local_N_, j);
+                }
+        }
+
+        // Swap rho_ with rho_tmp_. This is much more efficient,
+        // because it does not copy element by element, just replaces storage
+        // pointers.
+        double *tmp_ = D2D->rho_tmp_;
+        D2D->rho_tmp_ = D2D->rho_;
+        D2D->rho_ = tmp_;
+        D2D->cur_ = 1 - D2D->cur_;
+}
+
+void finalize(Diffusion2D *D2D)
+{
+        for (int k = 0; k < 2; k++)
+                for (int i = 0; i < 8; i++)
+                        MPI_Request_free(&D2D->halo_req_[k][i]);
+        MPI_Type_free(&D2D->column_type_);
+        MPI_Comm_free(&D2D->cart_comm_);
+
+        free(D2D->rho_);
+        free(D2D->rho_tmp_);
+        free(D2D->diag_);
+}
+
+// complete the reduction in flight (if any), and store its result in diag_ on rank 0
+void complete_diagnostics(Diffusion2D *D2D)
+{
+        MPI_Wait(&D2D->diag_req_, MPI_STATUS_IGNORE);
+        if (D2D->rank_ == 0)
+        {
+                double *heat_sum = D2D->heat_sum_[1 - D2D->diag_buf_];
+                for (int k = 0; k < D2D->pending_count_; ++k)
+                {
+                        D2D->diag_[D2D->pending_step0_ + k].heat = heat_sum[k];
+                #if DEBUG
+                        printf("t = %lf heat = %lf\n", D2D->diag_[D2D->pending_step0_ + k].time, heat_sum[k]);
+                #endif
+                }
+        }
+        D2D->pending_count_ = 0;
+}
+
+/* Start the reduction of the current batch and switch to the other buffer. The previous reduction is only
+ * completed here, a batch later, so it does not synchronize the ranks at every step.
+ * The MPI library may order the sum of a vector differently than the sum of a single value, so the heat can
+ * differ from a reduction per step in the last bit (not in the diagnostics files, written with %f).
+ */
+void flush_diagnostics(Diffusion2D *D2D)
+{
+        if (D2D->diag_count_ == 0)
+                return;
+        complete_diagnostics(D2D);
+
+        int b = D2D->diag_buf_;
+        MPI_Ireduce(D2D->heat_local_[b], D2D->heat_sum_[b], D2D->diag_count_, MPI_DOUBLE, MPI_SUM, 0,
+                    D2D->cart_comm_, &D2D->diag_req_);
+        D2D->pending_count_ = D2D->diag_count_;
+        D2D->pending_step0_ = D2D->diag_step0_;
+        D2D->diag_buf_ = 1 - b;
+        D2D->diag_count_ = 0;
+}
+
+void compute_diagnostics(Diffusion2D *D2D, const int step, const double t)
+{
+        int real_N_ = D2D->real_N_;
+        double *rho_ = D2D->rho_;
+        double dr_ = D2D->dr_;
+        int rank_ = D2D->rank_;
+
+        double heat = 0.0;
+        #pragma omp parallel for reduction(+ : heat)
+        for(int i = 1; i <= D2D->local_N_; ++i)
+                for(int j = 1; j <= D2D->local_M_; ++j)
+                        heat += rho_[i*real_N_ + j] * dr_ * dr_;
+
+        // buffer the local heat, it is reduced with the other steps of the batch
+        if (D2D->diag_count_ == 0)
+                D2D->diag_step0_ = step;
+        D2D->heat_local_[D2D->diag_buf_][D2D->diag_count_++] = heat;
+        if (rank_ == 0)
+                D2D->diag_[step].time = t;
+
+        if (D2D->diag_count_ == DIAG_BATCH)
+                flush_diagnostics(D2D);
+}
+
+void write_diagnostics(Diffusion2D *D2D, const char *filename)
+{
+
+        FILE *out_file = fopen(filename, "w");
+        for (int i = 0; i < D2D->T_; i++)
+                fprintf(out_file, "%f\t%f\n", D2D->diag_[i].time, D2D->diag_[i].heat);
+        fclose(out_file);
+}
+
+
+int main(int argc, char* argv[])
+{
+        if (argc < 6)
+        {
+                printf("Usage: %s D L T N dt\n", argv[0]);
+                return 1;
+        }
+
+        int rank, procs, provided;
+        // initialize the MPI enviroment, only the master thread of each rank makes MPI calls
+        MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+        if (provided < MPI_THREAD_FUNNELED)
+        {
+                printf("MPI_THREAD_FUNNELED is not supported by the MPI library\n");
+                MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &procs);
+
+        const double D = atof(argv[1]);
+        const double L = atoi(argv[2]);
+        const int N = atoi(argv[3]);
+        const int T = atoi(argv[4]);
+        const double dt = atof(argv[5]);
+
+        Diffusion2D system;
+
+        init(&system, D, L, N, T, dt, procs); // initialize the 2d diffusion system
+        rank = system.rank_; // rank in the Cartesian grid
+        int nthreads = omp_get_max_threads();
+        if (rank == 0)
+                printf("Running with %d ranks x %d threads\n", procs, nthreads);
+
+        double t0 = MPI_Wtime();        
+        for (int step = 0; step < T; ++step)
+        {
+                advance(&system);
+        #ifndef _PERF_
+                compute_diagnostics(&system, step, dt * step);
+        #endif
+        }
+        #ifndef _PERF_
+        // reduce the last batch
+        flush_diagnostics(&system);
+        complete_diagnostics(&system);
+        #endif
+        double t1 = MPI_Wtime();
+
+        if (rank == 0)
+                printf("Timing: %d %lf\n", N, t1-t0);
+
+        // per step cost of the halo exchange (starting it and waiting for it), averaged and maximum over the ranks
+        double comm_sum, comm_max;
+        MPI_Reduce(&system.comm_time_, &comm_sum, 1, MPI_DOUBLE, MPI_SUM, 0, system.cart_comm_);
+        MPI_Reduce(&system.comm_time_, &comm_max, 1, MPI_DOUBLE, MPI_MAX, 0, system.cart_comm_);
+        if (rank == 0)
+                printf("Communication: %.3lf usec/step (average), %.3lf usec/step (max over ranks), overlapped with the interior\n",
+                       comm_sum / procs / T * 1e6, comm_max / T * 1e6);
+
+        #ifndef _PERF_
+        if (rank == 0)
+        {
+                char diagnostics_filename[256];
+                sprintf(diagnostics_filename, "diagnostics_mpi_hybrid_%d_%d.dat", procs, nthreads);
+                write_diagnostics(&system, diagnostics_filename);
+        }
+        #endif
+
+        finalize(&system);
+        MPI_Finalize();
+        return 0;
+}
@@ -4,7 +4,17 @@
 #include <string.h>
 #include <mpi.h>
 
-
+/* With -DSHM, the ranks running on the same node allocate their rows in an MPI shared memory window, and
+ * read the boundary rows of their on-node neighbours directly from it instead of receiving them. The ranks
+ * publish the number of completed steps in a second shared window (a flag per rank), which their neighbours
+ * check before reading the rows (and before overwriting the rows that were read at the previous step).
+ * Messages are only used for the neighbours running on other nodes.
+ */
+
+// number of steps whose heat is reduced at once, with a single non-blocking reduction
+#ifndef DIAG_BATCH
+#define DIAG_BATCH 64
+#endif
 
 typedef struct Diagnostics_s
 {
@@ -21,6 +31,21 @@ typedef struct Diffusion2D_s
     int local_N_;
     double *rho_, *rho_tmp_;
     Diagnostics *diag_;
+    // the local heat of the current batch of steps, and of the batch being reduced (into heat_sum_ on rank 0)
+    double heat_local_[2][DIAG_BATCH], heat_sum_[2][DIAG_BATCH];
+    int diag_buf_, diag_count_, diag_step0_;        // buffer, size and first step of the current batch
+    int pending_count_, pending_step0_;             // size and first step of the batch being reduced
+    MPI_Request diag_req_;
+#if defined(SHM)
+    MPI_Comm node_comm_;            // ranks sharing the memory of this node
+    MPI_Win win_, flag_win_;        // rho_ and rho_tmp_ of the ranks of the node, and their step counters
+    volatile long *flag_;           // steps completed by this rank
+    volatile long *nb_flag_[2];     // steps completed by the previous and the next rank, NULL if not on this node
+    double *nb_rho_[2];             // rho_ and rho_tmp_ of the previous and the next rank, if on this node
+    int nb_local_N_[2];             // rows of the previous and the next rank
+    int cur_;                       // 0 if rho_ is the first buffer of the window, 1 otherwise
+    long step_;                     // steps completed
+#endif
 } Diffusion2D;
 
 void initialize_density(Diffusion2D *D2D)
@@ -50,6 +75,101 @@ void initialize_density(Diffusion2D *D2D)
     }
 }
 
+#if defined(SHM)
+/* Allocate rho_ and rho_tmp_ in a window shared by the ranks of the node, and find the buffers of the
+ * previous and next ranks if they are on the same node (the ranks swap their buffers in lockstep, so the
+ * current buffer of a neighbour is the one with the same index as ours).
+ */
+void init_shared(Diffusion2D *D2D)
+{
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, D2D->rank_, MPI_INFO_NULL, &D2D->node_comm_);
+
+    // let each rank's part of the window be allocated close to it (e.g. on its NUMA domain)
+    MPI_Info info;
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "alloc_shared_noncontig", "true");
+
+    double *base;
+    MPI_Win_allocate_shared(2 * D2D->Ntot_ * sizeof(double), sizeof(double), info, D2D->node_comm_, &base, &D2D->win_);
+    long *flag;
+    MPI_Win_allocate_shared(sizeof(long), sizeof(long), info, D2D->node_comm_, &flag, &D2D->flag_win_);
+    MPI_Info_free(&info);
+
+    memset(base, 0, 2 * D2D->Ntot_ * sizeof(double));
+    *flag = 0;
+    D2D->rho_ = base;
+    D2D->rho_tmp_ = base + D2D->Ntot_;
+    D2D->flag_ = flag;
+    D2D->cur_ = 0;
+    D2D->step_ = 0;
+
+    // one passive target epoch for the whole run, MPI_Win_sync orders the accesses to the windows
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, D2D->win_);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, D2D->flag_win_);
+
+    MPI_Group world_group, node_group;
+    MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+    MPI_Comm_group(D2D->node_comm_, &node_group);
+
+    int nb[2] = {D2D->rank_ - 1, D2D->rank_ + 1}, node_nb[2];
+    for (int k = 0; k < 2; k++)
+        node_nb[k] = MPI_UNDEFINED;
+    for (int k = 0; k < 2; k++)
+        if (nb[k] >= 0 && nb[k] < D2D->procs_)
+            MPI_Group_translate_ranks(world_group, 1, &nb[k], node_group, &node_nb[k]);
+    MPI_Group_free(&world_group);
+    MPI_Group_free(&node_group);
+
+    for (int k = 0; k < 2; k++) {
+        D2D->nb_rho_[k] = NULL;
+        D2D->nb_flag_[k] = NULL;
+        if (node_nb[k] == MPI_UNDEFINED)
+            continue;
+
+        MPI_Aint size, flag_size;
+        int disp_unit;
+        double *nb_base;
+        long *nb_flag;
+        MPI_Win_shared_query(D2D->win_, node_nb[k], &size, &disp_unit, &nb_base);
+        MPI_Win_shared_query(D2D->flag_win_, node_nb[k], &flag_size, &disp_unit, &nb_flag);
+        D2D->nb_rho_[k] = nb_base;
+        D2D->nb_flag_[k] = nb_flag;
+        // from the decomposition, not from size (which may be rounded up by the allocation)
+        D2D->nb_local_N_[k] = D2D->N_ / D2D->procs_ + (nb[k] == D2D->procs_ - 1 ? D2D->N_ % D2D->procs_ : 0);
+    }
+}
+
+// wait until the on-node neighbours have completed as many steps as this rank
+void wait_neighbours(Diffusion2D *D2D)
+{
+    for (int k = 0; k < 2; k++) {
+        if (D2D->nb_flag_[k] == NULL)
+            continue;
+        while (*D2D->nb_flag_[k] < D2D->step_)
+            MPI_Win_sync(D2D->flag_win_);
+    }
+    MPI_Win_sync(D2D->win_);
+}
+
+// make the new rows visible, then publish the completed step
+void publish_step(Diffusion2D *D2D)
+{
+    MPI_Win_sync(D2D->win_);
+    D2D->step_++;
+    *D2D->flag_ = D2D->step_;
+    MPI_Win_sync(D2D->flag_win_);
+}
+
+void finalize_shared(Diffusion2D *D2D)
+{
+    MPI_Win_unlock_all(D2D->win_);
+    MPI_Win_unlock_all(D2D->flag_win_);
+    MPI_Win_free(&D2D->win_);
+    MPI_Win_free(&D2D->flag_win_);
+    MPI_Comm_free(&D2D->node_comm_);
+}
+#endif
+
 void init(Diffusion2D *D2D,
                 const double D,
                 const double L,
@@ -86,15 +206,30 @@ void init(Diffusion2D *D2D,
     // Total number of cells.
     D2D->Ntot_ = (D2D->local_N_ + 2) * (D2D->N_ + 2);
 
+#if defined(SHM)
+    init_shared(D2D);
+#else
     D2D->rho_ = (double *)calloc(D2D->Ntot_, sizeof(double));
     D2D->rho_tmp_ = (double *)calloc(D2D->Ntot_, sizeof(double));
+#endif
     D2D->diag_ = (Diagnostics *)calloc(D2D->T_, sizeof(Diagnostics));
+    D2D->diag_buf_ = 0;
+    D2D->diag_count_ = 0;
+    D2D->pending_count_ = 0;
+    D2D->diag_req_ = MPI_REQUEST_NULL;
 
     // Check that the timestep satisfies the restriction for stability.
     if (D2D->rank_ == 0)
         printf("timestep from stability condition is %lf\n", D2D->dr_ * D2D->dr_ / (4.0 * D2D->D_));
 
     initialize_density(D2D);
+
+#if defined(SHM)
+    // the neighbours must not read the rows before they are initialized
+    MPI_Win_sync(D2D->win_);
+    MPI_Barrier(D2D->node_comm_);
+    MPI_Win_sync(D2D->win_);
+#endif
 }
 
 void advance(Diffusion2D *D2D)
@@ -114,6 +249,13 @@ void advance(Diffusion2D *D2D)
 
     int prev_rank = rank_ - 1;
     int next_rank = rank_ + 1;
+#if defined(SHM)
+    // the rows of the on-node neighbours are read in place, no message is needed
+    if (D2D->nb_rho_[0] != NULL)
+        prev_rank = -1;
+    if (D2D->nb_rho_[1] != NULL)
+        next_rank = procs_;
+#endif
 
     // Exchange ALL necessary ghost cells with neighboring ranks.
     if (prev_rank >= 0) {
@@ -160,8 +302,22 @@ void advance(Diffusion2D *D2D)
 	// ensure boundaries have arrived
 	MPI_Waitall(4, req, status);
 
+    // The rows above the first row and below the last row : the ghost rows, or (with -DSHM) the
+    // boundary rows of the on-node neighbours, in their current buffers.
+    double *above = &rho_[0*real_N_];
+    double *below = &rho_[(local_N_+1)*real_N_];
+#if defined(SHM)
+    wait_neighbours(D2D);
+    if (D2D->nb_rho_[0] != NULL)
+        above = D2D->nb_rho_[0] + (D2D->cur_ * (D2D->nb_local_N_[0]+2) + D2D->nb_local_N_[0]) * real_N_;
+    if (D2D->nb_rho_[1] != NULL)
+        below = D2D->nb_rho_[1] + (D2D->cur_ * (D2D->nb_local_N_[1]+2) + 1) * real_N_;
+#endif
+
     // Update the first and the last rows of each rank.
-    for (int i = 1; i <= local_N_; i += local_N_- 1) {
+    for (int i = 1; i <= local_N_; i += (local_N_ > 1) ? local_N_- 1 : 1) {
+        double *up = (i == 1) ? above : &rho_[(i-1)*real_N_];
+        double *down = (i == local_N_) ? below : &rho_[(i+1)*real_N_];
         for (int j = 1; j <= N_; ++j) {
             rho_tmp_[i*real_N_ + j] = rho_[i*real_N_ + j] +
                                      fac_
@@ -169,8 +325,8 @@ void advance(Diffusion2D *D2D)
                                      (
                                      + rho_[i*real_N_ + (j+1)]
                                      + rho_[i*real_N_ + (j-1)]
-                                     + rho_[(i+1)*real_N_ + j]
-                                     + rho_[(i-1)*real_N_ + j]
+                                     + down[j]
+                                     + up[j]
                                      - 4.*rho_[i*real_N_ + j]
                                      );
         }
@@ -184,6 +340,46 @@ void advance(Diffusion2D *D2D)
     double *tmp_ = D2D->rho_tmp_;
     D2D->rho_tmp_ = D2D->rho_;
     D2D->rho_ = tmp_;
+#if defined(SHM)
+    D2D->cur_ = 1 - D2D->cur_;
+    publish_step(D2D);
+#endif
+}
+
+// complete the reduction in flight (if any), and store its result in diag_ on rank 0
+void complete_diagnostics(Diffusion2D *D2D)
+{
+    MPI_Wait(&D2D->diag_req_, MPI_STATUS_IGNORE);
+    if (D2D->rank_ == 0) {
+        double *heat_sum = D2D->heat_sum_[1 - D2D->diag_buf_];
+        for (int k = 0; k < D2D->pending_count_; ++k) {
+            D2D->diag_[D2D->pending_step0_ + k].heat = heat_sum[k];
+#if DEBUG
+            printf("t = %lf heat = %lf\n", D2D->diag_[D2D->pending_step0_ + k].time, heat_sum[k]);
+#endif
+        }
+    }
+    D2D->pending_count_ = 0;
+}
+
+/* Start the reduction of the current batch and switch to the other buffer. The previous reduction is only
+ * completed here, a batch later, so it does not synchronize the ranks at every step.
+ * The MPI library may order the sum of a vector differently than the sum of a single value, so the heat can
+ * differ from a reduction per step in the last bit (not in the diagnostics files, written with %f).
+ */
+void flush_diagnostics(Diffusion2D *D2D)
+{
+    if (D2D->diag_count_ == 0)
+        return;
+    complete_diagnostics(D2D);
+
+    int b = D2D->diag_buf_;
+    MPI_Ireduce(D2D->heat_local_[b], D2D->heat_sum_[b], D2D->diag_count_, MPI_DOUBLE, MPI_SUM, 0,
+                MPI_COMM_WORLD, &D2D->diag_req_);
+    D2D->pending_count_ = D2D->diag_count_;
+    D2D->pending_step0_ = D2D->diag_step0_;
+    D2D->diag_buf_ = 1 - b;
+    D2D->diag_count_ = 0;
 }
 
 void compute_diagnostics(Diffusion2D *D2D, const int step, const double t)
@@ -200,17 +396,15 @@ void compute_diagnostics(Diffusion2D *D2D, const int step, const double t)
         for(int j = 1; j <= N_; ++j)
             heat += rho_[i*real_N_ + j] * dr_ * dr_;
 
-    // TODO:MPI, reduce heat (sum)
-    MPI_Reduce(rank_ == 0? MPI_IN_PLACE: &heat, &heat, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD); 
-
-
-    if (rank_ == 0) {
-#if DEBUG
-        printf("t = %lf heat = %lf\n", t, heat);
-#endif
+    // buffer the local heat, it is reduced with the other steps of the batch
+    if (D2D->diag_count_ == 0)
+        D2D->diag_step0_ = step;
+    D2D->heat_local_[D2D->diag_buf_][D2D->diag_count_++] = heat;
+    if (rank_ == 0)
         D2D->diag_[step].time = t;
-        D2D->diag_[step].heat = heat;
-    }
+
+    if (D2D->diag_count_ == DIAG_BATCH)
+        flush_diagnostics(D2D);
 }
 
 void write_diagnostics(Diffusion2D *D2D, const char *filename)
@@ -253,6 +447,11 @@ int main(int argc, char* argv[])
         compute_diagnostics(&system, step, dt * step);
 #endif
     }
+#ifndef _PERF_
+    // reduce the last batch
+    flush_diagnostics(&system);
+    complete_diagnostics(&system);
+#endif
     double t1 = MPI_Wtime();
 
     if (rank == 0)
@@ -261,11 +460,18 @@ int main(int argc, char* argv[])
 #ifndef _PERF_
     if (rank == 0) {
         char diagnostics_filename[256];
+#if defined(SHM)
+        sprintf(diagnostics_filename, "diagnostics_mpi_nb_shm_%d.dat", procs);
+#else
         sprintf(diagnostics_filename, "diagnostics_mpi_nb_%d.dat", procs);
+#endif
         write_diagnostics(&system, diagnostics_filename);
     }
 #endif
 
+#if defined(SHM)
+    finalize_shared(&system);
+#endif
     MPI_Finalize();
     return 0;
 }
@@ -4,6 +4,11 @@
 #include <string.h>
 #include <mpi.h>
 
+// number of steps whose heat is reduced at once, with a single non-blocking reduction
+#ifndef DIAG_BATCH
+#define DIAG_BATCH 64
+#endif
+
 typedef struct Diagnostics_s
 {
         double time;
@@ -16,20 +21,27 @@ typedef struct Diffusion2D_s
         int N_, Ntot_, real_N_;
         double dr_, dt_, fac_;
         int rank_, procs_;
-        int local_N_;
+        int local_N_, local_M_;         // rows and columns of the tile of this rank
+        int row0_, col0_;               // global index of the row and of the column before the tile
+        MPI_Comm cart_comm_;            // 2D Cartesian grid of the ranks
+        int upper_rank_, below_rank_, left_rank_, right_rank_;
         double *rho_, *rho_tmp_;
         Diagnostics *diag_;
+        // the local heat of the current batch of steps, and of the batch being reduced (into heat_sum_ on rank 0)
+        double heat_local_[2][DIAG_BATCH], heat_sum_[2][DIAG_BATCH];
+        int diag_buf_, diag_count_, diag_step0_;        // buffer, size and first step of the current batch
+        int pending_count_, pending_step0_;             // size and first step of the batch being reduced
+        MPI_Request diag_req_;
 } Diffusion2D;
 
 void initialize_density(Diffusion2D *D2D)
 {
         int real_N_ = D2D->real_N_;
         int local_N_ = D2D->local_N_;
+        int local_M_ = D2D->local_M_;
         double *rho_ = D2D->rho_;
         double dr_ = D2D->dr_;
         double L_ = D2D->L_;
-        int rank_ = D2D->rank_;
-        int procs_ = D2D->procs_;
         int gi, gj;
 
         /// Initialize rho(x, y, t=0).
@@ -38,11 +50,11 @@ void initialize_density(Diffusion2D *D2D)
         for (int i = 1; i <= local_N_; ++i) // row traversal loop
         {
                 // global matrix row index
-                gi = floor((double)rank_ / sqrt(procs_)) * local_N_ + i; 
+                gi = D2D->row0_ + i;
 
-                for (int j = 1; j <= local_N_; ++j) // column traversal loop
+                for (int j = 1; j <= local_M_; ++j) // column traversal loop
                 {
-                        gj = ( rank_ % (int)sqrt(procs_) ) * local_N_ + j; // global matrix column index
+                        gj = D2D->col0_ + j; // global matrix column index
 
                         /* initialize each cell of the rho_ matrix, to 0 or 1, depending on its position
                          * with respect to the area defined by the bound constant
@@ -65,7 +77,6 @@ void init(Diffusion2D *D2D,
                 const int N,
                 const int T,
                 const double dt,
-                const int rank,
                 const int procs)
 {
         D2D->D_ = D;
@@ -73,7 +84,6 @@ void init(Diffusion2D *D2D,
         D2D->N_ = N;
         D2D->T_ = T;
         D2D->dt_ = dt;
-        D2D->rank_ = rank;
         D2D->procs_ = procs;
 
         // Real space grid spacing.
@@ -82,18 +92,46 @@ void init(Diffusion2D *D2D,
         // Stencil factor.
         D2D->fac_ = D2D->dt_ * D2D->D_ / (D2D->dr_ * D2D->dr_);
 
-        // Number of rows per process = Number of rows per square tile
-        D2D->local_N_ = D2D->N_ / (int)sqrt(procs);
+        /* Arrange the ranks in a 2D grid, as square as possible for any number of ranks, and allow MPI to
+         * reorder them to match the topology of the machine. The rank of this process is its rank in the grid.
+         */
+        int dims[2] = {0, 0}, periods[2] = {0, 0}, coords[2];
+        MPI_Dims_create(procs, 2, dims);
+        MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 1, &D2D->cart_comm_);
+        MPI_Comm_rank(D2D->cart_comm_, &D2D->rank_);
+        MPI_Cart_coords(D2D->cart_comm_, D2D->rank_, 2, coords);
+
+        // Neighbouring ranks, MPI_PROC_NULL at the boundaries of the domain
+        MPI_Cart_shift(D2D->cart_comm_, 0, 1, &D2D->upper_rank_, &D2D->below_rank_);
+        MPI_Cart_shift(D2D->cart_comm_, 1, 1, &D2D->left_rank_, &D2D->right_rank_);
+
+        if (N < dims[0] || N < dims[1])
+        {
+                if (D2D->rank_ == 0)
+                        printf("N = %d is too small for a %d x %d grid of ranks\n", N, dims[0], dims[1]);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+
+        // Rows and columns of the tile : when N is not divisible by the number of tiles in a direction,
+        // the first N % dims tiles get one more row (column).
+        D2D->local_N_ = N / dims[0] + (coords[0] < N % dims[0] ? 1 : 0);
+        D2D->local_M_ = N / dims[1] + (coords[1] < N % dims[1] ? 1 : 0);
+        D2D->row0_ = coords[0] * (N / dims[0]) + (coords[0] < N % dims[0] ? coords[0] : N % dims[0]);
+        D2D->col0_ = coords[1] * (N / dims[1]) + (coords[1] < N % dims[1] ? coords[1] : N % dims[1]);
 
         // Actual dimension of a row (+2 for the ghost cells). (**num_cols +2**)
-        D2D->real_N_ = D2D->local_N_ + 2;
+        D2D->real_N_ = D2D->local_M_ + 2;
 
-        // Total number of cells inside each square tile
-        D2D->Ntot_ = (D2D->local_N_ + 2) * (D2D->local_N_ + 2);
+        // Total number of cells inside each tile
+        D2D->Ntot_ = (D2D->local_N_ + 2) * (D2D->local_M_ + 2);
 
         D2D->rho_ = (double *)calloc(D2D->Ntot_, sizeof(double));
         D2D->rho_tmp_ = (double *)calloc(D2D->Ntot_, sizeof(double));
         D2D->diag_ = (Diagnostics *)calloc(D2D->T_, sizeof(Diagnostics));
+        D2D->diag_buf_ = 0;
+        D2D->diag_count_ = 0;
+        D2D->pending_count_ = 0;
+        D2D->diag_req_ = MPI_REQUEST_NULL;
 
         // Check that the timestep satisfies the restriction for stability.
         if (D2D->rank_ == 0)
@@ -109,11 +147,11 @@ void init(Diffusion2D *D2D,
  * The 2d rho_ matrix is stored, as a linear array, therefore the rho_ + col_index, actually gives
  * the element rho_[0][col_index].
  * 
- * Each rank (MPI Node) has a K x K square submatrix (with K = local_N_) of the global N x N rho_,
+ * Each rank (MPI Node) has a K x M tile (with K = local_N_ rows and M = local_M_ columns) of the global N x N rho_,
  * but it has two extra columns and two extra rows, which are used as buffers for the data received
  * from the neighbouring ranks.
  * 
- * Therefore, the actual data for each MPI Node, are contained in the (K-2) x (K-2) submatrix of the K x K matrix.
+ * Therefore, the actual data for each MPI Node, are contained in the K x M submatrix of the (K+2) x (M+2) matrix.
  * gather_column_data needs to ignore the first and the last "superficial" rows. So, its for loop starts from row
  * index = 1 to local_N, which is the rows containing the actual data.
  *
@@ -153,23 +191,20 @@ void advance(Diffusion2D *D2D)
 {
         int real_N_ = D2D->real_N_;
         int local_N_ = D2D->local_N_;
+        int local_M_ = D2D->local_M_;
         double *rho_ = D2D->rho_;
         double *rho_tmp_ = D2D->rho_tmp_;
         double fac_ = D2D->fac_;
-        int rank_ = D2D->rank_;
-        int procs_ = D2D->procs_;
+        MPI_Comm comm = D2D->cart_comm_;
 
         MPI_Status status[4];
 
-        // we have sqrt(procs_) square tiles, i.e. sqrt(procs_) MPI nodes
-        int sqrt_procs = (int)sqrt(procs_);
+        // The IDs of each rank's neighbouring ranks, from the Cartesian grid
+        int below_rank = D2D->below_rank_;
+        int upper_rank = D2D->upper_rank_;
 
-        // Compute the IDs for each rank's neighbouring ranks
-        int below_rank = ((rank_ + sqrt_procs) < procs_) ? rank_ + sqrt_procs : MPI_PROC_NULL;
-        int upper_rank = ((rank_ - sqrt_procs) >= 0) ? rank_ - sqrt_procs : MPI_PROC_NULL;
-
-        int right_rank = ( ( ( (rank_ + 1) % sqrt_procs) ) == 0) ? MPI_PROC_NULL : rank_ + 1;
-        int left_rank = ( ( ( rank_ % sqrt_procs) ) == 0 ) ? MPI_PROC_NULL : rank_ - 1;
+        int right_rank = D2D->right_rank_;
+        int left_rank = D2D->left_rank_;
 
         double *data_buf = calloc(local_N_, sizeof(double));        
         double *rcv_buf = calloc(local_N_, sizeof(double));
@@ -181,32 +216,32 @@ void advance(Diffusion2D *D2D)
         // Exchange ALL necessary ghost cells with neighboring ranks.
         if(upper_rank != MPI_PROC_NULL)
         {
-                MPI_Send(&rho_[1*real_N_+1], local_N_, MPI_DOUBLE, upper_rank, 100, MPI_COMM_WORLD);
-                MPI_Recv(&rho_[0*real_N_+1], local_N_, MPI_DOUBLE, upper_rank, 100, MPI_COMM_WORLD, &status[0]);
+                MPI_Send(&rho_[1*real_N_+1], local_M_, MPI_DOUBLE, upper_rank, 100, comm);
+                MPI_Recv(&rho_[0*real_N_+1], local_M_, MPI_DOUBLE, upper_rank, 100, comm, &status[0]);
         }
 
         if(below_rank != MPI_PROC_NULL)
         {
-                MPI_Recv(&rho_[(local_N_+1)*real_N_+1], local_N_, MPI_DOUBLE, below_rank, 100, MPI_COMM_WORLD, &status[1]);
-                MPI_Send(&rho_[local_N_*real_N_+1], local_N_, MPI_DOUBLE, below_rank, 100, MPI_COMM_WORLD);
+                MPI_Recv(&rho_[(local_N_+1)*real_N_+1], local_M_, MPI_DOUBLE, below_rank, 100, comm, &status[1]);
+                MPI_Send(&rho_[local_N_*real_N_+1], local_M_, MPI_DOUBLE, below_rank, 100, comm);
         }
 
         if (right_rank != MPI_PROC_NULL)
         {
-                gather_column_data(D2D, data_buf, local_N_);
-                MPI_Send(data_buf, local_N_, MPI_DOUBLE, right_rank, 100, MPI_COMM_WORLD);
+                gather_column_data(D2D, data_buf, local_M_);
+                MPI_Send(data_buf, local_N_, MPI_DOUBLE, right_rank, 100, comm);
 
-                MPI_Recv(rcv_buf, local_N_, MPI_DOUBLE, right_rank, 100, MPI_COMM_WORLD, &status[2]);
-                scatter_column_data(D2D, rcv_buf, local_N_+1);
+                MPI_Recv(rcv_buf, local_N_, MPI_DOUBLE, right_rank, 100, comm, &status[2]);
+                scatter_column_data(D2D, rcv_buf, local_M_+1);
         }
 
         if (left_rank != MPI_PROC_NULL)
         {
-                MPI_Recv(rcv_buf, local_N_, MPI_DOUBLE, left_rank, 100, MPI_COMM_WORLD, &status[3]);
+                MPI_Recv(rcv_buf, local_N_, MPI_DOUBLE, left_rank, 100, comm, &status[3]);
                 scatter_column_data(D2D, rcv_buf, 0);
 
                 gather_column_data(D2D, data_buf, 1);
-                MPI_Send(data_buf, local_N_, MPI_DOUBLE, left_rank, 100, MPI_COMM_WORLD);
+                MPI_Send(data_buf, local_N_, MPI_DOUBLE, left_rank, 100, comm);
         }
 
         // *************************************************************************
@@ -217,7 +252,7 @@ void advance(Diffusion2D *D2D)
         // boundaries.
         for (int i = 2; i < local_N_; ++i)
         {
-                for (int j = 2; j < local_N_; ++j)
+                for (int j = 2; j < local_M_; ++j)
                 {
                         rho_tmp_[i*real_N_ + j] = rho_[i*real_N_ + j] +
                                                 fac_
@@ -235,7 +270,7 @@ void advance(Diffusion2D *D2D)
         // update first and last column of each rank
         for (int i = 1; i <= local_N_; ++i)
         {
-                for (int j = 1; j <= local_N_; j += local_N_- 1)
+                for (int j = 1; j <= local_M_; j += (local_M_ > 1) ? local_M_ - 1 : 1)
                 {
                         rho_tmp_[i*real_N_ + j] = rho_[i*real_N_ + j] +
                                                 fac_
@@ -251,9 +286,9 @@ void advance(Diffusion2D *D2D)
         }
 
         // Update the first and the last rows of each rank.
-        for (int i = 1; i <= local_N_; i += local_N_- 1)
+        for (int i = 1; i <= local_N_; i += (local_N_ > 1) ? local_N_ - 1 : 1)
         {
-                for (int j = 1; j <= local_N_; ++j)
+                for (int j = 1; j <= local_M_; ++j)
                 {
                         rho_tmp_[i*real_N_ + j] = rho_[i*real_N_ + j] +
                                                 fac_
@@ -280,29 +315,65 @@ void advance(Diffusion2D *D2D)
         free(rcv_buf);
 }
 
+// complete the reduction in flight (if any), and store its result in diag_ on rank 0
+void complete_diagnostics(Diffusion2D *D2D)
+{
+        MPI_Wait(&D2D->diag_req_, MPI_STATUS_IGNORE);
+        if (D2D->rank_ == 0)
+        {
+                double *heat_sum = D2D->heat_sum_[1 - D2D->diag_buf_];
+                for (int k = 0; k < D2D->pending_count_; ++k)
+                {
+                        D2D->diag_[D2D->pending_step0_ + k].heat = heat_sum[k];
+                #if DEBUG
+                        printf("t = %lf heat = %lf\n", D2D->diag_[D2D->pending_step0_ + k].time, heat_sum[k]);
+                #endif
+                }
+        }
+        D2D->pending_count_ = 0;
+}
+
+/* Start the reduction of the current batch and switch to the other buffer. The previous reduction is only
+ * completed here, a batch later, so it does not synchronize the ranks at every step.
+ * The MPI library may order the sum of a vector differently than the sum of a single value, so the heat can
+ * differ from a reduction per step in the last bit (not in the diagnostics files, written with %f).
+ */
+void flush_diagnostics(Diffusion2D *D2D)
+{
+        if (D2D->diag_count_ == 0)
+                return;
+        complete_diagnostics(D2D);
+
+        int b = D2D->diag_buf_;
+        MPI_Ireduce(D2D->heat_local_[b], D2D->heat_sum_[b], D2D->diag_count_, MPI_DOUBLE, MPI_SUM, 0,
+                    D2D->cart_comm_, &D2D->diag_req_);
+        D2D->pending_count_ = D2D->diag_count_;
+        D2D->pending_step0_ = D2D->diag_step0_;
+        D2D->diag_buf_ = 1 - b;
+        D2D->diag_count_ = 0;
+}
+
 void compute_diagnostics(Diffusion2D *D2D, const int step, const double t)
 {
         int real_N_ = D2D->real_N_;
-        int local_N_ = D2D->local_N_;
         double *rho_ = D2D->rho_;
         double dr_ = D2D->dr_;
         int rank_ = D2D->rank_;
 
         double heat = 0.0;
-        for(int i = 1; i <= local_N_; ++i)
-                for(int j = 1; j <= local_N_; ++j)
+        for(int i = 1; i <= D2D->local_N_; ++i)
+                for(int j = 1; j <= D2D->local_M_; ++j)
                         heat += rho_[i*real_N_ + j] * dr_ * dr_;
 
-        MPI_Reduce(rank_ == 0? MPI_IN_PLACE: &heat, &heat, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD); 
-
+        // buffer the local heat, it is reduced with the other steps of the batch
+        if (D2D->diag_count_ == 0)
+                D2D->diag_step0_ = step;
+        D2D->heat_local_[D2D->diag_buf_][D2D->diag_count_++] = heat;
         if (rank_ == 0)
-        {
-        #if DEBUG
-                printf("t = %lf heat = %lf\n", t, heat);
-        #endif
                 D2D->diag_[step].time = t;
-                D2D->diag_[step].heat = heat;
-        }
+
+        if (D2D->diag_count_ == DIAG_BATCH)
+                flush_diagnostics(D2D);
 }
 
 void write_diagnostics(Diffusion2D *D2D, const char *filename)
@@ -336,7 +407,8 @@ int main(int argc, char* argv[])
 
         Diffusion2D system;
 
-        init(&system, D, L, N, T, dt, rank, procs); // initialize the 2d diffusion system
+        init(&system, D, L, N, T, dt, procs); // initialize the 2d diffusion system
+        rank = system.rank_; // rank in the Cartesian grid
 
         double t0 = MPI_Wtime();        
         for (int step = 0; step < T; ++step)
@@ -346,6 +418,11 @@ int main(int argc, char* argv[])
                 compute_diagnostics(&system, step, dt * step);
         #endif
         }
+        #ifndef _PERF_
+        // reduce the last batch
+        flush_diagnostics(&system);
+        complete_diagnostics(&system);
+        #endif
         double t1 = MPI_Wtime();
 
         if (rank == 0)
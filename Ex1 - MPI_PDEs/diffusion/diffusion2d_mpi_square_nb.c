@@ -4,7 +4,20 @@
 #include <string.h>
 #include <mpi.h>
 
-#define _PERF_ 1
+/* With -DSHM, the ranks running on the same node allocate their tiles in an MPI shared memory window, and
+ * read the boundary rows and columns of their on-node neighbours directly from it instead of receiving them.
+ * Each rank publishes the number of completed steps in a second shared window (a flag per rank), which its
+ * neighbours check before reading its boundary (and before overwriting their own boundary cells, which it
+ * read at the previous step). Messages are only used for the neighbours running on other nodes.
+ */
+#if defined(SHM) && defined(NEIGHBOR)
+#error "SHM and NEIGHBOR are alternative halo exchange modes"
+#endif
+
+// number of steps whose heat is reduced at once, with a single non-blocking reduction
+#ifndef DIAG_BATCH
+#define DIAG_BATCH 64
+#endif
 
 typedef struct Diagnostics_s
 {
@@ -18,20 +31,51 @@ typedef struct Diffusion2D_s
         int N_, Ntot_, real_N_;
         double dr_, dt_, fac_;
         int rank_, procs_;
-        int local_N_;
+        int local_N_, local_M_;         // rows and columns of the tile of this rank
+        int row0_, col0_;               // global index of the row and of the column before the tile
+        MPI_Comm cart_comm_;            // 2D Cartesian grid of the ranks
+        int upper_rank_, below_rank_, left_rank_, right_rank_;
         double *rho_, *rho_tmp_;
         Diagnostics *diag_;
+        // the local heat of the current batch of steps, and of the batch being reduced (into heat_sum_ on rank 0)
+        double heat_local_[2][DIAG_BATCH], heat_sum_[2][DIAG_BATCH];
+        int diag_buf_, diag_count_, diag_step0_;        // buffer, size and first step of the current batch
+        int pending_count_, pending_step0_;             // size and first step of the batch being reduced
+        MPI_Request diag_req_;
+
+#if defined(NEIGHBOR)
+        // neighbourhood collective halo exchange : one subarray type per side (upper, below, left, right),
+        // for the cells sent to the neighbour and for the ghost cells received from it
+        MPI_Datatype send_types_[4], recv_types_[4];
+        MPI_Request halo_req_[1];
+#else
+        // persistent halo exchange, one set of requests for each of the two (swapped) density buffers
+        MPI_Datatype column_type_;
+        MPI_Request halo_req_[2][8];
+#endif
+        int cur_;               // set of requests matching the current rho_
+        double comm_time_;      // time spent starting and completing the halo exchange
+#if defined(SHM)
+        MPI_Comm node_comm_;            // ranks sharing the memory of this node
+        MPI_Win win_, flag_win_;        // rho_ and rho_tmp_ of the ranks of the node, and their step counters
+        volatile long *flag_;           // steps completed by this rank
+        long step_;                     // steps completed
+        // upper, below, left and right neighbours on this node (NULL otherwise) : their two buffers,
+        // the size of each buffer, and their step counters
+        double *nb_rho_[4];
+        int nb_Ntot_[4];
+        volatile long *nb_flag_[4];
+#endif
 } Diffusion2D;
 
 void initialize_density(Diffusion2D *D2D)
 {
         int real_N_ = D2D->real_N_;
         int local_N_ = D2D->local_N_;
+        int local_M_ = D2D->local_M_;
         double *rho_ = D2D->rho_;
         double dr_ = D2D->dr_;
         double L_ = D2D->L_;
-        int rank_ = D2D->rank_;
-        int procs_ = D2D->procs_;
         int gi, gj;
 
         /// Initialize rho(x, y, t=0).
@@ -40,11 +84,11 @@ void initialize_density(Diffusion2D *D2D)
         for (int i = 1; i <= local_N_; ++i) // row traversal loop
         {
                 // global matrix row index
-                gi = floor((double)rank_ / sqrt(procs_)) * local_N_ + i; 
+                gi = D2D->row0_ + i;
 
-                for (int j = 1; j <= local_N_; ++j) // column traversal loop
+                for (int j = 1; j <= local_M_; ++j) // column traversal loop
                 {
-                        gj = ( rank_ % (int)sqrt(procs_) ) * local_N_ + j; // global matrix column index
+                        gj = D2D->col0_ + j; // global matrix column index
 
                         /* initialize each cell of the rho_ matrix, to 0 or 1, depending on its position
                          * with respect to the area defined by the bound constant
@@ -61,13 +105,166 @@ void initialize_density(Diffusion2D *D2D)
         }
 }
 
+#if defined(NEIGHBOR)
+/* Set up the subarray types of the neighbourhood collective halo exchange.
+ *
+ * The neighbours of a rank in a 2D Cartesian communicator are ordered as upper, below, left and right
+ * (the negative and positive shifts in dimension 0, then in dimension 1), which is the order of the types.
+ * Each type selects one side of the (local_N_+2) x (local_M_+2) buffer, so the same types describe rho_ and
+ * rho_tmp_, and the send and ghost regions are disjoint. Missing neighbours are MPI_PROC_NULL, whose blocks
+ * are simply skipped by the collective.
+ */
+void init_halo_types(Diffusion2D *D2D)
+{
+        int local_N_ = D2D->local_N_;
+        int local_M_ = D2D->local_M_;
+        int sizes[2] = {local_N_ + 2, local_M_ + 2};
+
+        int row[2] = {1, local_M_};
+        int col[2] = {local_N_, 1};
+        int *subsizes[4] = {row, row, col, col};
+        int send_starts[4][2] = {{1, 1}, {local_N_, 1}, {1, 1}, {1, local_M_}};
+        int recv_starts[4][2] = {{0, 1}, {local_N_ + 1, 1}, {1, 0}, {1, local_M_ + 1}};
+
+        for (int k = 0; k < 4; k++)
+        {
+                MPI_Type_create_subarray(2, sizes, subsizes[k], send_starts[k], MPI_ORDER_C, MPI_DOUBLE, &D2D->send_types_[k]);
+                MPI_Type_commit(&D2D->send_types_[k]);
+                MPI_Type_create_subarray(2, sizes, subsizes[k], recv_starts[k], MPI_ORDER_C, MPI_DOUBLE, &D2D->recv_types_[k]);
+                MPI_Type_commit(&D2D->recv_types_[k]);
+        }
+}
+#else
+/* Set up the persistent halo exchange of the buffer rho (rho_ or rho_tmp_) into req.
+ *
+ * The first and last rows of the tile are contiguous, while its first and last columns are described by
+ * column_type_ (local_N_ doubles with a stride of real_N_), so they are sent and received in place, without
+ * any packing. Missing neighbours are MPI_PROC_NULL, for which the requests complete immediately.
+ * The tags identify the direction of each message, as seen by the sender.
+ */
+void init_halo_requests(Diffusion2D *D2D, double *rho, MPI_Request *req)
+{
+        int real_N_ = D2D->real_N_;
+        int local_N_ = D2D->local_N_;
+        int local_M_ = D2D->local_M_;
+        MPI_Comm comm = D2D->cart_comm_;
+
+        MPI_Recv_init(&rho[0 * real_N_ + 1], local_M_, MPI_DOUBLE, D2D->upper_rank_, 101, comm, &req[0]);
+        MPI_Send_init(&rho[1 * real_N_ + 1], local_M_, MPI_DOUBLE, D2D->upper_rank_, 100, comm, &req[1]);
+
+        MPI_Recv_init(&rho[(local_N_+1)*real_N_ + 1], local_M_, MPI_DOUBLE, D2D->below_rank_, 100, comm, &req[2]);
+        MPI_Send_init(&rho[local_N_*real_N_ + 1], local_M_, MPI_DOUBLE, D2D->below_rank_, 101, comm, &req[3]);
+
+        MPI_Recv_init(&rho[1*real_N_ + local_M_+1], 1, D2D->column_type_, D2D->right_rank_, 102, comm, &req[4]);
+        MPI_Send_init(&rho[1*real_N_ + local_M_], 1, D2D->column_type_, D2D->right_rank_, 103, comm, &req[5]);
+
+        MPI_Recv_init(&rho[1*real_N_ + 0], 1, D2D->column_type_, D2D->left_rank_, 103, comm, &req[6]);
+        MPI_Send_init(&rho[1*real_N_ + 1], 1, D2D->column_type_, D2D->left_rank_, 102, comm, &req[7]);
+}
+#endif
+
+#if defined(SHM)
+/* Allocate rho_ and rho_tmp_ in a window shared by the ranks of the node, and find the buffers of the
+ * neighbours which are on the same node. Those neighbours are then removed from the message exchange.
+ */
+void init_shared(Diffusion2D *D2D)
+{
+        MPI_Comm_split_type(D2D->cart_comm_, MPI_COMM_TYPE_SHARED, D2D->rank_, MPI_INFO_NULL, &D2D->node_comm_);
+
+        // let each rank's part of the window be allocated close to it (e.g. on its NUMA domain)
+        MPI_Info info;
+        MPI_Info_create(&info);
+        MPI_Info_set(info, "alloc_shared_noncontig", "true");
+
+        double *base;
+        MPI_Win_allocate_shared(2 * D2D->Ntot_ * sizeof(double), sizeof(double), info, D2D->node_comm_, &base, &D2D->win_);
+        long *flag;
+        MPI_Win_allocate_shared(sizeof(long), sizeof(long), info, D2D->node_comm_, &flag, &D2D->flag_win_);
+        MPI_Info_free(&info);
+
+        memset(base, 0, 2 * D2D->Ntot_ * sizeof(double));
+        *flag = 0;
+        D2D->rho_ = base;
+        D2D->rho_tmp_ = base + D2D->Ntot_;
+        D2D->flag_ = flag;
+        D2D->step_ = 0;
+
+        // one passive target epoch for the whole run, MPI_Win_sync orders the accesses to the windows
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, D2D->win_);
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, D2D->flag_win_);
+
+        int N = D2D->N_, dims[2], periods[2], coords[2];
+        MPI_Cart_get(D2D->cart_comm_, 2, dims, periods, coords);
+
+        MPI_Group cart_group, node_group;
+        MPI_Comm_group(D2D->cart_comm_, &cart_group);
+        MPI_Comm_group(D2D->node_comm_, &node_group);
+
+        int *nb[4] = {&D2D->upper_rank_, &D2D->below_rank_, &D2D->left_rank_, &D2D->right_rank_};
+        for (int k = 0; k < 4; k++)
+        {
+                D2D->nb_rho_[k] = NULL;
+                D2D->nb_flag_[k] = NULL;
+                if (*nb[k] == MPI_PROC_NULL)
+                        continue;
+
+                int node_rank;
+                MPI_Group_translate_ranks(cart_group, 1, nb[k], node_group, &node_rank);
+                if (node_rank == MPI_UNDEFINED)
+                        continue;
+
+                MPI_Aint size, flag_size;
+                int disp_unit;
+                double *nb_base;
+                long *nb_flag;
+                MPI_Win_shared_query(D2D->win_, node_rank, &size, &disp_unit, &nb_base);
+                MPI_Win_shared_query(D2D->flag_win_, node_rank, &flag_size, &disp_unit, &nb_flag);
+                D2D->nb_rho_[k] = nb_base;
+                D2D->nb_flag_[k] = nb_flag;
+
+                // the size of the neighbour's tile follows from its place in the grid (size may be rounded up)
+                int nb_coords[2];
+                MPI_Cart_coords(D2D->cart_comm_, *nb[k], 2, nb_coords);
+                int nb_N = N / dims[0] + (nb_coords[0] < N % dims[0] ? 1 : 0);
+                int nb_M = N / dims[1] + (nb_coords[1] < N % dims[1] ? 1 : 0);
+                D2D->nb_Ntot_[k] = (nb_N + 2) * (nb_M + 2);
+
+                // read in place, no message
+                *nb[k] = MPI_PROC_NULL;
+        }
+        MPI_Group_free(&cart_group);
+        MPI_Group_free(&node_group);
+}
+
+// wait until the on-node neighbours have completed as many steps as this rank
+void wait_neighbours(Diffusion2D *D2D)
+{
+        for (int k = 0; k < 4; k++)
+        {
+                if (D2D->nb_flag_[k] == NULL)
+                        continue;
+                while (*D2D->nb_flag_[k] < D2D->step_)
+                        MPI_Win_sync(D2D->flag_win_);
+        }
+        MPI_Win_sync(D2D->win_);
+}
+
+// make the new boundary visible, then publish the completed step
+void publish_step(Diffusion2D *D2D)
+{
+        MPI_Win_sync(D2D->win_);
+        D2D->step_++;
+        *D2D->flag_ = D2D->step_;
+        MPI_Win_sync(D2D->flag_win_);
+}
+#endif
+
 void init(Diffusion2D *D2D,
                 const double D,
                 const double L,
                 const int N,
                 const int T,
                 const double dt,
-                const int rank,
                 const int procs)
 {
         D2D->D_ = D;
@@ -75,7 +272,6 @@ void init(Diffusion2D *D2D,
         D2D->N_ = N;
         D2D->T_ = T;
         D2D->dt_ = dt;
-        D2D->rank_ = rank;
         D2D->procs_ = procs;
 
         // Real space grid spacing.
@@ -84,134 +280,110 @@ void init(Diffusion2D *D2D,
         // Stencil factor.
         D2D->fac_ = D2D->dt_ * D2D->D_ / (D2D->dr_ * D2D->dr_);
 
-        // Number of rows per process = Number of rows per square tile
-        D2D->local_N_ = D2D->N_ / (int)sqrt(procs);
+        /* Arrange the ranks in a 2D grid, as square as possible for any number of ranks, and allow MPI to
+         * reorder them to match the topology of the machine. The rank of this process is its rank in the grid.
+         */
+        int dims[2] = {0, 0}, periods[2] = {0, 0}, coords[2];
+        MPI_Dims_create(procs, 2, dims);
+        MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 1, &D2D->cart_comm_);
+        MPI_Comm_rank(D2D->cart_comm_, &D2D->rank_);
+        MPI_Cart_coords(D2D->cart_comm_, D2D->rank_, 2, coords);
+
+        // Neighbouring ranks, MPI_PROC_NULL at the boundaries of the domain
+        MPI_Cart_shift(D2D->cart_comm_, 0, 1, &D2D->upper_rank_, &D2D->below_rank_);
+        MPI_Cart_shift(D2D->cart_comm_, 1, 1, &D2D->left_rank_, &D2D->right_rank_);
+
+        if (N < dims[0] || N < dims[1])
+        {
+                if (D2D->rank_ == 0)
+                        printf("N = %d is too small for a %d x %d grid of ranks\n", N, dims[0], dims[1]);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+
+        // Rows and columns of the tile : when N is not divisible by the number of tiles in a direction,
+        // the first N % dims tiles get one more row (column).
+        D2D->local_N_ = N / dims[0] + (coords[0] < N % dims[0] ? 1 : 0);
+        D2D->local_M_ = N / dims[1] + (coords[1] < N % dims[1] ? 1 : 0);
+        D2D->row0_ = coords[0] * (N / dims[0]) + (coords[0] < N % dims[0] ? coords[0] : N % dims[0]);
+        D2D->col0_ = coords[1] * (N / dims[1]) + (coords[1] < N % dims[1] ? coords[1] : N % dims[1]);
 
         // Actual dimension of a row (+2 for the ghost cells). (**num_cols +2**)
-        D2D->real_N_ = D2D->local_N_ + 2;
+        D2D->real_N_ = D2D->local_M_ + 2;
 
-        // Total number of cells inside each square tile
-        D2D->Ntot_ = (D2D->local_N_ + 2) * (D2D->local_N_ + 2);
+        // Total number of cells inside each tile
+        D2D->Ntot_ = (D2D->local_N_ + 2) * (D2D->local_M_ + 2);
 
+#if defined(SHM)
+        init_shared(D2D);
+#else
         D2D->rho_ = (double *)calloc(D2D->Ntot_, sizeof(double));
         D2D->rho_tmp_ = (double *)calloc(D2D->Ntot_, sizeof(double));
+#endif
         D2D->diag_ = (Diagnostics *)calloc(D2D->T_, sizeof(Diagnostics));
+        D2D->diag_buf_ = 0;
+        D2D->diag_count_ = 0;
+        D2D->pending_count_ = 0;
+        D2D->diag_req_ = MPI_REQUEST_NULL;
+
+#if defined(NEIGHBOR)
+        init_halo_types(D2D);
+        D2D->halo_req_[0] = MPI_REQUEST_NULL;
+#else
+        // a column of the tile : local_N_ elements, each one a row (real_N_ elements) after the previous one
+        MPI_Type_vector(D2D->local_N_, 1, D2D->real_N_, MPI_DOUBLE, &D2D->column_type_);
+        MPI_Type_commit(&D2D->column_type_);
+
+        // the buffers are swapped after each step, so the exchange is set up once for each of them
+        init_halo_requests(D2D, D2D->rho_, D2D->halo_req_[0]);
+        init_halo_requests(D2D, D2D->rho_tmp_, D2D->halo_req_[1]);
+#endif
+        D2D->cur_ = 0;
+        D2D->comm_time_ = 0.0;
 
         // Check that the timestep satisfies the restriction for stability.
         if (D2D->rank_ == 0)
                 printf("timestep from stability condition is %lf\n", D2D->dr_ * D2D->dr_ / (4.0 * D2D->D_));
 
         initialize_density(D2D);
-}
-
-/* Helper function to gather data from a column vector, into the provided buffer (2nd argument).
- * The column index is passed as the 3rd argument. We move to the first element of the column vector
- * using the col_index, as an offset from the first element of the rho_ 2d matrix.
- * 
- * The 2d rho_ matrix is stored, as a linear array, therefore the rho_ + col_index, actually gives
- * the element rho_[0][col_index].
- * 
- * Each rank (MPI Node) has a K x K square submatrix (with K = local_N_) of the global N x N rho_,
- * but it has two extra columns and two extra rows, which are used as buffers for the data received
- * from the neighbouring ranks.
- * 
- * Therefore, the actual data for each MPI Node, are contained in the (K-2) x (K-2) submatrix of the K x K matrix.
- * gather_column_data needs to ignore the first and the last "superficial" rows. So, its for loop starts from row
- * index = 1 to local_N, which is the rows containing the actual data.
- *
- * Each element of the column vector, has an offset of real_N_ from the previous element of the same column. 
- * Thus, we need to make a jump of real_N_, in each new iteration of the for loop. Each element retrieved is stored
- * into the buf buffer.
- */
-void gather_column_data(Diffusion2D *D2D, double *buf, int col_index)
-{
-        int local_N_ = D2D->local_N_;
-        int real_N_ = D2D->real_N_;
-        double *rho_start_elmnt = D2D->rho_ + col_index;
-        
-        for(int i = 1; i <= local_N_; i++)
-        {
-                *(buf + i-1) = *(rho_start_elmnt + (i * real_N_));                                
-        }
-}
 
-/* Similarly, to gather_column_data, scatter_column_data operates on a column vector of the rho_ matrix.
- *
- * The function updates a column vector of the rho_ matrix with the data contained in the buf buffer (2nd argument).
- */
-void scatter_column_data(Diffusion2D *D2D, double *buf, int col_index)
-{
-        int local_N_ = D2D->local_N_;
-        int real_N_ = D2D->real_N_;
-        double *rho_start_elmnt = D2D->rho_ + col_index;
-        
-        for(int i = 1; i <= local_N_; i++)
-        {
-                *(rho_start_elmnt + (i * real_N_)) = *(buf + i-1);
-        }
+#if defined(SHM)
+        // the neighbours must not read the tile before it is initialized
+        MPI_Win_sync(D2D->win_);
+        MPI_Barrier(D2D->node_comm_);
+        MPI_Win_sync(D2D->win_);
+#endif
 }
 
 void advance(Diffusion2D *D2D)
 {
         int real_N_ = D2D->real_N_;
         int local_N_ = D2D->local_N_;
+        int local_M_ = D2D->local_M_;
         double *rho_ = D2D->rho_;
         double *rho_tmp_ = D2D->rho_tmp_;
         double fac_ = D2D->fac_;
-        int rank_ = D2D->rank_;
-        int procs_ = D2D->procs_;
-
-        MPI_Request req[8];
-        MPI_Status status[8];
-
-        // we have sqrt(procs_) square tiles, i.e. sqrt(procs_) MPI nodes
-        int sqrt_procs = (int)sqrt(procs_);
-
-        // Compute the IDs for each rank's neighbouring ranks
-        int below_rank = ((rank_ + sqrt_procs) < procs_) ? rank_ + sqrt_procs : MPI_PROC_NULL;
-        int upper_rank = ((rank_ - sqrt_procs) >= 0) ? rank_ - sqrt_procs : MPI_PROC_NULL;
-
-        int right_rank = ( ( ( (rank_ + 1) % sqrt_procs) ) == 0) ? MPI_PROC_NULL : rank_ + 1;
-        int left_rank = ( ( ( rank_ % sqrt_procs) ) == 0 ) ? MPI_PROC_NULL : rank_ - 1;
-
-        double *data_buf = calloc(local_N_, sizeof(double));        
-        double *rcv_buf = calloc(local_N_, sizeof(double));
-
-        for (int i = 0; i < 8; i++)
-                req[i] = MPI_REQUEST_NULL;
+#if defined(NEIGHBOR)
+        int counts[4] = {1, 1, 1, 1};
+        MPI_Aint displs[4] = {0, 0, 0, 0};
+        MPI_Request *req = D2D->halo_req_;
+#else
+        MPI_Request *req = D2D->halo_req_[D2D->cur_];
+#endif
 
         // *************************************************************************
         //                              COMMUNICATION PART
         // *************************************************************************
 
         // Exchange ALL necessary ghost cells with neighboring ranks.
-        if (upper_rank != MPI_PROC_NULL)
-        {
-                MPI_Irecv(&rho_[0 * real_N_ + 1], local_N_, MPI_DOUBLE, upper_rank, 100, MPI_COMM_WORLD, &req[0]);
-                MPI_Isend(&rho_[1 * real_N_ + 1], local_N_, MPI_DOUBLE, upper_rank, 100, MPI_COMM_WORLD, &req[1]);
-        }
-        
-        if(below_rank != MPI_PROC_NULL)
-        {
-                MPI_Irecv(&rho_[(local_N_+1)*real_N_+1], local_N_, MPI_DOUBLE, below_rank, 100, MPI_COMM_WORLD, &req[2]);
-                MPI_Isend(&rho_[local_N_*real_N_+1], local_N_, MPI_DOUBLE, below_rank, 100, MPI_COMM_WORLD, &req[3]);
-        }
-
-        if (right_rank != MPI_PROC_NULL)
-        {
-                MPI_Irecv(rcv_buf, local_N_, MPI_DOUBLE, right_rank, 100, MPI_COMM_WORLD, &req[4]);
-
-                gather_column_data(D2D, data_buf, local_N_);
-                MPI_Isend(data_buf, local_N_, MPI_DOUBLE, right_rank, 100, MPI_COMM_WORLD, &req[5]);
-        }
-
-        if (left_rank != MPI_PROC_NULL)
-        {
-                MPI_Irecv(rcv_buf, local_N_, MPI_DOUBLE, left_rank, 100, MPI_COMM_WORLD, &req[6]);
-
-                gather_column_data(D2D, data_buf, 1);
-                MPI_Isend(data_buf, local_N_, MPI_DOUBLE, left_rank, 100, MPI_COMM_WORLD, &req[7]);
-        }
+        double tc = MPI_Wtime();
+#if defined(NEIGHBOR)
+        // the whole exchange as a single non-blocking operation, the types locate the sides within rho_
+        MPI_Ineighbor_alltoallw(rho_, counts, displs, D2D->send_types_,
+                                rho_, counts, displs, D2D->recv_types_, D2D->cart_comm_, &req[0]);
+#else
+        MPI_Startall(8, req);
+#endif
+        D2D->comm_time_ += MPI_Wtime() - tc;
 
         // *************************************************************************
         //                              COMPUTATION PART
@@ -221,7 +393,7 @@ void advance(Diffusion2D *D2D)
         // boundaries.
         for (int i = 2; i < local_N_; ++i)
         {
-                for (int j = 2; j < local_N_; ++j)
+                for (int j = 2; j < local_M_; ++j)
                 {
                         rho_tmp_[i*real_N_ + j] = rho_[i*real_N_ + j] +
                                                 fac_
@@ -236,18 +408,69 @@ void advance(Diffusion2D *D2D)
                 }
         }
 
-        // Wait in order to ensure data from neighbouring ranks, have arrived
-        MPI_Waitall(8, req, status);
-        if(status[4].MPI_SOURCE == right_rank)  
-                scatter_column_data(D2D, rcv_buf, local_N_+1);
-        
-        if(status[6].MPI_SOURCE == left_rank)  
-                scatter_column_data(D2D, rcv_buf, 0);
+        // Wait in order to ensure data from neighbouring ranks, have arrived (directly in the ghost cells)
+        tc = MPI_Wtime();
+#if defined(NEIGHBOR)
+        MPI_Wait(&req[0], MPI_STATUS_IGNORE);
+#else
+        MPI_Waitall(8, req, MPI_STATUSES_IGNORE);
+#endif
+        D2D->comm_time_ += MPI_Wtime() - tc;
+
+#if defined(SHM)
+        /* The cells around the tile : the ghost cells, or the boundary rows and columns of the on-node neighbours,
+         * in their current buffers (the ranks swap their buffers in lockstep). The upper and lower neighbours have
+         * the same columns as this tile, the left and right ones the same rows, but their own row length.
+         */
+        int cur_ = D2D->cur_;
+        double *above = &rho_[0*real_N_];
+        double *below = &rho_[(local_N_+1)*real_N_];
+        double *left = &rho_[0];
+        double *right = &rho_[local_M_+1];
+        int left_stride = real_N_, right_stride = real_N_;
+
+        tc = MPI_Wtime();
+        wait_neighbours(D2D);
+        D2D->comm_time_ += MPI_Wtime() - tc;
+        if (D2D->nb_rho_[0] != NULL)
+                above = D2D->nb_rho_[0] + cur_ * D2D->nb_Ntot_[0] + (D2D->nb_Ntot_[0] / real_N_ - 2) * real_N_;
+        if (D2D->nb_rho_[1] != NULL)
+                below = D2D->nb_rho_[1] + cur_ * D2D->nb_Ntot_[1] + 1 * real_N_;
+        if (D2D->nb_rho_[2] != NULL)
+        {
+                left_stride = D2D->nb_Ntot_[2] / (local_N_ + 2);
+                left = D2D->nb_rho_[2] + cur_ * D2D->nb_Ntot_[2] + left_stride - 2;
+        }
+        if (D2D->nb_rho_[3] != NULL)
+        {
+                right_stride = D2D->nb_Ntot_[3] / (local_N_ + 2);
+                right = D2D->nb_rho_[3] + cur_ * D2D->nb_Ntot_[3] + 1;
+        }
 
+        // Update the first and last columns, then the first and last rows (skipping the corners) of each rank,
+        // with the same expression as the interior.
+        for (int i = 1; i <= local_N_; ++i)
+        {
+                int jstep = (i == 1 || i == local_N_ || local_M_ == 1) ? 1 : local_M_ - 1;
+                for (int j = 1; j <= local_M_; j += jstep)
+                {
+                        rho_tmp_[i*real_N_ + j] = rho_[i*real_N_ + j] +
+                                                fac_
+                                                *
+                                                (
+                                                + ((j == local_M_) ? right[i*right_stride] : rho_[i*real_N_ + (j+1)])
+                                                + ((j == 1) ? left[i*left_stride] : rho_[i*real_N_ + (j-1)])
+                                                + ((i == local_N_) ? below[j] : rho_[(i+1)*real_N_ + j])
+                                                + ((i == 1) ? above[j] : rho_[(i-1)*real_N_ + j])
+                                                - 4.*rho_[i*real_N_ + j]
+                                                );
+                }
+        }
+#else
         // update first and last column of each rank
         for (int i = 1; i <= local_N_; ++i)
         {
-                for (int j = 1; j <= local_N_; j += local_N_- 1)
+                for (int j = 1; j <= local_M_; j += (local_M_ > 1) ? local_M_ - 1 : 1)
                 {
                         rho_tmp_[i*real_N_ + j] = rho_[i*real_N_ + j] +
                                                 fac_
@@ -263,9 +486,9 @@ void advance(Diffusion2D *D2D)
         }
 
         // Update the first and the last rows of each rank.
-        for (int i = 1; i <= local_N_; i += local_N_- 1)
+        for (int i = 1; i <= local_N_; i += (local_N_ > 1) ? local_N_ - 1 : 1)
         {
-                for (int j = 1; j <= local_N_; ++j)
+                for (int j = 1; j <= local_M_; ++j)
                 {
                         rho_tmp_[i*real_N_ + j] = rho_[i*real_N_ + j] +
                                                 fac_
@@ -280,41 +503,107 @@ void advance(Diffusion2D *D2D)
                 }
         }
 
+#endif
+
         // Swap rho_ with rho_tmp_. This is much more efficient,
         // because it does not copy element by element, just replaces storage
         // pointers.
         double *tmp_ = D2D->rho_tmp_;
         D2D->rho_tmp_ = D2D->rho_;
         D2D->rho_ = tmp_;
+        D2D->cur_ = 1 - D2D->cur_;
+#if defined(SHM)
+        publish_step(D2D);
+#endif
+}
+
+void finalize(Diffusion2D *D2D)
+{
+#if defined(NEIGHBOR)
+        for (int k = 0; k < 4; k++)
+        {
+                MPI_Type_free(&D2D->send_types_[k]);
+                MPI_Type_free(&D2D->recv_types_[k]);
+        }
+#else
+        for (int k = 0; k < 2; k++)
+                for (int i = 0; i < 8; i++)
+                        MPI_Request_free(&D2D->halo_req_[k][i]);
+        MPI_Type_free(&D2D->column_type_);
+#endif
+#if defined(SHM)
+        MPI_Win_unlock_all(D2D->win_);
+        MPI_Win_unlock_all(D2D->flag_win_);
+        MPI_Win_free(&D2D->win_);
+        MPI_Win_free(&D2D->flag_win_);
+        MPI_Comm_free(&D2D->node_comm_);
+#else
+        free(D2D->rho_);
+        free(D2D->rho_tmp_);
+#endif
+        MPI_Comm_free(&D2D->cart_comm_);
+        free(D2D->diag_);
+}
+
+// complete the reduction in flight (if any), and store its result in diag_ on rank 0
+void complete_diagnostics(Diffusion2D *D2D)
+{
+        MPI_Wait(&D2D->diag_req_, MPI_STATUS_IGNORE);
+        if (D2D->rank_ == 0)
+        {
+                double *heat_sum = D2D->heat_sum_[1 - D2D->diag_buf_];
+                for (int k = 0; k < D2D->pending_count_; ++k)
+                {
+                        D2D->diag_[D2D->pending_step0_ + k].heat = heat_sum[k];
+                #if DEBUG
+                        printf("t = %lf heat = %lf\n", D2D->diag_[D2D->pending_step0_ + k].time, heat_sum[k]);
+                #endif
+                }
+        }
+        D2D->pending_count_ = 0;
+}
 
-        // free the dynamically allocated buffers
-        free(data_buf);
-        free(rcv_buf);
+/* Start the reduction of the current batch and switch to the other buffer. The previous reduction is only
+ * completed here, a batch later, so it does not synchronize the ranks at every step.
+ * The MPI library may order the sum of a vector differently than the sum of a single value, so the heat can
+ * differ from a reduction per step in the last bit (not in the diagnostics files, written with %f).
+ */
+void flush_diagnostics(Diffusion2D *D2D)
+{
+        if (D2D->diag_count_ == 0)
+                return;
+        complete_diagnostics(D2D);
+
+        int b = D2D->diag_buf_;
+        MPI_Ireduce(D2D->heat_local_[b], D2D->heat_sum_[b], D2D->diag_count_, MPI_DOUBLE, MPI_SUM, 0,
+                    D2D->cart_comm_, &D2D->diag_req_);
+        D2D->pending_count_ = D2D->diag_count_;
+        D2D->pending_step0_ = D2D->diag_step0_;
+        D2D->diag_buf_ = 1 - b;
+        D2D->diag_count_ = 0;
 }
 
 void compute_diagnostics(Diffusion2D *D2D, const int step, const double t)
 {
         int real_N_ = D2D->real_N_;
-        int local_N_ = D2D->local_N_;
         double *rho_ = D2D->rho_;
         double dr_ = D2D->dr_;
         int rank_ = D2D->rank_;
 
         double heat = 0.0;
-        for(int i = 1; i <= local_N_; ++i)
-                for(int j = 1; j <= local_N_; ++j)
+        for(int i = 1; i <= D2D->local_N_; ++i)
+                for(int j = 1; j <= D2D->local_M_; ++j)
                         heat += rho_[i*real_N_ + j] * dr_ * dr_;
 
-        MPI_Reduce(rank_ == 0? MPI_IN_PLACE: &heat, &heat, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD); 
-
+        // buffer the local heat, it is reduced with the other steps of the batch
+        if (D2D->diag_count_ == 0)
+                D2D->diag_step0_ = step;
+        D2D->heat_local_[D2D->diag_buf_][D2D->diag_count_++] = heat;
         if (rank_ == 0)
-        {
-        #if DEBUG
-                printf("t = %lf heat = %lf\n", t, heat);
-        #endif
                 D2D->diag_[step].time = t;
-                D2D->diag_[step].heat = heat;
-        }
+
+        if (D2D->diag_count_ == DIAG_BATCH)
+                flush_diagnostics(D2D);
 }
 
 void write_diagnostics(Diffusion2D *D2D, const char *filename)
@@ -348,7 +637,8 @@ int main(int argc, char* argv[])
 
         Diffusion2D system;
 
-        init(&system, D, L, N, T, dt, rank, procs); // initialize the 2d diffusion system
+        init(&system, D, L, N, T, dt, procs); // initialize the 2d diffusion system
+        rank = system.rank_; // rank in the Cartesian grid
 
         double t0 = MPI_Wtime();        
         for (int step = 0; step < T; ++step)
@@ -358,20 +648,40 @@ int main(int argc, char* argv[])
                 compute_diagnostics(&system, step, dt * step);
         #endif
         }
+        #ifndef _PERF_
+        // reduce the last batch
+        flush_diagnostics(&system);
+        complete_diagnostics(&system);
+        #endif
         double t1 = MPI_Wtime();
 
         if (rank == 0)
                 printf("Timing: %d %lf\n", N, t1-t0);
 
+        // per step cost of the halo exchange (starting it and waiting for it), averaged and maximum over the ranks
+        double comm_sum, comm_max;
+        MPI_Reduce(&system.comm_time_, &comm_sum, 1, MPI_DOUBLE, MPI_SUM, 0, system.cart_comm_);
+        MPI_Reduce(&system.comm_time_, &comm_max, 1, MPI_DOUBLE, MPI_MAX, 0, system.cart_comm_);
+        if (rank == 0)
+                printf("Communication: %.3lf usec/step (average), %.3lf usec/step (max over ranks)\n",
+                       comm_sum / procs / T * 1e6, comm_max / T * 1e6);
+
         #ifndef _PERF_
         if (rank == 0)
         {
                 char diagnostics_filename[256];
+        #if defined(NEIGHBOR)
+                sprintf(diagnostics_filename, "diagnostics_mpi_square_nb_neighbor_%d.dat", procs);
+        #elif defined(SHM)
+                sprintf(diagnostics_filename, "diagnostics_mpi_square_nb_shm_%d.dat", procs);
+        #else
                 sprintf(diagnostics_filename, "diagnostics_mpi_square_nb_%d.dat", procs);
+        #endif
                 write_diagnostics(&system, diagnostics_filename);
         }
         #endif
 
+        finalize(&system);
         MPI_Finalize();
         return 0;
 }
@@ -89,29 +89,59 @@ void init(Diffusion2D *D2D,
         initialize_density(D2D);
 }
 
-void advance(Diffusion2D *D2D)
+/* Advance one time step. If heat is not NULL, the heat integral of the new density is also computed
+ * during the sweep (fused with the stencil, as a parallel reduction), so the grid is not read again.
+ * The order of the sum depends on the number of threads, so the heat can differ from the serial sum
+ * by rounding (not in the diagnostics files, written with %f).
+ */
+void advance(Diffusion2D *D2D, double *heat)
 {
         int N_ = D2D->N_;
         int real_N_ = D2D->real_N_;
         double *rho_ = D2D->rho_;
         double *rho_tmp_ = D2D->rho_tmp_;
         double fac_ = D2D->fac_;
+        double dr_ = D2D->dr_;
 
         // Central differences in space, forward Euler in time with Dirichlet
         // boundaries.
-        #pragma omp parallel for
-        for (int i = 1; i <= N_; ++i)
+        if (heat == NULL)
         {
-                for (int j = 1; j <= N_; ++j)
+                #pragma omp parallel for
+                for (int i = 1; i <= N_; ++i)
+                {
+                        for (int j = 1; j <= N_; ++j)
+                        {
+                                rho_tmp_[i * real_N_ + j] =
+                                        rho_[i * real_N_ + j]
+                                        + fac_ * (rho_[i * real_N_ + (j + 1)]
+                                                + rho_[i * real_N_ + (j - 1)]
+                                                + rho_[(i + 1) * real_N_ + j]
+                                                + rho_[(i - 1) * real_N_ + j]
+                                                - 4.0 * rho_[i * real_N_ + j]);
+                        }
+                }
+        }
+        else
+        {
+                double h = 0.0;
+                #pragma omp parallel for reduction(+ : h)
+                for (int i = 1; i <= N_; ++i)
                 {
-                        rho_tmp_[i * real_N_ + j] =
-                                rho_[i * real_N_ + j]
-                                + fac_ * (rho_[i * real_N_ + (j + 1)]
-                                        + rho_[i * real_N_ + (j - 1)]
-                                        + rho_[(i + 1) * real_N_ + j]
-                                        + rho_[(i - 1) * real_N_ + j]
-                                        - 4.0 * rho_[i * real_N_ + j]);
+                        for (int j = 1; j <= N_; ++j)
+                        {
+                                double r =
+                                        rho_[i * real_N_ + j]
+                                        + fac_ * (rho_[i * real_N_ + (j + 1)]
+                                                + rho_[i * real_N_ + (j - 1)]
+                                                + rho_[(i + 1) * real_N_ + j]
+                                                + rho_[(i - 1) * real_N_ + j]
+                                                - 4.0 * rho_[i * real_N_ + j]);
+                                rho_tmp_[i * real_N_ + j] = r;
+                                h += dr_ * dr_ * r;
+                        }
                 }
+                *heat = h;
         }
 
         // Swap rho_ with rho_tmp_. This is much more efficient,
@@ -122,18 +152,133 @@ void advance(Diffusion2D *D2D)
         D2D->rho_ = tmp_;
 }
 
-void compute_diagnostics(Diffusion2D *D2D, const int step, const double t)
+// Side of the (square) tiles of the temporally blocked advance, excluding their halo.
+#ifndef TILE_SIZE
+#define TILE_SIZE 128
+#endif
+
+/* Advance nsteps time steps at once (temporal blocking), producing exactly the same values as
+ * nsteps calls of advance().
+ *
+ * The grid is split into TILE_SIZE x TILE_SIZE tiles, processed in parallel. Each tile copies its
+ * cells plus a halo of nsteps cells into two small local buffers, which stay in the cache, and
+ * advances them nsteps times. Every step shrinks the valid region by one cell on each side (an
+ * overlapped, or trapezoid, tile), so after nsteps steps exactly the tile's own cells are valid and
+ * are written back. The halo cells are also computed by the neighbouring tiles (redundant work),
+ * but the tiles are independent, so the grid is read and written once per nsteps steps instead of
+ * once per step.
+ *
+ * If heat is not NULL, heat[s] receives the diagnostic of step s + 1 (summed tile by tile).
+ */
+void advance_blocked(Diffusion2D *D2D, const int nsteps, double *heat)
 {
         int N_ = D2D->N_;
         int real_N_ = D2D->real_N_;
         double *rho_ = D2D->rho_;
+        double *rho_tmp_ = D2D->rho_tmp_;
+        double fac_ = D2D->fac_;
         double dr_ = D2D->dr_;
 
-        double heat = 0.0;
-        for (int i = 1; i <= N_; ++i)
-                for (int j = 1; j <= N_; ++j)
-                        heat += dr_ * dr_ * rho_[i * real_N_ + j];
+        int ntiles_ = (N_ + TILE_SIZE - 1) / TILE_SIZE;
+        int buf_N_ = TILE_SIZE + 2 * nsteps;
+        double *tile_heat_ = NULL;
+        if (heat != NULL)
+                tile_heat_ = (double *)calloc((size_t)ntiles_ * ntiles_ * nsteps, sizeof(double));
+
+        #pragma omp parallel
+        {
+                double *src_ = (double *)malloc((size_t)buf_N_ * buf_N_ * sizeof(double));
+                double *dst_ = (double *)malloc((size_t)buf_N_ * buf_N_ * sizeof(double));
 
+                #pragma omp for collapse(2) schedule(static)
+                for (int ti = 0; ti < ntiles_; ++ti)
+                {
+                        for (int tj = 0; tj < ntiles_; ++tj)
+                        {
+                                // interior cells [i0, i1) x [j0, j1) of the tile
+                                int i0 = 1 + ti * TILE_SIZE, i1 = (i0 + TILE_SIZE <= N_ + 1) ? i0 + TILE_SIZE : N_ + 1;
+                                int j0 = 1 + tj * TILE_SIZE, j1 = (j0 + TILE_SIZE <= N_ + 1) ? j0 + TILE_SIZE : N_ + 1;
+
+                                // cells of the tile and its halo (including the ghost cells) in the local buffers
+                                int bi0 = (i0 - nsteps > 0) ? i0 - nsteps : 0, bi1 = (i1 + nsteps < N_ + 2) ? i1 + nsteps : N_ + 2;
+                                int bj0 = (j0 - nsteps > 0) ? j0 - nsteps : 0, bj1 = (j1 + nsteps < N_ + 2) ? j1 + nsteps : N_ + 2;
+                                int bN_ = bj1 - bj0;
+
+                                // both buffers get the ghost cells, which never change
+                                for (int i = bi0; i < bi1; ++i)
+                                {
+                                        memcpy(&src_[(i - bi0) * bN_], &rho_[i * real_N_ + bj0], bN_ * sizeof(double));
+                                        memcpy(&dst_[(i - bi0) * bN_], &rho_[i * real_N_ + bj0], bN_ * sizeof(double));
+                                }
+
+                                for (int s = 1; s <= nsteps; ++s)
+                                {
+                                        // region that is still valid after s steps
+                                        int r = nsteps - s;
+                                        int si0 = (i0 - r > 1) ? i0 - r : 1, si1 = (i1 + r < N_ + 1) ? i1 + r : N_ + 1;
+                                        int sj0 = (j0 - r > 1) ? j0 - r : 1, sj1 = (j1 + r < N_ + 1) ? j1 + r : N_ + 1;
+
+                                        for (int i = si0; i < si1; ++i)
+                                        {
+                                                double *in_ = &src_[(i - bi0) * bN_ - bj0];
+                                                double *out_ = &dst_[(i - bi0) * bN_ - bj0];
+                                                // same expression as advance(), so the results are bitwise equal
+                                                for (int j = sj0; j < sj1; ++j)
+                                                {
+                                                        out_[j] =
+                                                                in_[j]
+                                                                + fac_ * (in_[j + 1]
+                                                                        + in_[j - 1]
+                                                                        + in_[j + bN_]
+                                                                        + in_[j - bN_]
+                                                                        - 4.0 * in_[j]);
+                                                }
+                                        }
+
+                                        if (tile_heat_ != NULL)
+                                        {
+                                                double h = 0.0;
+                                                for (int i = i0; i < i1; ++i)
+                                                        for (int j = j0; j < j1; ++j)
+                                                                h += dr_ * dr_ * dst_[(i - bi0) * bN_ + (j - bj0)];
+                                                tile_heat_[((size_t)ti * ntiles_ + tj) * nsteps + (s - 1)] = h;
+                                        }
+
+                                        double *tmp_ = src_;
+                                        src_ = dst_;
+                                        dst_ = tmp_;
+                                }
+
+                                // write back the cells of the tile, which are valid after nsteps steps
+                                for (int i = i0; i < i1; ++i)
+                                        memcpy(&rho_tmp_[i * real_N_ + j0], &src_[(i - bi0) * bN_ + (j0 - bj0)], (j1 - j0) * sizeof(double));
+                        }
+                }
+
+                free(src_);
+                free(dst_);
+        }
+
+        // sum the heat of the tiles in a fixed order, so that it does not depend on the number of threads
+        if (heat != NULL)
+        {
+                for (int s = 0; s < nsteps; ++s)
+                {
+                        heat[s] = 0.0;
+                        for (int t = 0; t < ntiles_ * ntiles_; ++t)
+                                heat[s] += tile_heat_[(size_t)t * nsteps + s];
+                }
+                free(tile_heat_);
+        }
+
+        double *tmp_ = D2D->rho_tmp_;
+        D2D->rho_tmp_ = D2D->rho_;
+        D2D->rho_ = tmp_;
+}
+
+// store the heat of a time step, as computed by advance() or advance_blocked()
+void compute_diagnostics(Diffusion2D *D2D, const int step, const double t, const double heat)
+{
         #if DEBUG
         printf("t = %lf heat = %lf\n", t, heat);
         #endif
@@ -141,11 +286,12 @@ void compute_diagnostics(Diffusion2D *D2D, const int step, const double t)
         D2D->diag_[step].heat = heat;
 }
 
-void write_diagnostics(Diffusion2D *D2D, const char *filename)
+// write the diagnostics of every diag_every-th time step (the only ones computed)
+void write_diagnostics(Diffusion2D *D2D, const char *filename, const int diag_every)
 {
 
         FILE *out_file = fopen(filename, "w");
-        for (int i = 0; i < D2D->T_; i++)
+        for (int i = 0; i < D2D->T_; i += diag_every)
                 fprintf(out_file, "%f\t%f\n", D2D->diag_[i].time, D2D->diag_[i].heat);
         fclose(out_file);
 }
@@ -170,7 +316,7 @@ int main(int argc, char* argv[])
 {
         if (argc < 6)
         {
-                printf("Usage: %s D L T N dt\n", argv[0]);
+                printf("Usage: %s D L T N dt [time_block] [diag_every]\n", argv[0]);
                 return 1;
         }
 
@@ -187,22 +333,58 @@ int main(int argc, char* argv[])
         const int N = atoi(argv[3]);		// NxN grid (N=1024)
         const int T = atoi(argv[4]);		// number of timesteps (T=1000)
         const double dt = atof(argv[5]);	// dt = 0.00000001
+        const int nb = (argc > 6) ? atoi(argv[6]) : 1;	// time steps per tile (1 = one sweep per step)
+        #ifndef _PERF_
+        const int diag_every = (argc > 7 && atoi(argv[7]) > 0) ? atoi(argv[7]) : 1;	// diagnostics every K steps
+        #endif
 
         Diffusion2D system;
 
         init(&system, D, L, N, T, dt, 0);
 
         double t0 = omp_get_wtime();
-        for (int step = 0; step < T; ++step)
+        if (nb <= 1)
         {
-                advance(&system);
-                #ifndef _PERF_
-                        compute_diagnostics(&system, step, dt * step);
-                #endif
+                for (int step = 0; step < T; ++step)
+                {
+                        #ifndef _PERF_
+                        if (step % diag_every == 0)
+                        {
+                                double heat;
+                                advance(&system, &heat);
+                                compute_diagnostics(&system, step, dt * step, heat);
+                        }
+                        else
+                        #endif
+                                advance(&system, NULL);
+                }
+        }
+        else
+        {
+                double *heat = (double *)malloc(nb * sizeof(double));
+                for (int step = 0; step < T; step += nb)
+                {
+                        int nsteps = (step + nb <= T) ? nb : T - step;
+                        #ifndef _PERF_
+                        // first step of the block with diagnostics
+                        int first = (step + diag_every - 1) / diag_every * diag_every;
+                        if (first < step + nsteps)
+                        {
+                                advance_blocked(&system, nsteps, heat);
+                                for (int s = first; s < step + nsteps; s += diag_every)
+                                        compute_diagnostics(&system, s, dt * s, heat[s - step]);
+                        }
+                        else
+                        #endif
+                                advance_blocked(&system, nsteps, NULL);
+                }
+                free(heat);
         }
         double t1 = omp_get_wtime();
 
         printf("Timing: %d %lf\n", N, t1-t0);
+        // effective lattice updates per second (the redundant updates of the tile halos are not counted)
+        printf("Performance: %.3f GLUP/s (time_block = %d)\n", (double)N * N * T / (t1 - t0) / 1e9, nb > 1 ? nb : 1);
 
         #ifndef _PERF_
                 char diagnostics_filename[256];
@@ -211,7 +393,7 @@ int main(int argc, char* argv[])
         #else
                 sprintf(diagnostics_filename, "diagnostics_openmp_%d.dat", nthreads);
         #endif
-                write_diagnostics(&system, diagnostics_filename);
+                write_diagnostics(&system, diagnostics_filename, diag_every);
         #endif
 
         return 0;
@@ -0,0 +1,89 @@
+#!/bin/bash
+# Benchmark driver for the kNN variants.
+# Sweeps the problem sizes (DIM/KNN/TRA/QUE) and the number of threads (OpenMP variants) or ranks (MPI variants),
+# rebuilding the executables for every problem size, since the sizes are compile-time constants.
+# Every configuration runs WARMUP untimed trials and TRIALS timed ones. The timings are taken from the
+# BENCH record that every variant prints (see print_bench_record in func.h), so all variants share the same
+# timing semantics, and they are summarized into one CSV line per configuration.
+# The record only has the total time of a trial (the queries are processed block by block over the training
+# set, so they have no individual latency) : the per-query columns are per-trial averages, i.e. the time of
+# the median and of the slowest trial divided by the number of queries.
+# The executables are built in a scratch copy of the sources, so the binaries of this directory are left alone.
+#
+# Usage: ./bench.sh > results.csv
+# Every parameter may be overridden from the environment, e.g.
+#	DIMS="16 64" THREADS="1 2 4 8" ENGINES="myknn_simd myknn_omp_simd" ./bench.sh > results.csv
+
+DIMS=${DIMS:-"16"}
+KNNS=${KNNS:-"32"}
+TRAS=${TRAS:-"1048576"}
+QUES=${QUES:-"1024"}
+THREADS=${THREADS:-"1 2 4"}
+RANKS=${RANKS:-"1 2 4"}
+ENGINES=${ENGINES:-"myknn myknn_simd myknn_omp myknn_omp_simd myknn_mpi myknn_mpi_simd"}
+TRIALS=${TRIALS:-5}
+WARMUP=${WARMUP:-1}
+MPIRUN=${MPIRUN:-"mpirun"}
+BUILDDIR=$(mktemp -d)
+trap 'rm -rf $BUILDDIR' EXIT
+if [ -z "$DATADIR" ]; then
+	DATADIR=$(mktemp -d)
+	trap 'rm -rf $BUILDDIR $DATADIR' EXIT
+fi
+
+SRCDIR=$(cd "$(dirname "$0")" && pwd)
+cp "$SRCDIR"/Makefile "$SRCDIR"/*.c "$SRCDIR"/*.h "$SRCDIR"/*.cu "$BUILDDIR"
+cd "$BUILDDIR"
+
+# median, p95 (nearest rank) and maximum of the numbers read from stdin
+percentiles() {
+	sort -g | awk '{ v[NR] = $1 } END { m = int((NR + 1) / 2); p = int(0.95 * NR + 0.999999); if (p < 1) p = 1; print v[m], v[p], v[NR] }'
+}
+
+# run a single trial and print the t_total of its BENCH record
+run_trial() {
+	local engine=$1 workers=$2
+	case $engine in
+	*mpi*) $MPIRUN -n $workers ./$engine $DATADIR/train.bin $DATADIR/query.bin ;;
+	*omp*) OMP_NUM_THREADS=$workers ./$engine $DATADIR/train.bin $DATADIR/query.bin ;;
+	*)     ./$engine $DATADIR/train.bin $DATADIR/query.bin ;;
+	esac | awk -F, '/^BENCH,/ { print $8 }'
+}
+
+echo "engine,dim,knn,tra,que,workers,trials,median_s,p95_s,median_s_per_query,max_trial_s_per_query,queries_per_s,dist_evals_per_s,effective_GBps"
+
+for dim in $DIMS; do
+for knn in $KNNS; do
+for tra in $TRAS; do
+for que in $QUES; do
+	make clean > /dev/null
+	make gendata $ENGINES DIM=$dim KNN=$knn TRA=$tra QUE=$que > /dev/null 2>&1 || { echo "build failed for DIM=$dim KNN=$knn TRA=$tra QUE=$que" >&2; exit 1; }
+	./gendata $DATADIR/train.bin $DATADIR/query.bin > /dev/null
+
+	for engine in $ENGINES; do
+		case $engine in
+		*mpi*) workers_list=$RANKS ;;
+		*omp*) workers_list=$THREADS ;;
+		*)     workers_list=1 ;;
+		esac
+
+		for workers in $workers_list; do
+			for ((t = 0; t < WARMUP; t++)); do
+				run_trial $engine $workers > /dev/null
+			done
+
+			times=$(for ((t = 0; t < TRIALS; t++)); do run_trial $engine $workers; done)
+			read median p95 max <<< "$(echo "$times" | percentiles)"
+
+			# the time per query averages a whole trial, the throughput metrics use the median trial
+			awk -v e=$engine -v d=$dim -v k=$knn -v n=$tra -v q=$que -v w=$workers -v r=$TRIALS -v m=$median -v p=$p95 -v x=$max 'BEGIN {
+				printf "%s,%d,%d,%d,%d,%d,%d,%.6f,%.6f,%.4e,%.4e,%.1f,%.4e,%.3f\n",
+					e, d, k, n, q, w, r, m, p, m / q, x / q, q / m, n * q / m,
+					n * q * d * 8 / m / 1e9
+			}'
+		done
+	done
+done
+done
+done
+done
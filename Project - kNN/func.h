@@ -9,21 +9,140 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
 // struct that will preserve the k nearest neighbors for each query.
 // Will be used in order to load training data in a blocking fashion,
 // iterating over all query points. Thus for each query point we will
 // need to preserve the k nearest neighbors that have been found so far
 // in the preceding blocks.
+// The struct only points to the query's slices of the query buffers (see query_buffers_t).
 typedef struct query_s
 {
 	double *x; 		// Query's coordinate
-	int nn_idx[NNBS]; 	// The index (< TRAINELEMS) of the k nearest neighbors
-	double nn_dist[NNBS]; 	// The distance between the query point and each one of the k nearest neighbors
-	double nn_val[NNBS];
+	int *nn_idx; 		// The index (< TRAINELEMS) of the k nearest neighbors
+	double *nn_dist; 	// The distance between the query point and each one of the k nearest neighbors
+	double *nn_val;
 } query_t;
 
+// Row stride (in doubles) of the query coordinates.
+// Rounded up to a multiple of 4 so that every row stays 32-byte aligned in SIMD mode.
+#define QX_STRIDE (((PROBDIM + 3) / 4) * 4)
+
+// Strides of the k nearest neighbor state of each query, rounded up so that every query's slice starts on a 64-byte cache line
+#define NN_STRIDE (((NNBS + 7) / 8) * 8)		// doubles
+#define NN_IDX_STRIDE (((NNBS + 15) / 16) * 16)	// ints
+
+/* Structure-of-arrays storage of a set of queries, allocated once : the coordinates, the neighbor indices,
+ * the neighbor distances and the neighbor values of all the queries are stored in separate contiguous arrays.
+ * Threads that update the neighbors of different queries never share a cache line, and the state of a range
+ * of consecutive queries is contiguous, so it can be sent with plain MPI messages.
+ */
+typedef struct query_buffers_s
+{
+	int n;
+	double *x;		// n * QX_STRIDE (NULL if the queries have no coordinates of their own)
+	int *nn_idx;		// n * NN_IDX_STRIDE
+	double *nn_dist;	// n * NN_STRIDE
+	double *nn_val;		// n * NN_STRIDE
+	void *mem;
+} query_buffers_t;
+
+/* In PRUNE and LBFILTER modes the scan compares squared distances, so nn_dist holds the squared distance
+ * between the query point and each one of its neighbors.
+ */
+
+// Counters of the work performed by the kNN scan, used to quantify the savings of the pruned scan
+typedef struct knn_stats_s
+{
+	long long dist_evals;	// number of candidates whose distance was (even partially) evaluated
+	long long dims_touched;	// number of dimensions summed, over all evaluated candidates
+	long long lb_rejects;	// number of candidates rejected by the lower bound, without evaluating their distance
+	long long topk_inserts;	// number of candidates inserted into the k nearest neighbors (i.e. replacing the k-th one)
+} knn_stats_t;
+
+// number of principal axes used by the summary of each point in LBFILTER mode
+#ifndef NPROJ
+#define NPROJ 2
+#endif
+
+// size of each point's summary : its NPROJ projections and the norm of its residual (i.e. what the projections do not capture)
+#define SUMM_SIZE (NPROJ + 1)
+
+/* Summaries of the training elements, used to filter the candidates of the kNN scan with a cheap lower bound of their distance.
+ * Each point x is centered (x' = x - center) and split into its projections onto the NPROJ principal axes of the
+ * training set and the residual r = x' - sum_j <x', u_j> u_j. Since the axes are orthonormal,
+ *	|x - q|^2 = sum_j (<x', u_j> - <q', u_j>)^2 + |r_x - r_q|^2 >= sum_j (<x', u_j> - <q', u_j>)^2 + (|r_x| - |r_q|)^2 ,
+ * which only needs the SUMM_SIZE summary values of the two points.
+ */
+typedef struct knn_summary_s
+{
+	double center[PROBDIM];		// mean of the training elements
+	double axes[NPROJ][PROBDIM];	// orthonormal principal axes of the training elements
+	double tol;			// absolute slack of the lower bound, that covers its rounding errors
+	double *xsumm;			// SUMM_SIZE values per training element, stored next to the training matrix
+} knn_summary_t;
+
+// reset the k nearest neighbors of a query, before the first training block is scanned
+void reset_query(query_t *q)
+{
+	for (int j = 0; j < NNBS; j++)
+		q->nn_idx[j] = -1;
+
+	for (int j = 0; j < NNBS; j++)
+		q->nn_dist[j] = 1e99 - j;
+
+	for (int j = 0; j < NNBS; j++)
+		q->nn_val[j] = -1;
+}
+
+// allocation of the large kNN buffers, from the arena of knn_pages_init if there is one (see below)
+void *knn_alloc(size_t size, size_t align);
+void knn_free(void *p);
+
+/* Allocate the buffers of n queries, in a single cache-line-aligned allocation, and point each queries[i] to its slices.
+ * with_x == 0 skips the coordinates, for queries whose x is set to point elsewhere (e.g. to the training elements).
+ */
+void alloc_query_buffers(query_buffers_t *qb, query_t *queries, int n, int with_x)
+{
+	size_t x_size = with_x ? (size_t)n * QX_STRIDE * sizeof(double) : 0;
+	size_t idx_size = (size_t)n * NN_IDX_STRIDE * sizeof(int);
+	size_t dist_size = (size_t)n * NN_STRIDE * sizeof(double);
+
+	// every size is a multiple of 64 bytes (apart from x_size, which is rounded up), so all the arrays are aligned
+	x_size = (x_size + 63) & ~(size_t)63;
+	qb->mem = knn_alloc(x_size + idx_size + 2 * dist_size, 64);
+
+	char *p = (char *)qb->mem;
+	qb->n = n;
+	qb->x = with_x ? (double *)p : NULL;
+	qb->nn_idx = (int *)(p + x_size);
+	qb->nn_dist = (double *)(p + x_size + idx_size);
+	qb->nn_val = (double *)(p + x_size + idx_size + dist_size);
+
+	for (int i = 0; i < n; i++)
+	{
+		queries[i].x = with_x ? &qb->x[(size_t)i * QX_STRIDE] : NULL;
+		queries[i].nn_idx = &qb->nn_idx[(size_t)i * NN_IDX_STRIDE];
+		queries[i].nn_dist = &qb->nn_dist[(size_t)i * NN_STRIDE];
+		queries[i].nn_val = &qb->nn_val[(size_t)i * NN_STRIDE];
+		if (with_x)
+			for (int k = 0; k < QX_STRIDE; k++)
+				queries[i].x[k] = 0.0;
+		reset_query(&queries[i]);
+	}
+}
+
+void free_query_buffers(query_buffers_t *qb)
+{
+	knn_free(qb->mem);
+	qb->mem = NULL;
+}
+
 /* I/O routines */
 void store_binary_data(char *filename, double *data, int n)
 {
@@ -52,26 +171,15 @@ void load_binary_data(const char *filename, double *data, query_t *queries, cons
 	assert(nelems == n); // check that all elements were actually read
 	fclose(fp);
 
-	// If queries are loaded, initialize the queries structs
+	// If queries are loaded, copy their coordinates into the query buffers (see alloc_query_buffers) and initialize them
 	if (queries != NULL)
 	{
 		for (int i = 0; i < QUERYELEMS; i++)
 		{
 			for (int k = 0; k < PROBDIM; k++)
-		#if defined(SIMD)
 				queries[i].x[k] = data[i * (PROBDIM + 1) + k];
-		#else
-				queries[i].x = &data[i * (PROBDIM + 1)];
-		#endif
-
-			for (int j = 0; j < NNBS; j++)
-				queries[i].nn_idx[j] = -1;
-
-			for (int j = 0; j < NNBS; j++)
-				queries[i].nn_dist[j] = 1e99 - j;
 
-			for (int j = 0; j < NNBS; j++)
-				queries[i].nn_val[j] = -1;
+			reset_query(&queries[i]);
 		}
 	}
 }
@@ -83,6 +191,67 @@ void copy_to_aligned(double *mem, double **aligned_data, const int mem_row_size,
 			aligned_data[i][j] = mem[i*mem_row_size + j];
 }
 
+/* Binary results file : one fixed-size record per query, in query order, so the record of query i
+ * starts at byte offset i * KNN_RECORD_SIZE. Each record is packed (no padding, native byte order) :
+ * 	int idx[NNBS]		(indices of the k nearest neighbors, sorted by increasing distance)
+ * 	double dist[NNBS]	(their euclidean distances)
+ * 	double pred		(the predicted value of the query)
+ */
+#define KNN_RECORD_SIZE (NNBS * (sizeof(int) + sizeof(double)) + sizeof(double))
+
+/* The k nearest neighbors are not kept sorted by the scan : order[j] is set to the position of the j-th
+ * nearest neighbor of q (insertion sort, k is small, and stable, so ties keep their position order).
+ */
+void sort_neighbors(query_t *q, int *order)
+{
+	for (int j = 0; j < NNBS; j++)
+	{
+		int m = j;
+		while (m > 0 && q->nn_dist[order[m - 1]] > q->nn_dist[j])
+		{
+			order[m] = order[m - 1];
+			m--;
+		}
+		order[m] = j;
+	}
+}
+
+// Pack the k nearest neighbors of q and its predicted value yp into the record rec (of KNN_RECORD_SIZE bytes)
+void pack_knn_record(query_t *q, double yp, char *rec)
+{
+	int order[NNBS], idx[NNBS];
+	double dist[NNBS];
+
+	sort_neighbors(q, order);
+
+	for (int j = 0; j < NNBS; j++)
+	{
+		idx[j] = q->nn_idx[order[j]];
+#if defined(PRUNE) || defined(LBFILTER)
+		dist[j] = sqrt(q->nn_dist[order[j]]); // nn_dist holds squared distances in these modes
+#else
+		dist[j] = q->nn_dist[order[j]];
+#endif
+	}
+
+	memcpy(rec, idx, NNBS * sizeof(int));
+	memcpy(rec + NNBS * sizeof(int), dist, NNBS * sizeof(double));
+	memcpy(rec + NNBS * (sizeof(int) + sizeof(double)), &yp, sizeof(double));
+}
+
+void store_knn_results(const char *filename, char *records, int n)
+{
+	FILE *fp = fopen(filename, "wb");
+	if (fp == NULL)
+	{
+		printf("fopen(%s, \"wb\") FAILED!\n", filename);
+		exit(1);
+	}
+	size_t nelems = fwrite(records, KNN_RECORD_SIZE, n, fp);
+	assert(nelems == n); // check that all records were actually written
+	fclose(fp);
+}
+
 double read_nextnum(FILE *fp)
 {
 	double val;
@@ -117,33 +286,68 @@ double gettime()
 	return (double) (tv.tv_sec+tv.tv_usec/1000000.0);
 }
 
-/* Function to approximate */
-double fitfun(double *x, int n)
+/* Print the machine-readable benchmark record of a run, parsed by bench.sh :
+ * 	BENCH,<engine>,<PROBDIM>,<NNBS>,<TRAINELEMS>,<QUERYELEMS>,<workers>,<t_total>
+ * The engine is the name of the executable (i.e. the variant) and workers is the number of threads or ranks.
+ * All variants use the same timing semantics for t_total : the wall clock time from the start of the
+ * neighbor search, after all the input data have been loaded, until the values of all the queries have been
+ * predicted (for MPI, the maximum over all ranks). The first query is not treated differently.
+ */
+void print_bench_record(const char *exe, int nworkers, double t_total)
+{
+	const char *engine = strrchr(exe, '/');
+	engine = (engine == NULL) ? exe : engine + 1;
+	printf("BENCH,%s,%d,%d,%d,%d,%d,%.9f\n", engine, PROBDIM, NNBS, TRAINELEMS, QUERYELEMS, nworkers, t_total);
+}
+
+/* Functions to approximate */
+enum { FITFUN_CIRCLE, FITFUN_HIMMELBLAU, FITFUN_ROSENBROCK, FITFUN_RASTRIGIN, FITFUN_COUNT };
+
+const char *fitfun_names[FITFUN_COUNT] = {"circle", "himmelblau", "rosenbrock", "rastrigin"};
+
+// returns the id of the function with the given name, or -1 if there is no such function
+int fitfun_from_name(const char *name)
+{
+	for (int id = 0; id < FITFUN_COUNT; id++)
+		if (strcmp(name, fitfun_names[id]) == 0)
+			return id;
+	return -1;
+}
+
+double fitfun_id(double *x, int n, int id)
 {
 	double f = 0.0;
 	int i;
 
-#if 1
-	for(i=0; i<n; i++)	/* circle */
-		f += x[i]*x[i];
-#endif
-#if 0
-	for(i=0; i<n-1; i++) {	/*  himmelblau */
-		f = f + pow((x[i]*x[i]+x[i+1]-11.0),2) + pow((x[i]+x[i+1]*x[i+1]-7.0),2);
+	switch (id) {
+	case FITFUN_CIRCLE:
+		for(i=0; i<n; i++)	/* circle */
+			f += x[i]*x[i];
+		break;
+	case FITFUN_HIMMELBLAU:
+		for(i=0; i<n-1; i++) {	/*  himmelblau */
+			f = f + pow((x[i]*x[i]+x[i+1]-11.0),2) + pow((x[i]+x[i+1]*x[i+1]-7.0),2);
+		}
+		break;
+	case FITFUN_ROSENBROCK:
+		for (i=0; i<n-1; i++)   /* rosenbrock */
+			f = f + 100.0*pow((x[i+1]-x[i]*x[i]),2) + pow((x[i]-1.0),2);
+		break;
+	case FITFUN_RASTRIGIN:
+		for (i=0; i<n; i++)     /* rastrigin */
+			f = f + pow(x[i],2) + 10.0 - 10.0*cos(2*M_PI*x[i]);
+		break;
 	}
-#endif
-#if 0
-	for (i=0; i<n-1; i++)   /* rosenbrock */
-		f = f + 100.0*pow((x[i+1]-x[i]*x[i]),2) + pow((x[i]-1.0),2);
-#endif
-#if 0
-	for (i=0; i<n; i++)     /* rastrigin */
-		f = f + pow(x[i],2) + 10.0 - 10.0*cos(2*M_PI*x[i]);
-#endif
 
 	return f;
 }
 
+/* Function to approximate */
+double fitfun(double *x, int n)
+{
+	return fitfun_id(x, n, FITFUN_CIRCLE);
+}
+
 
 /* random number generator  */
 #define SEED_RAND()     srand48(1)
@@ -161,6 +365,64 @@ double get_rand(int k)
 	return (UB-LB)*URAND()+LB;
 }
 
+/* Counter-based random number generator (Philox4x32-10, Salmon et al., "Parallel random numbers: as easy as 1, 2, 3", SC'11).
+ * Each random number is a pure function of a counter and a key, so that any part of a random sequence can be
+ * generated independently of the rest, e.g. by different threads, and always yields the same numbers.
+ */
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+void philox4x32_10(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4])
+{
+	uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+	uint32_t k0 = key[0], k1 = key[1];
+
+	for (int round = 0; round < 10; round++)
+	{
+		uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+		uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+		uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+		uint32_t n1 = (uint32_t)p1;
+		uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+		uint32_t n3 = (uint32_t)p0;
+		c0 = n0; c1 = n1; c2 = n2; c3 = n3;
+
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+	out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+// uniform double in [0, 1), using 53 random bits
+double philox_uniform(uint32_t hi, uint32_t lo)
+{
+	return ((hi >> 5) * 67108864.0 + (lo >> 6)) * (1.0 / 9007199254740992.0);
+}
+
+/* Fill x[0 .. n-1] with the coordinates of row `row` of the random stream `stream`, uniformly drawn from [LB, UB).
+ * The coordinates only depend on (seed, stream, row), and not on the order in which the rows are generated.
+ */
+void get_rand_row(uint32_t seed, uint32_t stream, uint64_t row, double *x, int n)
+{
+	uint32_t key[2] = {seed, stream};
+	uint32_t ctr[4], out[4];
+
+	for (int k = 0; k < n; k += 2)
+	{
+		ctr[0] = k / 2;
+		ctr[1] = (uint32_t)row;
+		ctr[2] = (uint32_t)(row >> 32);
+		ctr[3] = 0;
+		philox4x32_10(ctr, key, out);
+
+		x[k] = (UB-LB)*philox_uniform(out[0], out[1])+LB;
+		if (k + 1 < n)
+			x[k + 1] = (UB-LB)*philox_uniform(out[2], out[3])+LB;
+	}
+}
+
 
 /* utils */
 double compute_min(double *v, int n)
@@ -229,7 +491,8 @@ double compute_var(double *v, int n, double mean)
 }
 
 
-double compute_dist(double *v, double *w, int n)
+// squared euclidean distance between v and w
+double compute_dist_sq(double *v, double *w, int n)
 {
 #if defined (SIMD)
 	__builtin_assume_aligned(v, 32);
@@ -279,7 +542,7 @@ double compute_dist(double *v, double *w, int n)
 
 	sum_value += sum;
 
-	return sqrt(sum_value);
+	return sum_value;
 #else
 	int i;
 	double s = 0.0;
@@ -287,8 +550,243 @@ double compute_dist(double *v, double *w, int n)
 		s+= pow(v[i]-w[i],2);
 	}
 
-	return sqrt(s);
+	return s;
+#endif
+}
+
+double compute_dist(double *v, double *w, int n)
+{
+	return sqrt(compute_dist_sq(v, w, n));
+}
+
+// Number of dimensions accumulated between two checks of the pruned distance against its bound
+// (a multiple of 4, i.e. of the SIMD register width) : half of the dimensions, but at most 16, since checking
+// after every single register costs more than it saves in high dimension. At least two checks are made per
+// candidate, so that the evaluation can be abandoned before all the dimensions are summed.
+#ifndef PRUNE_CHECK
+#if PROBDIM >= 32
+#define PRUNE_CHECK 16
+#elif PROBDIM >= 8
+#define PRUNE_CHECK (PROBDIM / 2 / 4 * 4)
+#else
+#define PRUNE_CHECK 4
+#endif
+#endif
+
+/* Squared euclidean distance with early abandoning : the evaluation stops as soon as the
+ * running sum reaches bound, since the candidate can no longer enter the k nearest neighbors.
+ * The running sum is checked after each chunk of PRUNE_CHECK dimensions.
+ * Returns the squared distance, or a partial sum >= bound if the evaluation was abandoned,
+ * and stores the number of dimensions that were actually touched into ndims.
+ */
+double compute_dist_sq_pruned(double *v, double *w, int n, double bound, int *ndims)
+{
+	int nchunks = n / PRUNE_CHECK;
+	double sum_value = 0.0;
+#if defined (SIMD)
+	v = __builtin_assume_aligned(v, 32);
+	w = __builtin_assume_aligned(w, 32);
+
+	__m256d _sum_v = _mm256_setzero_pd();
+	__m256d _v, _w, _diff, _hsum;
+	__m128d _total_sum;
+	for (int c = 0; c < nchunks; c++)
+	{
+		for (int i = c * PRUNE_CHECK; i < (c + 1) * PRUNE_CHECK; i += 4)
+		{
+			_v = _mm256_load_pd(&v[i]);
+			_w = _mm256_load_pd(&w[i]);
+			_diff = _mm256_sub_pd(_v, _w);
+			_diff = _mm256_mul_pd(_diff, _diff); // diff squared
+			_sum_v = _mm256_add_pd(_sum_v, _diff); // add to sum vector reg
+		}
+
+		// horizontal sum of the running sum vector register, as in compute_dist
+		_hsum = _mm256_hadd_pd(_sum_v, _sum_v);
+		_total_sum = _mm_add_pd(_mm256_extractf128_pd(_hsum, 1), _mm256_castpd256_pd128(_hsum));
+		_mm_storeh_pd(&(sum_value), _total_sum);
+
+		if (sum_value >= bound)
+		{
+			*ndims = (c + 1) * PRUNE_CHECK;
+			return sum_value;
+		}
+	}
+#else
+	for (int c = 0; c < nchunks; c++)
+	{
+		for (int i = c * PRUNE_CHECK; i < (c + 1) * PRUNE_CHECK; i++)
+			sum_value += (v[i] - w[i]) * (v[i] - w[i]);
+
+		if (sum_value >= bound)
+		{
+			*ndims = (c + 1) * PRUNE_CHECK;
+			return sum_value;
+		}
+	}
 #endif
+	// handle the remaining entries
+	for (int i = nchunks * PRUNE_CHECK; i < n; i++)
+		sum_value += (v[i] - w[i]) * (v[i] - w[i]);
+
+	*ndims = n;
+	return sum_value;
+}
+
+/* Permute the dimensions of the training and query vectors, so that the dimensions with the largest
+ * variance (over the training elements) come first. The distances do not change, but the pruned scan
+ * accumulates the largest contributions first and is able to abandon the candidates earlier.
+ */
+void reorder_dims_by_variance(double **xdata, int ntrain, query_t *queries, int nqueries, int dim)
+{
+	double mean[dim], var[dim], tmp[dim];
+	int perm[dim];
+
+	for (int k = 0; k < dim; k++)
+	{
+		mean[k] = 0.0;
+		var[k] = 0.0;
+		perm[k] = k;
+	}
+	for (int i = 0; i < ntrain; i++)
+		for (int k = 0; k < dim; k++)
+			mean[k] += xdata[i][k];
+	for (int k = 0; k < dim; k++)
+		mean[k] /= ntrain;
+	for (int i = 0; i < ntrain; i++)
+		for (int k = 0; k < dim; k++)
+			var[k] += (xdata[i][k] - mean[k]) * (xdata[i][k] - mean[k]);
+
+	// sort the dimensions by decreasing variance (insertion sort, dim is small)
+	for (int k = 1; k < dim; k++)
+	{
+		int p = perm[k], j = k - 1;
+		while (j >= 0 && var[perm[j]] < var[p])
+		{
+			perm[j + 1] = perm[j];
+			j--;
+		}
+		perm[j + 1] = p;
+	}
+
+	for (int i = 0; i < ntrain; i++)
+	{
+		for (int k = 0; k < dim; k++)
+			tmp[k] = xdata[i][perm[k]];
+		for (int k = 0; k < dim; k++)
+			xdata[i][k] = tmp[k];
+	}
+	for (int i = 0; i < nqueries; i++)
+	{
+		for (int k = 0; k < dim; k++)
+			tmp[k] = queries[i].x[perm[k]];
+		for (int k = 0; k < dim; k++)
+			queries[i].x[k] = tmp[k];
+	}
+}
+
+// compute the summary (projections onto the principal axes and residual norm) of a single point
+void compute_point_summary(knn_summary_t *ks, double *x, double *summ)
+{
+	double r[PROBDIM];
+	for (int k = 0; k < PROBDIM; k++)
+		r[k] = x[k] - ks->center[k];
+
+	for (int j = 0; j < NPROJ; j++)
+	{
+		double p = 0.0;
+		for (int k = 0; k < PROBDIM; k++)
+			p += r[k] * ks->axes[j][k];
+		summ[j] = p;
+	}
+	// the residual is computed explicitly, instead of using |x'|^2 - sum_j p_j^2, in order to avoid cancellation
+	for (int j = 0; j < NPROJ; j++)
+		for (int k = 0; k < PROBDIM; k++)
+			r[k] -= summ[j] * ks->axes[j][k];
+
+	double rn = 0.0;
+	for (int k = 0; k < PROBDIM; k++)
+		rn += r[k] * r[k];
+	summ[NPROJ] = sqrt(rn);
+}
+
+/* Build the summaries of n training elements : find the NPROJ principal axes of the training set
+ * (power iteration with deflation on the covariance matrix) and summarize each training element.
+ */
+void build_summaries(knn_summary_t *ks, double **xdata, int n)
+{
+	static double cov[PROBDIM][PROBDIM];
+
+	for (int k = 0; k < PROBDIM; k++)
+		ks->center[k] = 0.0;
+	for (int i = 0; i < n; i++)
+		for (int k = 0; k < PROBDIM; k++)
+			ks->center[k] += xdata[i][k];
+	for (int k = 0; k < PROBDIM; k++)
+		ks->center[k] /= n;
+
+	for (int k = 0; k < PROBDIM; k++)
+		for (int l = 0; l < PROBDIM; l++)
+			cov[k][l] = 0.0;
+	for (int i = 0; i < n; i++)
+		for (int k = 0; k < PROBDIM; k++)
+			for (int l = 0; l < PROBDIM; l++)
+				cov[k][l] += (xdata[i][k] - ks->center[k]) * (xdata[i][l] - ks->center[l]);
+
+	for (int j = 0; j < NPROJ && j < PROBDIM; j++)
+	{
+		double *u = ks->axes[j], w[PROBDIM];
+		for (int k = 0; k < PROBDIM; k++)
+			u[k] = 1.0 + (k == j);	// deterministic starting vector
+
+		for (int it = 0; it < 100; it++)
+		{
+			// keep u orthogonal to the axes that have already been found (deflation)
+			for (int p = 0; p < j; p++)
+			{
+				double d = 0.0;
+				for (int k = 0; k < PROBDIM; k++)
+					d += u[k] * ks->axes[p][k];
+				for (int k = 0; k < PROBDIM; k++)
+					u[k] -= d * ks->axes[p][k];
+			}
+			double nrm = 0.0;
+			for (int k = 0; k < PROBDIM; k++)
+				nrm += u[k] * u[k];
+			nrm = sqrt(nrm);
+			for (int k = 0; k < PROBDIM; k++)
+				u[k] /= nrm;
+
+			if (it == 99)
+				break;
+			for (int k = 0; k < PROBDIM; k++)
+			{
+				w[k] = 0.0;
+				for (int l = 0; l < PROBDIM; l++)
+					w[k] += cov[k][l] * u[l];
+			}
+			for (int k = 0; k < PROBDIM; k++)
+				u[k] = w[k] + 1e-3 * u[k];	// shift, so that u never vanishes
+		}
+	}
+	for (int j = PROBDIM; j < NPROJ; j++)
+		for (int k = 0; k < PROBDIM; k++)
+			ks->axes[j][k] = 0.0;
+
+	double max_norm = 0.0;
+	for (int i = 0; i < n; i++)
+	{
+		double *summ = &ks->xsumm[(size_t)i * SUMM_SIZE];
+		compute_point_summary(ks, xdata[i], summ);
+
+		double nrm = summ[NPROJ] * summ[NPROJ];
+		for (int j = 0; j < NPROJ; j++)
+			nrm += summ[j] * summ[j];
+		if (nrm > max_norm)
+			max_norm = nrm;
+	}
+	// the rounding errors of the bound scale with the squared norms of the (centered) points
+	ks->tol = 1e-12 * PROBDIM * 4 * max_norm;
 }
 
 double compute_max_pos(double *v, int n, int *pos)
@@ -319,6 +817,60 @@ double compute_min_pos(double *v, int n, int *pos)
 	return vmin;
 }
 
+/* Selection of the k smallest of n candidates (dist, idx), written to out_dist, out_idx (in no particular order).
+ * select_k_kpass is the k-pass min search of myknn_acc.c : k full passes over the candidates, each one
+ * overwriting the minimum it found with HUGE_VAL, i.e. O(k * n) work.
+ */
+void select_k_kpass(double *dist, int *idx, int n, int k, double *out_dist, int *out_idx)
+{
+	int pos;
+	for (int j = 0; j < k; j++)
+	{
+		out_dist[j] = compute_min_pos(dist, n, &pos);
+		out_idx[j] = idx[pos];
+		dist[pos] = HUGE_VAL;
+	}
+}
+
+/* Same as select_k_kpass, in a single (expected O(n)) pass : quickselect partitions the candidates in place,
+ * around a median of three pivot, until the k smallest ones occupy the first k positions.
+ */
+void select_k_quickselect(double *dist, int *idx, int n, int k, double *out_dist, int *out_idx)
+{
+	int lo = 0, hi = n - 1;
+
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+		double a = dist[lo], b = dist[mid], c = dist[hi];
+		double pivot = (a < b) ? ((b < c) ? b : ((a < c) ? c : a)) : ((a < c) ? a : ((b < c) ? c : b));
+
+		// Hoare partition : [lo, j] <= pivot <= [j + 1, hi]
+		int i = lo - 1, j = hi + 1;
+		while (1)
+		{
+			do i++; while (dist[i] < pivot);
+			do j--; while (dist[j] > pivot);
+			if (i >= j)
+				break;
+			double td = dist[i]; dist[i] = dist[j]; dist[j] = td;
+			int ti = idx[i]; idx[i] = idx[j]; idx[j] = ti;
+		}
+
+		// keep partitioning the side that contains the boundary between the k-th and the (k+1)-th smallest
+		if (k - 1 <= j)
+			hi = j;
+		else
+			lo = j + 1;
+	}
+
+	for (int j = 0; j < k; j++)
+	{
+		out_dist[j] = dist[j];
+		out_idx[j] = idx[j];
+	}
+}
+
 double compute_root(double dist, int norm)
 {
 	if (dist == 0) return 0;
@@ -366,15 +918,20 @@ double compute_distance(double *pat1, double *pat2, int lpat, int norm)
 	return dist;	// compute_root(dist);
 }
 
-void compute_knn_brute_force(double **xdata, double *ydata, query_t *q, int dim, int k, int global_block_offset, int mpi_block_offset, int block_size)
+void compute_knn_brute_force(double **xdata, double *ydata, query_t *q, int dim, int k, int global_block_offset, int mpi_block_offset, int block_size, knn_stats_t *stats)
 {									  
 	/* global_block_offset : block offset in terms of **training elements** (does not take into account the dimension)
 	 * mpi_block_offset : use this in case you have training elements blocking for MPI (i.e. blocking on the local block)
 	 * block_size : the amount of training elements in xdata to iterate over,
 	 * 				starting from index (global_block_offset + mpi_block_offset)
+	 * stats : if not NULL, the work performed by the scan is added to its counters
 	 */
 	int i, gi, xdata_idx, max_i;
 	double max_d, new_d;
+	long long dims_touched = 0, topk_inserts = 0;
+#if defined(PRUNE)
+	int ndims;
+#endif
 
 	int block_start = global_block_offset + mpi_block_offset;
 	// find K neighbors
@@ -387,14 +944,398 @@ void compute_knn_brute_force(double **xdata, double *ydata, query_t *q, int dim,
 #else
 		xdata_idx = gi;
 #endif
+#if defined(PRUNE)
+		new_d = compute_dist_sq_pruned(q->x, xdata[xdata_idx], dim, max_d, &ndims); // squared euclidean, abandoned at max_d
+		dims_touched += ndims;
+#else
 		new_d = compute_dist(q->x, xdata[xdata_idx], dim); // euclidean		
+		dims_touched += dim;
+#endif
 		if (new_d < max_d) // add point to the list of knns, replace element max_i
 		{	
 			q->nn_idx[max_i] = gi;
 			q->nn_dist[max_i] = new_d;
 			q->nn_val[max_i] = ydata[xdata_idx];
+			// the k-th distance only changes when a neighbor is replaced
+			max_d = compute_max_pos(q->nn_dist, k, &max_i);
+			topk_inserts++;
+		}
+	}
+
+	if (stats != NULL)
+	{
+		stats->dist_evals += block_size;
+		stats->dims_touched += dims_touched;
+		stats->topk_inserts += topk_inserts;
+	}
+}
+
+
+/* Same as compute_knn_brute_force, but every candidate is first checked with the lower bound of its distance
+ * that is derived from the summaries of the candidate (xsumm, built by build_summaries) and of the query (qsumm).
+ * The full distance is only computed for the candidates whose bound is below the current k-th distance, so the
+ * neighbors found are exactly the same. nn_dist holds squared distances.
+ */
+void compute_knn_brute_force_lb(double **xdata, knn_summary_t *ks, double *ydata, query_t *q, double *qsumm, int dim, int k, int global_block_offset, int mpi_block_offset, int block_size, knn_stats_t *stats)
+{
+	int i, gi, xdata_idx, max_i;
+	double max_d, new_d;
+	long long dims_touched = 0, lb_rejects = 0, topk_inserts = 0;
+#if defined(PRUNE)
+	int ndims;
+#endif
+
+	int block_start = global_block_offset + mpi_block_offset;
+	max_d = compute_max_pos(q->nn_dist, k, &max_i);
+	for (i = 0; i < block_size; i++)
+	{
+		gi = block_start + i;
+#if defined(MPI)
+		xdata_idx = i;
+#else
+		xdata_idx = gi;
+#endif
+		double *xs = &ks->xsumm[(size_t)xdata_idx * SUMM_SIZE];
+		double lb = (xs[NPROJ] - qsumm[NPROJ]) * (xs[NPROJ] - qsumm[NPROJ]);
+		for (int j = 0; j < NPROJ; j++)
+			lb += (xs[j] - qsumm[j]) * (xs[j] - qsumm[j]);
+
+		if (lb > max_d + ks->tol) // the candidate cannot be closer than the k-th neighbor
+		{
+			lb_rejects++;
+			continue;
 		}
-		max_d = compute_max_pos(q->nn_dist, k, &max_i);
+
+#if defined(PRUNE)
+		new_d = compute_dist_sq_pruned(q->x, xdata[xdata_idx], dim, max_d, &ndims);
+		dims_touched += ndims;
+#else
+		new_d = compute_dist_sq(q->x, xdata[xdata_idx], dim);
+		dims_touched += dim;
+#endif
+		if (new_d < max_d) // add point to the list of knns, replace element max_i
+		{
+			q->nn_idx[max_i] = gi;
+			q->nn_dist[max_i] = new_d;
+			q->nn_val[max_i] = ydata[xdata_idx];
+			max_d = compute_max_pos(q->nn_dist, k, &max_i);
+			topk_inserts++;
+		}
+	}
+
+	if (stats != NULL)
+	{
+		stats->dist_evals += block_size - lb_rejects;
+		stats->dims_touched += dims_touched;
+		stats->lb_rejects += lb_rejects;
+		stats->topk_inserts += topk_inserts;
+	}
+}
+
+
+/* Arena (bump) allocator : memory is handed out from large chunks, which are only released all together.
+ * Used for results whose size is not known in advance (e.g. the neighbors found by a range query),
+ * so that appending to them never calls malloc for each result.
+ */
+typedef struct arena_chunk_s
+{
+	struct arena_chunk_s *next;
+	size_t size, used;
+	char *data;
+	int mapped;	// 1 if data is a region of arena_init_region (released with munmap)
+} arena_chunk_t;
+
+typedef struct arena_s
+{
+	arena_chunk_t *head;
+	size_t chunk_size;
+} arena_t;
+
+void arena_init(arena_t *arena, size_t chunk_size)
+{
+	arena->head = NULL;
+	arena->chunk_size = chunk_size;
+}
+
+// allocate size bytes aligned to align (a power of 2) bytes
+void *arena_alloc(arena_t *arena, size_t size, size_t align)
+{
+	arena_chunk_t *c = arena->head;
+	size_t offset = 0;
+	if (c != NULL)
+		offset = (c->used + align - 1) & ~(align - 1);
+
+	if (c == NULL || offset + size > c->size)
+	{
+		size_t chunk_size = size + align > arena->chunk_size ? size + align : arena->chunk_size;
+		c = (arena_chunk_t *)malloc(sizeof(arena_chunk_t));
+		int posix_res = posix_memalign((void **)(&(c->data)), align > 64 ? align : 64, chunk_size);
+		assert(posix_res == 0);
+		c->size = chunk_size;
+		c->used = 0;
+		c->mapped = 0;
+		c->next = arena->head;
+		arena->head = c;
+		offset = 0;
+	}
+	c->used = offset + size;
+	return c->data + offset;
+}
+
+void arena_free(arena_t *arena)
+{
+	arena_chunk_t *c = arena->head;
+	while (c != NULL)
+	{
+		arena_chunk_t *next = c->next;
+		if (c->mapped)
+			munmap(c->data, c->size);
+		else
+			free(c->data);
+		free(c);
+		c = next;
+	}
+	arena->head = NULL;
+}
+
+/* Page sizes of the region that backs an arena (see arena_init_region) :
+ *	PAGES_MALLOC	no region, the buffers are allocated one by one with malloc (the original allocation scheme)
+ *	PAGES_SMALL	a single region of base (4 KB) pages
+ *	PAGES_THP	a single region of transparent huge pages (madvise, needs THP in "always" or "madvise" mode)
+ *	PAGES_HUGETLB	a single region of explicit huge pages (MAP_HUGETLB, needs vm.nr_hugepages), or THP if there are none
+ */
+enum { PAGES_MALLOC, PAGES_SMALL, PAGES_THP, PAGES_HUGETLB, PAGES_COUNT };
+
+const char *pages_names[PAGES_COUNT] = {"malloc", "small", "thp", "hugetlb"};
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+/* Reserve one region of (at least) size bytes as the first chunk of an arena, aligned to a huge page boundary.
+ * Allocations that do not fit in the region fall back to regular chunks. Returns the mode actually obtained.
+ */
+int arena_init_region(arena_t *arena, size_t size, int mode)
+{
+	arena_init(arena, HUGE_PAGE_SIZE);
+	size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+	char *data = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+	if (mode == PAGES_HUGETLB)
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (data == MAP_FAILED)
+	{
+		if (mode == PAGES_HUGETLB)
+			mode = PAGES_THP;
+
+		// map one more huge page and trim the ends, so that the region starts at a huge page boundary
+		char *raw = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		assert(raw != MAP_FAILED);
+		data = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+		if (data > raw)
+			munmap(raw, data - raw);
+		munmap(data + size, raw + HUGE_PAGE_SIZE - data);
+
+#if defined(MADV_HUGEPAGE)
+		madvise(data, size, mode == PAGES_THP ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+#endif
+	}
+
+	arena_chunk_t *c = (arena_chunk_t *)malloc(sizeof(arena_chunk_t));
+	c->data = data;
+	c->size = size;
+	c->used = 0;
+	c->mapped = 1;
+	c->next = NULL;
+	arena->head = c;
+	return mode;
+}
+
+// arena of the large kNN buffers, NULL when they are allocated with malloc
+arena_t *knn_arena = NULL;
+
+void *knn_alloc(size_t size, size_t align)
+{
+	if (knn_arena != NULL)
+		return arena_alloc(knn_arena, size, align);
+
+	if (align <= 16)
+		return malloc(size);
+
+	void *p;
+	int posix_res = posix_memalign(&p, align, size);
+	assert(posix_res == 0);
+	return p;
+}
+
+// buffers of the arena are only released all together, by knn_pages_free
+void knn_free(void *p)
+{
+	if (knn_arena == NULL)
+		free(p);
+}
+
+/* Select the allocation scheme of the large kNN buffers with the environment variable KNN_PAGES
+ * (malloc, small, thp or hugetlb, thp by default) and reserve a region of size bytes for them.
+ * Returns the mode actually obtained.
+ */
+int knn_pages_init(arena_t *arena, size_t size)
+{
+	const char *env = getenv("KNN_PAGES");
+	int mode = PAGES_THP;
+	if (env != NULL)
+		for (int m = 0; m < PAGES_COUNT; m++)
+			if (strcmp(env, pages_names[m]) == 0)
+				mode = m;
+
+	if (mode == PAGES_MALLOC)
+		return mode;
+
+	mode = arena_init_region(arena, size, mode);
+	knn_arena = arena;
+	return mode;
+}
+
+void knn_pages_free()
+{
+	if (knn_arena != NULL)
+		arena_free(knn_arena);
+	knn_arena = NULL;
+}
+
+// size of the region for the buffers of the kNN drivers : training and query data, their handler arrays and the query buffers
+size_t knn_region_size()
+{
+	size_t size = (size_t)TRAINELEMS * (PROBDIM + 2) * sizeof(double) + (size_t)TRAINELEMS * sizeof(double *);	// mem, ydata, xdata
+	size += (size_t)QUERYELEMS * (PROBDIM + 2) * sizeof(double);						// query_mem, query_ydata
+	size += (size_t)QUERYELEMS * ((QX_STRIDE + 2 * NN_STRIDE) * sizeof(double) + NN_IDX_STRIDE * sizeof(int));	// query buffers
+#if defined(SIMD)
+	size += (size_t)TRAINELEMS * ((PROBDIM * sizeof(double) + 31) & ~(size_t)31);				// aligned rows of xdata
+#endif
+#if defined(LBFILTER)
+	size += (size_t)(TRAINELEMS + QUERYELEMS) * SUMM_SIZE * sizeof(double);				// summaries
+#endif
+	return size + 64 * 64; // alignment of each buffer
+}
+
+// page faults of the process so far
+long get_page_faults()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_minflt + ru.ru_majflt;
+}
+
+// memory of the process backed by transparent huge pages, in KB (-1 if unknown)
+long get_anon_huge_kb()
+{
+	long kb = -1;
+#if defined(__linux__)
+	FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+	if (fp == NULL)
+		return -1;
+
+	char line[256];
+	while (fgets(line, sizeof(line), fp) != NULL)
+		if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+			break;
+	fclose(fp);
+#endif
+	return kb;
+}
+
+// Print how the kNN buffers were allocated and the page faults taken while they were allocated and filled
+void print_pages_report(int mode, size_t size, long faults)
+{
+	if (mode == PAGES_MALLOC)
+		printf("Memory : malloc, %ld page faults while loading the data", faults);
+	else
+		printf("Memory : %.1f MB region of %s pages, %ld page faults while loading the data", size / 1048576.0, pages_names[mode], faults);
+	long huge_kb = get_anon_huge_kb();
+	if (huge_kb >= 0)
+		printf(", %.1f MB in transparent huge pages", huge_kb / 1024.0);
+	printf("\n");
+}
+
+/* Range (fixed-radius) queries : all the training elements within distance r of the query point.
+ * Since the number of neighbors of each query is not known in advance, they are appended to a list
+ * of fixed-size blocks, that are allocated from an arena.
+ */
+#define RANGE_BLOCK_SIZE 64
+
+typedef struct range_block_s
+{
+	struct range_block_s *next;
+	int n;
+	int idx[RANGE_BLOCK_SIZE];	// index (< TRAINELEMS) of each neighbor
+	double dist[RANGE_BLOCK_SIZE];	// distance between the query point and each neighbor
+} range_block_t;
+
+typedef struct range_query_s
+{
+	double *x;			// Query's coordinate
+	range_block_t *head, *tail;	// list of the blocks of neighbors found so far
+	long long count;		// number of neighbors found so far
+} range_query_t;
+
+void range_append(range_query_t *q, arena_t *arena, int idx, double dist)
+{
+	if (q->tail == NULL || q->tail->n == RANGE_BLOCK_SIZE)
+	{
+		range_block_t *b = (range_block_t *)arena_alloc(arena, sizeof(range_block_t), 64);
+		b->next = NULL;
+		b->n = 0;
+		if (q->tail == NULL)
+			q->head = b;
+		else
+			q->tail->next = b;
+		q->tail = b;
+	}
+	q->tail->idx[q->tail->n] = idx;
+	q->tail->dist[q->tail->n] = dist;
+	q->tail->n++;
+	q->count++;
+}
+
+/* Range query counterpart of compute_knn_brute_force : append to q every training element of the block that
+ * lies within distance r of the query point. The neighbors are appended in increasing index order.
+ * Squared distances are compared against r^2, and in PRUNE mode the evaluation of a candidate is abandoned as
+ * soon as its partial sum exceeds r^2.
+ */
+void compute_range_brute_force(double **xdata, range_query_t *q, double r, int dim, int global_block_offset, int mpi_block_offset, int block_size, arena_t *arena, knn_stats_t *stats)
+{
+	int i, gi, xdata_idx;
+	double new_d, r_sq = r * r;
+	long long dims_touched = 0;
+#if defined(PRUNE)
+	int ndims;
+	double bound = nextafter(r_sq, INFINITY); // abandon only when the partial sum is strictly above r^2
+#endif
+
+	int block_start = global_block_offset + mpi_block_offset;
+	for (i = 0; i < block_size; i++)
+	{
+		gi = block_start + i;
+#if defined(MPI)
+		xdata_idx = i;
+#else
+		xdata_idx = gi;
+#endif
+#if defined(PRUNE)
+		new_d = compute_dist_sq_pruned(q->x, xdata[xdata_idx], dim, bound, &ndims);
+		dims_touched += ndims;
+#else
+		new_d = compute_dist_sq(q->x, xdata[xdata_idx], dim);
+		dims_touched += dim;
+#endif
+		if (new_d <= r_sq)
+			range_append(q, arena, gi, sqrt(new_d));
+	}
+
+	if (stats != NULL)
+	{
+		stats->dist_evals += block_size;
+		stats->dims_touched += dims_touched;
 	}
 }
 
@@ -451,3 +1392,61 @@ double predict_value(double *ydata, int knn)
 	return sum_v / knn;
 #endif
 }
+
+/* Evaluation of every k <= NNBS in a single scan (KSWEEP) : the scan keeps the NNBS = k_max nearest neighbors,
+ * and the prediction with k neighbors is the mean value of the first k of them, in order of increasing distance.
+ * The errors of the predictions of all queries are accumulated for each k.
+ */
+typedef struct knn_sweep_s
+{
+	double sse[NNBS];	// sse[k - 1] : sum of the squared errors of the predictions with k neighbors
+	double err_sum[NNBS];	// err_sum[k - 1] : sum of their absolute percentage errors
+} knn_sweep_t;
+
+void sweep_init(knn_sweep_t *sw)
+{
+	for (int k = 0; k < NNBS; k++)
+	{
+		sw->sse[k] = 0.0;
+		sw->err_sum[k] = 0.0;
+	}
+}
+
+// add the predictions of query q (whose true value is y) with k = 1 .. NNBS neighbors
+void sweep_add_query(knn_sweep_t *sw, query_t *q, double y)
+{
+	int order[NNBS];
+	double sum = 0.0;
+
+	sort_neighbors(q, order);
+	for (int k = 1; k <= NNBS; k++)
+	{
+		sum += q->nn_val[order[k - 1]];
+		double yp = sum / k;
+		sw->sse[k - 1] += (y - yp) * (y - yp);
+		sw->err_sum[k - 1] += 100.0 * fabs((yp - y) / y);
+	}
+}
+
+void sweep_merge(knn_sweep_t *sw, knn_sweep_t *other)
+{
+	for (int k = 0; k < NNBS; k++)
+	{
+		sw->sse[k] += other->sse[k];
+		sw->err_sum[k] += other->err_sum[k];
+	}
+}
+
+// print the metrics of every k for n queries, whose true values have variance var, and the k of the lowest MSE
+void print_sweep(knn_sweep_t *sw, int n, double var)
+{
+	int best_k = 1;
+	for (int k = 1; k <= NNBS; k++)
+	{
+		double mse = sw->sse[k - 1] / n;
+		printf("k = %3d : APE = %.2f %%, MSE = %.6f, R2 = %.6lf\n", k, sw->err_sum[k - 1] / n, mse, 1 - (mse / var));
+		if (sw->sse[k - 1] < sw->sse[best_k - 1])
+			best_k = k;
+	}
+	printf("Best k = %d (MSE = %.6f)\n", best_k, sw->sse[best_k - 1] / n);
+}
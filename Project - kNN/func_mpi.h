@@ -21,26 +21,15 @@ void load_binary_data_mpi(const char *filename, double *data, query_t *queries,
         MPI_Status status;
         MPI_File_read_at_all(f, base + data_offset, data, N, MPI_DOUBLE, &status); // blocking collective call
 
-        // If queries are loaded, initialize the queries structs
+        // If queries are loaded, copy their coordinates into the query buffers (see alloc_query_buffers) and initialize them
 	if (queries != NULL)
 	{
 		for (int i = 0; i < QUERYELEMS; i++)
 		{
 			for (int k = 0; k < PROBDIM; k++)
-		#if defined(SIMD)
 				queries[i].x[k] = data[i * (PROBDIM + 1) + k];
-		#else
-				queries[i].x = &data[i * (PROBDIM + 1)];
-		#endif
-		
-			for (int j = 0; j < NNBS; j++)
-				queries[i].nn_idx[j] = -1;
-
-			for (int j = 0; j < NNBS; j++)
-				queries[i].nn_dist[j] = 1e99 - j;
-
-			for (int j = 0; j < NNBS; j++)
-				queries[i].nn_val[j] = -1;
+
+			reset_query(&queries[i]);
 		}
 	}
 
@@ -75,6 +64,38 @@ void store_binary_data_mpi(const char *filename, double *data, const int N, int
         MPI_File_close(&f); 
 }
 
+/* Collectively write the nqueries records (packed by pack_knn_record) of the queries
+ * [first_query, first_query + nqueries) to an already opened binary results file. Since all records have
+ * the same size, the offset of each rank follows from its first query and no prefix sum is needed.
+ */
+void write_knn_records_mpi(MPI_File f, char *records, int first_query, int nqueries)
+{
+	MPI_Datatype mpi_record_t;
+	MPI_Type_contiguous(KNN_RECORD_SIZE, MPI_BYTE, &mpi_record_t);
+	MPI_Type_commit(&mpi_record_t);
+
+	// blocking collective call
+	MPI_File_write_at_all(f, (MPI_Offset)first_query * KNN_RECORD_SIZE, records, nqueries, mpi_record_t, MPI_STATUS_IGNORE);
+
+	MPI_Type_free(&mpi_record_t);
+}
+
+// Create the binary results file (collective call), truncating any previous, longer, contents
+void open_knn_results_mpi(const char *filename, MPI_File *f)
+{
+	MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, f);
+	MPI_File_set_size(*f, (MPI_Offset)QUERYELEMS * KNN_RECORD_SIZE);
+}
+
+// Write the records of the queries [first_query, first_query + nqueries), when each rank holds all of its records at once
+void store_knn_results_mpi(const char *filename, char *records, int first_query, int nqueries)
+{
+	MPI_File f;
+	open_knn_results_mpi(filename, &f);
+	write_knn_records_mpi(f, records, first_query, nqueries);
+	MPI_File_close(&f);
+}
+
 int get_rank_in_charge_of(int query_idx, int query_blocksize, int mpi_comm_size)
 {
 	int rank = query_idx / query_blocksize;
@@ -114,4 +135,51 @@ void reduce_in_struct(query_t *query, query_t *received, int received_size)
 			}
 		}
 	}
-}
\ No newline at end of file
+}
+
+/* Post the non-blocking sends of the k nearest neighbors of the queries [first, first + n) to rank dest.
+ * The state of consecutive queries is contiguous in the query buffers, so it takes three plain messages
+ * (tags 0, 1, 2) and no derived datatype. req must have room for 3 requests.
+ */
+void isend_knn_block_mpi(query_buffers_t *qb, int first, int n, int dest, MPI_Request *req)
+{
+	MPI_Isend(&qb->nn_idx[(size_t)first * NN_IDX_STRIDE], n * NN_IDX_STRIDE, MPI_INT, dest, 0, MPI_COMM_WORLD, &req[0]);
+	MPI_Isend(&qb->nn_dist[(size_t)first * NN_STRIDE], n * NN_STRIDE, MPI_DOUBLE, dest, 1, MPI_COMM_WORLD, &req[1]);
+	MPI_Isend(&qb->nn_val[(size_t)first * NN_STRIDE], n * NN_STRIDE, MPI_DOUBLE, dest, 2, MPI_COMM_WORLD, &req[2]);
+}
+
+// Receive the k nearest neighbors of n queries, sent by isend_knn_block_mpi from rank src, into the first n queries of qb
+void recv_knn_block_mpi(query_buffers_t *qb, int n, int src)
+{
+	MPI_Recv(qb->nn_idx, n * NN_IDX_STRIDE, MPI_INT, src, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	MPI_Recv(qb->nn_dist, n * NN_STRIDE, MPI_DOUBLE, src, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	MPI_Recv(qb->nn_val, n * NN_STRIDE, MPI_DOUBLE, src, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+}
+
+/* Collectively read nqueries query vectors, starting from the global query index first_query,
+ * using an already opened file handle. Ranks that have no more queries to read must still take
+ * part in the call, using nqueries = 0.
+ * The coordinates of each query are copied into its slice of the query buffers, its surrogate value into
+ * qy, and the k nearest neighbor state of the corresponding query is reset.
+ */
+void load_query_block_mpi(MPI_File f, double *buf, double *qy, query_t *queries, int first_query, int nqueries)
+{
+	int vector_size = PROBDIM + 1;
+	MPI_Offset data_offset = (MPI_Offset)first_query * vector_size * sizeof(double);
+
+	// blocking collective call, each rank reads only its own slice of the query file
+	MPI_File_read_at_all(f, data_offset, buf, nqueries * vector_size, MPI_DOUBLE, MPI_STATUS_IGNORE);
+
+	for (int i = 0; i < nqueries; i++)
+	{
+		for (int k = 0; k < PROBDIM; k++)
+			queries[i].x[k] = buf[i * vector_size + k];
+
+#if defined(SURROGATES)
+		qy[i] = buf[i * vector_size + PROBDIM];
+#else
+		qy[i] = 0;
+#endif
+		reset_query(&queries[i]);
+	}
+}
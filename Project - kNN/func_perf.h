@@ -0,0 +1,249 @@
+#pragma once
+
+/* Optional hardware counters of the hot loops of the kNN search, read with perf_event_open (Linux only).
+ *
+ * The counters are switched on at runtime, by setting the environment variable KNN_PERF (to anything but 0).
+ * When it is not set, perf_begin/perf_end only test a flag, so the instrumented code runs at full speed.
+ *
+ * Each thread opens its own counters (perf_thread_open), which only count the user-space events of the calling
+ * thread, and accumulates them into one of the PERF_NSCOPES scopes (the training-block loop and the prediction
+ * phase) between perf_begin and perf_end. The work counters of the scan (distance evaluations and top-k
+ * insertions, see knn_stats_t) are attached to the scan scope when the counters are closed.
+ *
+ * Counters that the kernel refuses (e.g. no PMU in a virtual machine, or kernel.perf_event_paranoid > 2) are
+ * reported as -1 and the rest of the report is still printed.
+ */
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#endif
+
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_L1D_MISSES, PERF_LLC_MISSES, PERF_DTLB_MISSES, PERF_NEVENTS };
+enum { PERF_SCAN, PERF_PREDICT, PERF_NSCOPES };
+
+const char *perf_scope_names[PERF_NSCOPES] = {"scan", "predict"};
+
+// bytes transferred from memory for each last level cache miss
+#define PERF_LINE_SIZE 64
+
+// 1 if the counters were switched on by KNN_PERF (set by perf_init)
+int perf_enabled = 0;
+
+// the counters of one thread (or rank), in a plain struct so that it can be gathered with MPI
+typedef struct perf_counts_s
+{
+	double time[PERF_NSCOPES];			// wall clock time spent in each scope
+	long long count[PERF_NSCOPES][PERF_NEVENTS];	// hardware events, -1 if the event is not available
+	long long dist_evals;				// distance evaluations of the scan
+	long long topk_inserts;				// neighbors inserted into the top-k lists by the scan
+	long long dims_touched;				// dimensions summed by the scan (i.e. doubles read from the training set)
+} perf_counts_t;
+
+typedef struct perf_thread_s
+{
+	int fd[PERF_NEVENTS];
+	double t0;
+	perf_counts_t c;
+} perf_thread_t;
+
+// read the KNN_PERF switch, must be called once before any thread opens its counters
+void perf_init()
+{
+	const char *env = getenv("KNN_PERF");
+	perf_enabled = (env != NULL && strcmp(env, "0") != 0);
+}
+
+#if defined(__linux__)
+int perf_open_event(int type, long long config)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;	// user-space only, allowed with the default perf_event_paranoid
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	// pid = 0, cpu = -1 : the calling thread, on any cpu
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+// open the counters of the calling thread (no-op if the counters are off)
+void perf_thread_open(perf_thread_t *pt)
+{
+	memset(&pt->c, 0, sizeof(pt->c));
+	for (int e = 0; e < PERF_NEVENTS; e++)
+		pt->fd[e] = -1;
+
+	if (!perf_enabled)
+		return;
+
+#if defined(__linux__)
+	pt->fd[PERF_CYCLES] = perf_open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	pt->fd[PERF_INSTRUCTIONS] = perf_open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	pt->fd[PERF_L1D_MISSES] = perf_open_event(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+	                                          (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	pt->fd[PERF_LLC_MISSES] = perf_open_event(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+	                                          (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	pt->fd[PERF_DTLB_MISSES] = perf_open_event(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+	                                           (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#endif
+	for (int e = 0; e < PERF_NEVENTS; e++)
+		if (pt->fd[e] < 0)
+			for (int s = 0; s < PERF_NSCOPES; s++)
+				pt->c.count[s][e] = -1;
+}
+
+// start counting the events of a scope
+void perf_begin(perf_thread_t *pt)
+{
+	if (!perf_enabled)
+		return;
+
+	for (int e = 0; e < PERF_NEVENTS; e++)
+	{
+		if (pt->fd[e] < 0)
+			continue;
+		ioctl(pt->fd[e], PERF_EVENT_IOC_RESET, 0);
+		ioctl(pt->fd[e], PERF_EVENT_IOC_ENABLE, 0);
+	}
+	pt->t0 = gettime();
+}
+
+// stop counting and add the events since perf_begin to the given scope
+void perf_end(perf_thread_t *pt, int scope)
+{
+	if (!perf_enabled)
+		return;
+
+	pt->c.time[scope] += gettime() - pt->t0;
+	for (int e = 0; e < PERF_NEVENTS; e++)
+	{
+		if (pt->fd[e] < 0)
+			continue;
+		ioctl(pt->fd[e], PERF_EVENT_IOC_DISABLE, 0);
+
+		// value, time enabled, time running : scale the value up if the event was multiplexed with others
+		unsigned long long v[3];
+		if (read(pt->fd[e], v, sizeof(v)) != sizeof(v))
+			continue;
+		if (v[2] > 0 && v[2] < v[1])
+			v[0] = (unsigned long long)((double)v[0] * v[1] / v[2]);
+		pt->c.count[scope][e] += v[0];
+	}
+}
+
+// close the counters of the calling thread and attach the work counters of its scan
+void perf_thread_close(perf_thread_t *pt, knn_stats_t *stats)
+{
+	for (int e = 0; e < PERF_NEVENTS; e++)
+		if (pt->fd[e] >= 0)
+			close(pt->fd[e]);
+
+	if (stats != NULL)
+	{
+		pt->c.dist_evals = stats->dist_evals;
+		pt->c.topk_inserts = stats->topk_inserts;
+		pt->c.dims_touched = stats->dims_touched;
+	}
+}
+
+void perf_print_line(const char *engine, const char *worker, perf_counts_t *c, int scope)
+{
+	long long *n = c->count[scope];
+	int scan = (scope == PERF_SCAN);
+
+	printf("PERF,%s,%s,%s,%.6f,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld\n", engine, worker, perf_scope_names[scope], c->time[scope],
+	       n[PERF_CYCLES], n[PERF_INSTRUCTIONS], n[PERF_L1D_MISSES], n[PERF_LLC_MISSES],
+	       n[PERF_LLC_MISSES] < 0 ? -1 : n[PERF_LLC_MISSES] * PERF_LINE_SIZE, n[PERF_DTLB_MISSES],
+	       scan ? c->dist_evals : 0, scan ? c->topk_inserts : 0, scan ? c->dims_touched * (long long)sizeof(double) : 0);
+}
+
+/* Print the counters of nworkers threads or ranks, one machine-readable record per worker and scope,
+ * followed by their sum and a few derived metrics :
+ * 	PERF,<engine>,<worker>,<scope>,<secs>,<cycles>,<instructions>,<l1d_misses>,<llc_misses>,<llc_bytes>,<dtlb_misses>,<dist_evals>,<topk_inserts>,<bytes_loaded>
+ * llc_bytes estimates the traffic from memory (a cache line per last level cache miss), while bytes_loaded is the
+ * size of the training coordinates read by the scan. The time of the sum is the maximum over all workers.
+ */
+void perf_report(const char *exe, perf_counts_t *c, int nworkers)
+{
+	if (!perf_enabled)
+		return;
+
+	const char *engine = strrchr(exe, '/');
+	engine = (engine == NULL) ? exe : engine + 1;
+
+	perf_counts_t total;
+	memset(&total, 0, sizeof(total));
+	for (int w = 0; w < nworkers; w++)
+	{
+		total.dist_evals += c[w].dist_evals;
+		total.topk_inserts += c[w].topk_inserts;
+		total.dims_touched += c[w].dims_touched;
+		for (int s = 0; s < PERF_NSCOPES; s++)
+		{
+			if (c[w].time[s] > total.time[s])
+				total.time[s] = c[w].time[s];
+			for (int e = 0; e < PERF_NEVENTS; e++)
+				if (total.count[s][e] >= 0)
+					total.count[s][e] = (c[w].count[s][e] < 0) ? -1 : total.count[s][e] + c[w].count[s][e];
+		}
+	}
+
+	char worker[16];
+	for (int w = 0; w < nworkers; w++)
+		for (int s = 0; s < PERF_NSCOPES; s++)
+		{
+			snprintf(worker, sizeof(worker), "%d", w);
+			perf_print_line(engine, worker, &c[w], s);
+		}
+	for (int s = 0; s < PERF_NSCOPES; s++)
+		perf_print_line(engine, "total", &total, s);
+
+	if (total.count[PERF_SCAN][PERF_CYCLES] < 0)
+		printf("Hardware counters not available (no PMU, or not permitted by kernel.perf_event_paranoid), only the work counters were reported\n");
+
+	long long *n = total.count[PERF_SCAN];
+	double t = total.time[PERF_SCAN];
+	printf("Scan : %.3e distance evaluations (%.1f M/sec), %.3e top-k insertions (%.4f per evaluation)\n",
+	       (double)total.dist_evals, total.dist_evals / t / 1e6, (double)total.topk_inserts, (double)total.topk_inserts / total.dist_evals);
+	if (n[PERF_CYCLES] > 0 && n[PERF_INSTRUCTIONS] >= 0)
+		printf("Scan : IPC = %.2f, cycles/evaluation = %.1f\n",
+		       (double)n[PERF_INSTRUCTIONS] / n[PERF_CYCLES], (double)n[PERF_CYCLES] / total.dist_evals);
+	if (n[PERF_L1D_MISSES] >= 0 && n[PERF_LLC_MISSES] >= 0)
+		printf("Scan : L1d misses/evaluation = %.3f, LLC misses/evaluation = %.4f, memory traffic = %.2f GB/sec (loads of %.2f GB/sec)\n",
+		       (double)n[PERF_L1D_MISSES] / total.dist_evals, (double)n[PERF_LLC_MISSES] / total.dist_evals,
+		       (double)n[PERF_LLC_MISSES] * PERF_LINE_SIZE / t / 1e9, total.dims_touched * sizeof(double) / t / 1e9);
+	if (n[PERF_DTLB_MISSES] >= 0)
+		printf("Scan : dTLB misses/evaluation = %.5f (%.3e in total)\n",
+		       (double)n[PERF_DTLB_MISSES] / total.dist_evals, (double)n[PERF_DTLB_MISSES]);
+}
+
+#if defined(MPI)
+// gather the counters of all ranks to rank 0, which prints the report (collective call)
+void perf_report_mpi(const char *exe, perf_counts_t *c)
+{
+	if (!perf_enabled)
+		return;
+
+	int rank, nprocs;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+
+	perf_counts_t *all = NULL;
+	if (rank == 0)
+		all = (perf_counts_t *)malloc(nprocs * sizeof(perf_counts_t));
+
+	MPI_Gather(c, sizeof(perf_counts_t), MPI_BYTE, all, sizeof(perf_counts_t), MPI_BYTE, 0, MPI_COMM_WORLD);
+	if (rank == 0)
+		perf_report(exe, all, nprocs);
+
+	free(all);
+}
+#endif
@@ -0,0 +1,422 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <limits.h>
+#include "func.h"
+
+/* Incrementally updated training set.
+ *
+ * The training matrix is kept in memory and is updated in batches : new training elements are appended and old ones
+ * are deleted by marking them with a tombstone, instead of regenerating and reloading the whole training file.
+ * Queries run concurrently with the updates, and each one sees a consistent snapshot of the training set.
+ *
+ * The rows of the training set are stored in arrays (train_rows_t) that are shared by consecutive snapshots :
+ * - each row vector is allocated once and never modified, so the snapshots share the rows instead of copying them,
+ * - an append writes the new rows after the last row of the newest snapshot, which no older snapshot ever reads,
+ * - a delete stores the epoch of the batch in the tombstone of the row, so the row stays visible to older snapshots :
+ *   a snapshot of epoch e sees the row i if i < n and del_epoch[i] > e.
+ * When the arrays are full, or when half of their rows have been deleted, the batch copies the live rows to new arrays
+ * (compaction). The arrays, the snapshots and the deleted rows that are no longer reachable from the newest snapshot
+ * are retired, and they are only freed once no query may still be using them (epoch-based reclamation) :
+ * each reader announces the epoch it enters with, and an object retired at epoch e is freed when every active
+ * reader has announced an epoch >= e, since these readers can only have seen the snapshots that do not reach it.
+ *
+ * There is a single writer (the thread that applies the batches), and up to STORE_MAX_READERS concurrent readers.
+ */
+
+#ifndef STORE_MAX_READERS
+#define STORE_MAX_READERS 256
+#endif
+
+#define EPOCH_QUIESCENT LONG_MAX	// announced epoch of a reader that is not using any snapshot, and tombstone of a live row
+
+typedef struct train_rows_s
+{
+	int capacity;
+	double **xdata;			// coordinates of each row (PROBDIM doubles, 32 byte aligned)
+	double *ydata;			// surrogate value of each row
+	int *ids;			// stable id of each row, reported as the neighbor index (increasing, since rows are only appended)
+	_Atomic long *del_epoch;	// epoch of the batch that deleted the row, or EPOCH_QUIESCENT if it is alive
+#if defined(LBFILTER)
+	double *xsumm;			// SUMM_SIZE summary values per row, computed with the axes of the store
+#endif
+} train_rows_t;
+
+// Immutable view of the training set, as it was after the batch of its epoch
+typedef struct train_snapshot_s
+{
+	long epoch;
+	int n;				// number of rows of the arrays that are visible (some may be deleted)
+	int nalive;			// number of rows that are visible and alive
+	double lb_tol;			// slack of the lower bound, over all the visible rows (LBFILTER)
+	train_rows_t *rows;
+} train_snapshot_t;
+
+// An object that is no longer reachable from the newest snapshot, waiting for the readers of older snapshots
+typedef struct retired_s
+{
+	struct retired_s *next;
+	long epoch;			// the epoch of the first snapshot that does not reach the object
+	void *ptr;
+	void (*free_fn)(void *);
+} retired_t;
+
+// Epoch announced by a reader, padded to a cache line so that the readers do not false-share their slots
+typedef struct reader_slot_s
+{
+	_Atomic long epoch;
+	char pad[64 - sizeof(long)];
+} reader_slot_t;
+
+typedef struct train_store_s
+{
+	_Atomic(train_snapshot_t *) current;	// the newest snapshot
+	_Atomic long epoch;			// the epoch of the newest snapshot
+	reader_slot_t readers[STORE_MAX_READERS];
+
+	// the following fields are only accessed by the writer
+	int next_id;			// id of the next appended row
+	int ndead;			// deleted rows still stored in the arrays of the newest snapshot
+	retired_t *retired;
+	long nretired, nfreed;		// counters of the reclamation
+#if defined(LBFILTER)
+	knn_summary_t ks;		// center and principal axes, found once from the initial training set
+#endif
+} train_store_t;
+
+// A batch of updates : nappend new rows (PROBDIM coordinates followed by the surrogate value) and ndelete ids to delete
+typedef struct train_batch_s
+{
+	int nappend;
+	double *append_mem;
+	int ndelete;
+	int *delete_ids;
+} train_batch_t;
+
+train_rows_t *rows_alloc(int capacity)
+{
+	train_rows_t *r = (train_rows_t *)malloc(sizeof(train_rows_t));
+	r->capacity = capacity;
+	r->xdata = (double **)malloc(capacity * sizeof(double *));
+	r->ydata = (double *)malloc(capacity * sizeof(double));
+	r->ids = (int *)malloc(capacity * sizeof(int));
+	r->del_epoch = (_Atomic long *)malloc(capacity * sizeof(_Atomic long));
+#if defined(LBFILTER)
+	r->xsumm = (double *)malloc((size_t)capacity * SUMM_SIZE * sizeof(double));
+#endif
+	return r;
+}
+
+// free the arrays only : the row vectors are shared with the other arrays and are retired on their own
+void rows_free(void *p)
+{
+	train_rows_t *r = (train_rows_t *)p;
+	free(r->xdata);
+	free(r->ydata);
+	free(r->ids);
+	free(r->del_epoch);
+#if defined(LBFILTER)
+	free(r->xsumm);
+#endif
+	free(r);
+}
+
+void store_retire(train_store_t *store, void *ptr, void (*free_fn)(void *), long epoch)
+{
+	retired_t *ret = (retired_t *)malloc(sizeof(retired_t));
+	ret->ptr = ptr;
+	ret->free_fn = free_fn;
+	ret->epoch = epoch;
+	ret->next = store->retired;
+	store->retired = ret;
+	store->nretired++;
+}
+
+// Free the retired objects that none of the active readers may still reach
+void store_reclaim(train_store_t *store)
+{
+	long min_epoch = EPOCH_QUIESCENT;
+	for (int t = 0; t < STORE_MAX_READERS; t++)
+	{
+		long e = atomic_load(&store->readers[t].epoch);
+		if (e < min_epoch)
+			min_epoch = e;
+	}
+
+	retired_t **prev = &store->retired;
+	while (*prev != NULL)
+	{
+		retired_t *ret = *prev;
+		if (ret->epoch <= min_epoch)
+		{
+			*prev = ret->next;
+			ret->free_fn(ret->ptr);
+			free(ret);
+			store->nfreed++;
+		}
+		else
+			prev = &ret->next;
+	}
+}
+
+// Store row i of the arrays : copy its coordinates to a new aligned row vector
+void rows_set(train_store_t *store, train_rows_t *r, int i, double *x, double y, int id)
+{
+	int posix_res = posix_memalign((void **)(&(r->xdata[i])), 32, PROBDIM * sizeof(double));
+	assert(posix_res == 0);
+	for (int k = 0; k < PROBDIM; k++)
+		r->xdata[i][k] = x[k];
+	r->ydata[i] = y;
+	r->ids[i] = id;
+	atomic_init(&r->del_epoch[i], EPOCH_QUIESCENT);
+#if defined(LBFILTER)
+	compute_point_summary(&store->ks, r->xdata[i], &r->xsumm[(size_t)i * SUMM_SIZE]);
+#endif
+}
+
+#if defined(LBFILTER)
+// slack of the lower bound that covers the rows [first, n) (see build_summaries)
+double rows_lb_tol(train_rows_t *r, int first, int n, double tol)
+{
+	for (int i = first; i < n; i++)
+	{
+		double *summ = &r->xsumm[(size_t)i * SUMM_SIZE];
+		double nrm = summ[NPROJ] * summ[NPROJ];
+		for (int j = 0; j < NPROJ; j++)
+			nrm += summ[j] * summ[j];
+		if (1e-12 * PROBDIM * 4 * nrm > tol)
+			tol = 1e-12 * PROBDIM * 4 * nrm;
+	}
+	return tol;
+}
+#endif
+
+/* Initialize the store with the n rows of mem (PROBDIM coordinates followed by the surrogate value),
+ * with ids 0..n-1. In LBFILTER mode, the principal axes of these rows are used for all the rows appended later,
+ * which keeps the lower bound valid (it holds for any orthonormal axes), only less tight if the data drift.
+ */
+void store_init(train_store_t *store, double *mem, int n, int capacity)
+{
+	train_rows_t *r = rows_alloc(capacity);
+
+#if defined(LBFILTER)
+	double **xtmp = (double **)malloc(n * sizeof(double *));
+	for (int i = 0; i < n; i++)
+		xtmp[i] = &mem[i * (PROBDIM + 1)];
+	store->ks.xsumm = (double *)malloc((size_t)n * SUMM_SIZE * sizeof(double));
+	build_summaries(&store->ks, xtmp, n);
+	free(store->ks.xsumm);
+	store->ks.xsumm = NULL;
+	free(xtmp);
+#endif
+
+	for (int i = 0; i < n; i++)
+		rows_set(store, r, i, &mem[i * (PROBDIM + 1)], mem[i * (PROBDIM + 1) + PROBDIM], i);
+
+	train_snapshot_t *s = (train_snapshot_t *)malloc(sizeof(train_snapshot_t));
+	s->epoch = 0;
+	s->n = n;
+	s->nalive = n;
+	s->rows = r;
+#if defined(LBFILTER)
+	s->lb_tol = rows_lb_tol(r, 0, n, 0.0);
+#else
+	s->lb_tol = 0.0;
+#endif
+
+	for (int t = 0; t < STORE_MAX_READERS; t++)
+		atomic_init(&store->readers[t].epoch, EPOCH_QUIESCENT);
+	atomic_init(&store->current, s);
+	atomic_init(&store->epoch, 0);
+	store->next_id = n;
+	store->ndead = 0;
+	store->retired = NULL;
+	store->nretired = 0;
+	store->nfreed = 0;
+}
+
+// Enter as reader `slot` and get the newest snapshot, which stays valid until store_exit
+train_snapshot_t *store_enter(train_store_t *store, int slot)
+{
+	atomic_store(&store->readers[slot].epoch, atomic_load(&store->epoch));
+	return atomic_load(&store->current);
+}
+
+void store_exit(train_store_t *store, int slot)
+{
+	atomic_store(&store->readers[slot].epoch, EPOCH_QUIESCENT);
+}
+
+// find the row of a given id among the first n rows (the ids are increasing), or -1 if it is not stored
+int rows_find(train_rows_t *r, int n, int id)
+{
+	int lo = 0, hi = n - 1;
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (r->ids[mid] == id)
+			return mid;
+		if (r->ids[mid] < id)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return -1;
+}
+
+/* Apply a batch of updates (writer only) and publish the snapshot that reflects it.
+ * The ids of the appended rows are next_id, next_id + 1, ... Deleting an id that is not alive has no effect.
+ */
+void store_apply_batch(train_store_t *store, train_batch_t *batch)
+{
+	train_snapshot_t *cur = atomic_load(&store->current);
+	train_rows_t *r = cur->rows;
+	long epoch = cur->epoch + 1;
+	int n = cur->n, nalive = cur->nalive;
+
+	// tombstones : the rows stay visible to the snapshots of the older epochs
+	for (int d = 0; d < batch->ndelete; d++)
+	{
+		int i = rows_find(r, n, batch->delete_ids[d]);
+		if (i >= 0 && atomic_load_explicit(&r->del_epoch[i], memory_order_relaxed) == EPOCH_QUIESCENT)
+		{
+			atomic_store_explicit(&r->del_epoch[i], epoch, memory_order_relaxed);
+			store->ndead++;
+			nalive--;
+		}
+	}
+
+	double lb_tol = cur->lb_tol;
+	if (n + batch->nappend > r->capacity || 2 * store->ndead > n)
+	{
+		// compaction : copy the live rows to new arrays, and retire the deleted row vectors along with the old arrays
+		int capacity = 2 * (nalive + batch->nappend);
+		train_rows_t *nr = rows_alloc(capacity);
+		int m = 0;
+		for (int i = 0; i < n; i++)
+		{
+			if (atomic_load_explicit(&r->del_epoch[i], memory_order_relaxed) != EPOCH_QUIESCENT)
+			{
+				store_retire(store, r->xdata[i], free, epoch);
+				continue;
+			}
+			nr->xdata[m] = r->xdata[i];
+			nr->ydata[m] = r->ydata[i];
+			nr->ids[m] = r->ids[i];
+			atomic_init(&nr->del_epoch[m], EPOCH_QUIESCENT);
+#if defined(LBFILTER)
+			for (int j = 0; j < SUMM_SIZE; j++)
+				nr->xsumm[(size_t)m * SUMM_SIZE + j] = r->xsumm[(size_t)i * SUMM_SIZE + j];
+#endif
+			m++;
+		}
+		store_retire(store, r, rows_free, epoch);
+		r = nr;
+		n = m;
+		store->ndead = 0;
+#if defined(LBFILTER)
+		lb_tol = rows_lb_tol(r, 0, n, 0.0);
+#endif
+	}
+
+	// appends : the new rows lie beyond the rows that the older snapshots see
+	for (int a = 0; a < batch->nappend; a++)
+	{
+		double *row = &batch->append_mem[a * (PROBDIM + 1)];
+		rows_set(store, r, n + a, row, row[PROBDIM], store->next_id++);
+	}
+#if defined(LBFILTER)
+	lb_tol = rows_lb_tol(r, n, n + batch->nappend, lb_tol);
+#endif
+
+	train_snapshot_t *s = (train_snapshot_t *)malloc(sizeof(train_snapshot_t));
+	s->epoch = epoch;
+	s->n = n + batch->nappend;
+	s->nalive = nalive + batch->nappend;
+	s->lb_tol = lb_tol;
+	s->rows = r;
+
+	// publish the snapshot before the epoch, so that a reader that announces the new epoch also gets the new snapshot
+	atomic_store(&store->current, s);
+	atomic_store(&store->epoch, epoch);
+	store_retire(store, cur, free, epoch);
+
+	store_reclaim(store);
+}
+
+// Free everything, once there are no readers left
+void store_free(train_store_t *store)
+{
+	store_reclaim(store);
+	assert(store->retired == NULL);
+
+	train_snapshot_t *s = atomic_load(&store->current);
+	for (int i = 0; i < s->n; i++)
+		free(s->rows->xdata[i]);
+	rows_free(s->rows);
+	free(s);
+}
+
+/* Same as compute_knn_brute_force, over the rows [block_start, block_start + block_size) of a snapshot :
+ * the rows that are deleted in the snapshot are skipped, and the neighbors are reported by their ids.
+ */
+void compute_knn_snapshot(train_snapshot_t *s, query_t *q, double *qsumm, int k, int block_start, int block_size, knn_stats_t *stats)
+{
+	train_rows_t *r = s->rows;
+	int max_i;
+	double max_d, new_d;
+	long long dist_evals = 0, dims_touched = 0, lb_rejects = 0, topk_inserts = 0;
+#if defined(PRUNE)
+	int ndims;
+#endif
+
+	if (block_start + block_size > s->n)
+		block_size = s->n - block_start;
+
+	max_d = compute_max_pos(q->nn_dist, k, &max_i);
+	for (int i = block_start; i < block_start + block_size; i++)
+	{
+		if (atomic_load_explicit(&r->del_epoch[i], memory_order_relaxed) <= s->epoch) // deleted in this snapshot
+			continue;
+
+#if defined(LBFILTER)
+		double *xs = &r->xsumm[(size_t)i * SUMM_SIZE];
+		double lb = (xs[NPROJ] - qsumm[NPROJ]) * (xs[NPROJ] - qsumm[NPROJ]);
+		for (int j = 0; j < NPROJ; j++)
+			lb += (xs[j] - qsumm[j]) * (xs[j] - qsumm[j]);
+
+		if (lb > max_d + s->lb_tol) // the candidate cannot be closer than the k-th neighbor
+		{
+			lb_rejects++;
+			continue;
+		}
+#endif
+		dist_evals++;
+#if defined(PRUNE)
+		new_d = compute_dist_sq_pruned(q->x, r->xdata[i], PROBDIM, max_d, &ndims);
+		dims_touched += ndims;
+#elif defined(LBFILTER)
+		new_d = compute_dist_sq(q->x, r->xdata[i], PROBDIM);
+		dims_touched += PROBDIM;
+#else
+		new_d = compute_dist(q->x, r->xdata[i], PROBDIM);
+		dims_touched += PROBDIM;
+#endif
+		if (new_d < max_d) // add point to the list of knns, replace element max_i
+		{
+			q->nn_idx[max_i] = r->ids[i];
+			q->nn_dist[max_i] = new_d;
+			q->nn_val[max_i] = r->ydata[i];
+			max_d = compute_max_pos(q->nn_dist, k, &max_i);
+			topk_inserts++;
+		}
+	}
+
+	if (stats != NULL)
+	{
+		stats->dist_evals += dist_evals;
+		stats->dims_touched += dims_touched;
+		stats->lb_rejects += lb_rejects;
+		stats->topk_inserts += topk_inserts;
+	}
+}
@@ -9,47 +9,80 @@
 
 #include "func.h"
 
+// number of rows generated (in parallel) and written at a time, this bounds the memory footprint of the generator
+#ifndef GEN_CHUNK_ROWS
+#define GEN_CHUNK_ROWS 65536
+#endif
 
-int main(int argc, char *argv[])
+#define GEN_SEED 1	/* the training set is fixed */
+
+/* Generate nrows rows of the random stream `stream` and write them to filename, GEN_CHUNK_ROWS rows at a time.
+ * Each row is keyed by its index in the counter-based generator, so the rows of a chunk are generated in parallel
+ * and the output file is identical for any number of threads.
+ */
+void generate_file(const char *filename, int nrows, uint32_t stream, int fitfun_type, double *mem)
 {
-	// Allocate enough space to store either training data or query data
-	double *mem = (double *)malloc(fmax(TRAINELEMS, QUERYELEMS) * (PROBDIM + 1) * sizeof(double));
+	FILE *fp = fopen(filename, "wb");
+	if (fp == NULL)
+	{
+		printf("fopen(%s, \"wb\") FAILED!\n", filename);
+		exit(1);
+	}
 
-	if (argc != 3)
+	for (long long chunk_start = 0; chunk_start < nrows; chunk_start += GEN_CHUNK_ROWS)
 	{
-		printf("usage: %s <trainfile> <queryfile>\n", argv[0]);
+		int chunk_rows = (chunk_start + GEN_CHUNK_ROWS <= nrows) ? GEN_CHUNK_ROWS : nrows - chunk_start;
+
+		#pragma omp parallel for schedule(static)
+		for (int i = 0; i < chunk_rows; i++)
+		{
+			double *row = &mem[(size_t)i * (PROBDIM + 1)];
+			get_rand_row(GEN_SEED, stream, chunk_start + i, row, PROBDIM);
+			row[PROBDIM] = fitfun_id(row, PROBDIM, fitfun_type);
+		}
+
+		size_t nelems = fwrite(mem, sizeof(double), (size_t)chunk_rows * (PROBDIM + 1), fp);
+		assert(nelems == (size_t)chunk_rows * (PROBDIM + 1)); // check that all elements were actually written
+	}
+	fclose(fp);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3 && argc != 4)
+	{
+		printf("usage: %s <trainfile> <queryfile> [circle|himmelblau|rosenbrock|rastrigin]\n", argv[0]);
 		exit(1);
 	}
 
 	char *trainfile = argv[1];
 	char *queryfile = argv[2];
 
-	SEED_RAND();	/* the training set is fixed */
-
-	// Initialize mem for training data
-	for (int i = 0; i < TRAINELEMS; i++)
+	int fitfun_type = FITFUN_CIRCLE;
+	if (argc == 4)
 	{
-		for (int k = 0; k < PROBDIM; k++)
-			mem[i * (PROBDIM + 1) + k] = get_rand(k);
-
-		mem[i * (PROBDIM + 1) + PROBDIM] = fitfun(&mem[i * (PROBDIM + 1)], PROBDIM);
+		fitfun_type = fitfun_from_name(argv[3]);
+		if (fitfun_type < 0)
+		{
+			printf("unknown function %s\n", argv[3]);
+			exit(1);
+		}
 	}
 
-	store_binary_data(trainfile, mem, TRAINELEMS * (PROBDIM + 1));
-	printf("%d data points written to %s!\n", TRAINELEMS, trainfile);
+	// Allocate enough space to store a chunk of rows
+	double *mem = (double *)malloc((size_t)GEN_CHUNK_ROWS * (PROBDIM + 1) * sizeof(double));
 
-	// Initialize mem for query data
-	for (int i = 0; i < QUERYELEMS; i++)
-	{
-		for (int k = 0; k < PROBDIM; k++)
-			mem[i * (PROBDIM + 1) + k] = get_rand(k);
+	double t0 = gettime();
 
-		mem[i * (PROBDIM + 1) + PROBDIM] = fitfun(&mem[i * (PROBDIM + 1)], PROBDIM);
-	}
+	// the training and query data are drawn from different streams of the generator
+	generate_file(trainfile, TRAINELEMS, 0, fitfun_type, mem);
+	printf("%d data points written to %s!\n", TRAINELEMS, trainfile);
 
-	store_binary_data(queryfile, mem, QUERYELEMS * (PROBDIM + 1));
+	generate_file(queryfile, QUERYELEMS, 1, fitfun_type, mem);
 	printf("%d data points written to %s!\n", QUERYELEMS, queryfile);
 
+	printf("Function = %s, generation time = %lf secs\n", fitfun_names[fitfun_type], gettime() - t0);
+
 	free(mem);
 	return 0;
 }
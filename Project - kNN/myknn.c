@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include "func.h"
+#include "func_perf.h"
 
 #ifndef PROBDIM
 #define PROBDIM 2
@@ -14,9 +15,9 @@ static double *ydata;
 int main(int argc, char *argv[])
 {
 	/* Load all data from files in memory */
-	if (argc != 3)
+	if (argc != 3 && argc != 4)
 	{
-		printf("usage: %s <trainfile> <queryfile>\n", argv[0]);
+		printf("usage: %s <trainfile> <queryfile> [resultfile]\n", argv[0]);
 		exit(1);
 	}
 
@@ -28,21 +29,23 @@ int main(int argc, char *argv[])
 
 	char *trainfile = argv[1];
 	char *queryfile = argv[2];
+	char *resultfile = (argc == 4) ? argv[3] : NULL; // binary file of the neighbors and predictions of each query (see pack_knn_record)
 
-	double *mem = (double *)malloc(TRAINELEMS * (PROBDIM + 1) * sizeof(double));
-	ydata = (double *)malloc(TRAINELEMS * sizeof(double));
-	double *query_mem = (double *)malloc(QUERYELEMS * (PROBDIM + 1) * sizeof(double));
+	/* Carve the large buffers out of a single region, backed by huge pages unless KNN_PAGES selects
+	 * another scheme (see knn_pages_init), so that the scans and the top-k updates take fewer TLB misses.
+	 */
+	arena_t arena;
+	long page_faults = get_page_faults();
+	int pages_mode = knn_pages_init(&arena, knn_region_size());
+
+	double *mem = (double *)knn_alloc(TRAINELEMS * (PROBDIM + 1) * sizeof(double), 64);
+	ydata = (double *)knn_alloc(TRAINELEMS * sizeof(double), 64);
+	double *query_mem = (double *)knn_alloc(QUERYELEMS * (PROBDIM + 1) * sizeof(double), 64);
 	query_t *queries = (query_t *)malloc(QUERYELEMS * sizeof(query_t));
 
-#if defined(SIMD)
-	int posix_res;
-        // Malloc aligned space for query.x data 
-        for (int i = 0; i < QUERYELEMS; i++)
-        {
-                posix_res = posix_memalign((void **)(&(queries[i].x)), 32, PROBDIM * sizeof(double));
-                assert(posix_res == 0);
-        }
-#endif
+	// Allocate the coordinates and the k nearest neighbors of all the queries at once (see query_buffers_t)
+	query_buffers_t query_buffers;
+	alloc_query_buffers(&query_buffers, queries, QUERYELEMS, 1);
 
 	load_binary_data(trainfile, mem, NULL, TRAINELEMS*(PROBDIM+1));
 	load_binary_data(queryfile, query_mem, queries, QUERYELEMS * (PROBDIM + 1));
@@ -58,16 +61,13 @@ int main(int argc, char *argv[])
 	 * We either going to use the xdata of two points (ex. when calculating distance from one another)
 	 * or use ydata (surrogates) (ex. when predicting the value of a query point)
 	 */
-	xdata = (double **)malloc(TRAINELEMS * sizeof(double *));
+	xdata = (double **)knn_alloc(TRAINELEMS * sizeof(double *), 64);
 
 #if defined(SIMD)
 	// Allocate new memory for the handler arrays, so that it is aligned and copy the data there
 	// Align each xdata[i] to a 32 byte boundary so you may later use SIMD
 	for (int i = 0; i < TRAINELEMS; i++)
-	{
-		posix_res = posix_memalign((void **)(&(xdata[i])), 32, PROBDIM * sizeof(double));
-		assert(posix_res == 0);
-	}
+		xdata[i] = (double *)knn_alloc(PROBDIM * sizeof(double), 32);
 	copy_to_aligned(mem, xdata, (PROBDIM+1), PROBDIM, TRAINELEMS);
 #else
 	// Assign to the handler arrays, pointers to the already allocated mem
@@ -76,7 +76,7 @@ int main(int argc, char *argv[])
 #endif
 
 	/* Configure and Initialize the ydata handler arrays */
-	double *query_ydata = malloc(QUERYELEMS * sizeof(double));
+	double *query_ydata = (double *)knn_alloc(QUERYELEMS * sizeof(double), 64);
 	
 	for (int i = 0; i < TRAINELEMS; i++)
 	{
@@ -98,30 +98,77 @@ int main(int argc, char *argv[])
 
 	assert(TRAINELEMS % train_block_size == 0);
 
+#if defined(PRUNE_REORDER)
+	// permute the dimensions, so that the pruned scan sees the largest contributions to the distance first
+	reorder_dims_by_variance(xdata, TRAINELEMS, queries, QUERYELEMS, PROBDIM);
+#endif
+
+#if defined(LBFILTER)
+	/* Summarize each training element and each query point (projections onto the principal axes
+	 * of the training set and residual norm), so that the scan may reject most candidates using
+	 * a lower bound of their distance.
+	 */
+	knn_summary_t summaries;
+	summaries.xsumm = (double *)knn_alloc((size_t)TRAINELEMS * SUMM_SIZE * sizeof(double), 64);
+	double *query_summ = (double *)knn_alloc(QUERYELEMS * SUMM_SIZE * sizeof(double), 64);
+
+	double t_summ = gettime();
+	build_summaries(&summaries, xdata, TRAINELEMS);
+	for (int i = 0; i < QUERYELEMS; i++)
+		compute_point_summary(&summaries, queries[i].x, &query_summ[i * SUMM_SIZE]);
+	t_summ = gettime() - t_summ;
+#endif
+
+	// page faults taken while the buffers were allocated and filled, i.e. before the scan
+	print_pages_report(pages_mode, knn_region_size(), get_page_faults() - page_faults);
+
+	char *records = NULL;
+	if (resultfile != NULL)
+		records = (char *)malloc((size_t)QUERYELEMS * KNN_RECORD_SIZE);
+
 	/* COMPUTATION PART */
 
 	double t0, t1, t_first = 0.0, t_sum = 0.0;
 	double sse = 0.0;
 	double err, err_sum = 0.0;
+	knn_stats_t stats = {0, 0, 0, 0};
+#if defined(KSWEEP)
+	// errors of the predictions with every k <= NNBS, from the same scan (see knn_sweep_t)
+	knn_sweep_t sweep;
+	sweep_init(&sweep);
+#endif
+	double t_bench; // total time, with the same semantics in all variants (see print_bench_record)
+
+	// hardware counters of the scan and of the prediction, if switched on by KNN_PERF (see func_perf.h)
+	perf_thread_t perf;
+	perf_init();
+	perf_thread_open(&perf);
 
 	/* For each training elements block, we calculate each query point's k neighbors,
 	 * using the training elements, that belong to the current training element block.
 	 * The calculation of each query point's neighbors, occurs inside compute_knn_brute_force.
 	 */
+	t_bench = gettime();
+	perf_begin(&perf);
 	for (int train_offset = 0; train_offset < TRAINELEMS; train_offset += train_block_size)
 	{
 		t0 = gettime();
 		for (int i = 0; i < QUERYELEMS; i++)
 		{
-			compute_knn_brute_force(xdata, ydata, &(queries[i]), PROBDIM, NNBS, train_offset, 0, train_block_size);
+#if defined(LBFILTER)
+			compute_knn_brute_force_lb(xdata, &summaries, ydata, &(queries[i]), &query_summ[i * SUMM_SIZE], PROBDIM, NNBS, train_offset, 0, train_block_size, &stats);
+#else
+			compute_knn_brute_force(xdata, ydata, &(queries[i]), PROBDIM, NNBS, train_offset, 0, train_block_size, &stats);
+#endif
 			if (i == 0)
 				t_first += gettime() - t0;
 		}
 		t1 = gettime();
 		t_sum += t1 - t0;
 	}
+	perf_end(&perf, PERF_SCAN);
 
-
+	perf_begin(&perf);
 	for (int i = 0; i < QUERYELEMS; i++)
 	{
 		t0 = gettime();
@@ -137,7 +184,16 @@ int main(int argc, char *argv[])
 		fprintf(fpout,"%.5f %.5f %.2f\n", query_ydata[i], yp, err);
 #endif
 		err_sum += err;
+
+		if (records != NULL)
+			pack_knn_record(&(queries[i]), yp, records + (size_t)i * KNN_RECORD_SIZE);
+#if defined(KSWEEP)
+		sweep_add_query(&sweep, &(queries[i]), query_ydata[i]);
+#endif
 	}
+	perf_end(&perf, PERF_PREDICT);
+	t_bench = gettime() - t_bench;
+	perf_thread_close(&perf, &stats);
 	
 	/* CALCULATE AND DISPLAY RESULTS */
 
@@ -150,34 +206,56 @@ int main(int argc, char *argv[])
 	printf("APE = %.2f %%\n", err_sum / QUERYELEMS);
 	printf("MSE = %.6f\n", mse);
 	printf("R2 = 1 - (MSE/Var) = %.6lf\n", r2);
+#if defined(KSWEEP)
+	print_sweep(&sweep, QUERYELEMS, var);
+#endif
 
 	printf("Total time = %lf secs\n", t_sum);
 	printf("Time for 1st query = %lf secs\n", t_first);
 	printf("Time for 2..N queries = %lf secs\n", t_sum - t_first);
 	printf("Average time/query = %lf secs\n", (t_sum - t_first) / (QUERYELEMS - 1));
+	print_bench_record(argv[0], 1, t_bench);
+#if defined(PRUNE)
+	printf("Dimensions touched/candidate = %.2f (out of %d)\n", (double)stats.dims_touched / stats.dist_evals, PROBDIM);
+#endif
+#if defined(LBFILTER)
+	printf("Candidates rejected by the lower bound = %.2f %% (summaries built in %lf secs)\n",
+	       100.0 * stats.lb_rejects / ((double)TRAINELEMS * QUERYELEMS), t_summ);
+#endif
+	perf_report(argv[0], &perf.c, 1);
+
+	if (records != NULL)
+	{
+		store_knn_results(resultfile, records, QUERYELEMS);
+		printf("Neighbors and predictions written to %s\n", resultfile);
+	}
 
 	/* CLEANUP */
+	free(records);
 
 #if defined(DEBUG)
 	/* Close the output file */
 	fclose(fpout);
 #endif
 
-#if defined(SIMD)
-	for (int i = 0; i < QUERYELEMS; i++)
-		free(queries[i].x);
-#endif
+	free_query_buffers(&query_buffers);
 	free(queries);
-	free(query_ydata);
-	free(query_mem);
+	knn_free(query_ydata);
+	knn_free(query_mem);
 
 #if defined(SIMD)
 	for (int i = 0; i < TRAINELEMS; i++)
-		free(xdata[i]);
+		knn_free(xdata[i]);
+#endif
+	knn_free(xdata);
+	knn_free(ydata);
+	knn_free(mem);
+
+#if defined(LBFILTER)
+	knn_free(summaries.xsumm);
+	knn_free(query_summ);
 #endif
-	free(xdata);
-	free(ydata);
-	free(mem);
+	knn_pages_free();
 
 	return 0;
 }
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+#include <omp.h>
+#include "func.h"
+
+#ifndef PROBDIM
+#define PROBDIM 2
+#endif
+
+#define TRAIN_BLOCK_SIZE 8192
+#define QUERY_BLOCK_SIZE 64
+
+#define NUM_TRAIN_BLOCKS (TRAINELEMS / TRAIN_BLOCK_SIZE)
+
+/* Selection of the k smallest candidates of a tile : single pass quickselect by default,
+ * or the k-pass min search of myknn_acc.c with -DKPASS (for comparison).
+ */
+#if defined(KPASS)
+#define select_k select_k_kpass
+#else
+#define select_k select_k_quickselect
+#endif
+
+int main(int argc, char *argv[])
+{
+	/* Load all data from files in memory */
+	if (argc != 3)
+	{
+		printf("usage: %s <trainfile> <queryfile>\n", argv[0]);
+		exit(1);
+	}
+
+	char *trainfile = argv[1];
+	char *queryfile = argv[2];
+	// check that the size of the training element block divides the TRAINELEMS training elements
+	assert(TRAINELEMS % TRAIN_BLOCK_SIZE == 0);
+
+	// size of the loaded vectors from the input files (PROBDIM + 1 for the surrogate value)
+	int loaded_vector_size = PROBDIM + 1;
+
+	double *mem = (double *)malloc(TRAINELEMS * loaded_vector_size * sizeof(double));
+	double *ydata = (double *)malloc(TRAINELEMS * sizeof(double));
+	double *query_mem = (double *)malloc(QUERYELEMS * loaded_vector_size * sizeof(double));
+
+	load_binary_data(trainfile, mem, NULL, TRAINELEMS*(PROBDIM+1));
+	load_binary_data(queryfile, query_mem, NULL, QUERYELEMS * loaded_vector_size);
+
+	double *query_ydata = malloc(QUERYELEMS * sizeof(double));
+
+	// pure vectors (coordinates without surrogate value), stored contiguously as in myknn_acc.c
+	double *train_vectors = (double *)malloc((size_t)TRAINELEMS * PROBDIM * sizeof(double));
+	double *query_vectors = (double *)malloc((size_t)QUERYELEMS * PROBDIM * sizeof(double));
+	for (int i = 0; i < TRAINELEMS; i++)
+		for (int k = 0; k < PROBDIM; k++)
+			train_vectors[(size_t)i * PROBDIM + k] = mem[(size_t)i * loaded_vector_size + k];
+	for (int i = 0; i < QUERYELEMS; i++)
+		for (int k = 0; k < PROBDIM; k++)
+			query_vectors[i * PROBDIM + k] = query_mem[i * loaded_vector_size + k];
+
+	// NNBS candidate neighbors per query point and training element block
+	int *reduced_nn_idx = (int *)malloc((size_t)QUERYELEMS * NUM_TRAIN_BLOCKS * NNBS * sizeof(int));
+	double *reduced_nn_dist = (double *)malloc((size_t)QUERYELEMS * NUM_TRAIN_BLOCKS * NNBS * sizeof(double));
+
+	for (int i = 0; i < TRAINELEMS; i++)
+	{
+#if defined(SURROGATES)
+		ydata[i] = mem[i * loaded_vector_size + PROBDIM];
+#else
+		ydata[i] = 0;
+#endif
+	}
+
+	for (int i = 0; i < QUERYELEMS; i++)
+	{
+#if defined(SURROGATES)
+		query_ydata[i] = query_mem[i * loaded_vector_size + PROBDIM];
+#else
+		query_ydata[i] = 0;
+#endif
+	}
+
+	/* COMPUTATION PART */
+	double t_sum, t_select = 0.0;
+	double sse = 0.0;
+	double err_sum = 0.0;
+
+	double t_start = gettime();
+	/* The two level blocking algorithm of myknn_acc.c, on the CPU : for each block of query points, the distances
+	 * of each query point to the training elements of each training element block form a tile of TRAIN_BLOCK_SIZE
+	 * distances, which is reduced into NNBS candidate neighbors. The N * NNBS candidates of each query point
+	 * (N training element blocks) are then reduced into its final NNBS neighbors.
+	 *
+	 * Unlike the GPU version, each thread computes a whole tile into its own scratch arrays and reduces it
+	 * right away, while it is still in the cache, so no (QUERY_BLOCK_SIZE x TRAINELEMS) scratchpad is needed.
+	 * Both reductions use select_k : a single quickselect pass over the tile, instead of NNBS passes.
+	 */
+	#pragma omp parallel reduction(+ : t_select)
+	{
+		double *tile_dist = (double *)malloc(TRAIN_BLOCK_SIZE * sizeof(double));
+		int *tile_idx = (int *)malloc(TRAIN_BLOCK_SIZE * sizeof(int));
+
+		for (int query_block = 0; query_block < QUERYELEMS; query_block += QUERY_BLOCK_SIZE) 		// choose query block
+		{
+			#pragma omp for collapse(2) schedule(static) nowait
+			for (int train_block = 0; train_block < TRAINELEMS; train_block += TRAIN_BLOCK_SIZE)	// choose training block
+			{
+				for (int query_el = 0; query_el < QUERY_BLOCK_SIZE; query_el++)		// choose query point
+				{
+					int g_query_el_idx = query_block + query_el;	// global query element index
+					if (g_query_el_idx >= QUERYELEMS)
+						continue;
+
+					// calculate distances for the chosen query point with each training point in this block
+					for (int train_el = 0; train_el < TRAIN_BLOCK_SIZE; train_el++)
+					{
+						int g_train_el_idx = train_block + train_el;	// global training element index
+						tile_dist[train_el] = compute_dist(&query_vectors[g_query_el_idx * PROBDIM],
+						                                   &train_vectors[(size_t)g_train_el_idx * PROBDIM], PROBDIM);
+						tile_idx[train_el] = g_train_el_idx;
+					}
+
+					double t0 = gettime();
+					size_t red = ((size_t)g_query_el_idx * NUM_TRAIN_BLOCKS + train_block / TRAIN_BLOCK_SIZE) * NNBS;
+					select_k(tile_dist, tile_idx, TRAIN_BLOCK_SIZE, NNBS, &reduced_nn_dist[red], &reduced_nn_idx[red]);
+					t_select += gettime() - t0;
+				}
+			}
+		}
+		free(tile_dist);
+		free(tile_idx);
+
+		// every candidate must be in place before the final reduction
+		#pragma omp barrier
+
+		/* Reduce the N * NNBS candidates of each query point into its final NNBS neighbors,
+		 * and predict its value using their surrogate values.
+		 */
+		double nn_dist[NNBS];
+		int nn_idx[NNBS];
+		#pragma omp for reduction(+ : sse, err_sum)
+		for (int query_el = 0; query_el < QUERYELEMS; query_el++)
+		{
+			size_t red = (size_t)query_el * NUM_TRAIN_BLOCKS * NNBS;
+
+			double t0 = gettime();
+			select_k(&reduced_nn_dist[red], &reduced_nn_idx[red], NUM_TRAIN_BLOCKS * NNBS, NNBS, nn_dist, nn_idx);
+			t_select += gettime() - t0;
+
+			double sum = 0.0;
+			for (int neigh = 0; neigh < NNBS; neigh++)
+				sum += ydata[nn_idx[neigh]]; // gather "neigh" neighbor value
+
+			double yp = sum / NNBS;
+			sse += (query_ydata[query_el] - yp) * (query_ydata[query_el] - yp);
+			err_sum += 100.0 * fabs((yp - query_ydata[query_el]) / query_ydata[query_el]);
+		}
+	}
+	t_sum = gettime() - t_start;
+
+	/* CALCULATE AND DISPLAY RESULTS */
+
+	double mse = sse / QUERYELEMS;
+	double ymean = compute_mean(query_ydata, QUERYELEMS);
+	double var = compute_var(query_ydata, QUERYELEMS, ymean);
+	double r2 = 1 - (mse / var);
+	int nthreads = omp_get_max_threads();
+
+	printf("Results for %d query points\n", QUERYELEMS);
+	printf("APE = %.2f %%\n", err_sum / QUERYELEMS);
+	printf("MSE = %.6f\n", mse);
+	printf("R2 = 1 - (MSE/Var) = %.6lf\n", r2);
+
+	printf("Total Computing time = %lf secs\n", t_sum);
+	printf("Average time/query = %lf secs\n", t_sum / QUERYELEMS);
+#if defined(KPASS)
+	printf("Selection (k-pass min search) time = %lf secs, summed over %d threads\n", t_select, nthreads);
+#else
+	printf("Selection (quickselect) time = %lf secs, summed over %d threads\n", t_select, nthreads);
+#endif
+	print_bench_record(argv[0], nthreads, t_sum);
+
+	/* CLEANUP */
+	free(mem);
+	free(ydata);
+	free(query_mem);
+	free(query_ydata);
+
+	free(train_vectors);
+	free(query_vectors);
+
+	free(reduced_nn_idx);
+	free(reduced_nn_dist);
+
+	return 0;
+}
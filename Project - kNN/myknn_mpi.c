@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include "func_mpi.h"
+#include "func_perf.h"
 #include <stddef.h>
 
 #ifndef PROBDIM
@@ -29,13 +30,14 @@ double find_knn_value(query_t *q, int knn)
 int main(int argc, char *argv[])
 {
 	/* Load all data from files in memory */
-	if (argc != 3)
+	if (argc != 3 && argc != 4)
 	{
-		printf("usage: %s <trainfile> <queryfile>\n", argv[0]);
+		printf("usage: %s <trainfile> <queryfile> [resultfile]\n", argv[0]);
 		exit(1);
 	}
 	char *trainfile = argv[1];
 	char *queryfile = argv[2];
+	char *resultfile = (argc == 4) ? argv[3] : NULL; // binary file of the neighbors and predictions of each query (see pack_knn_record)
 
         // MPI Init
         int rank, nprocs;
@@ -59,14 +61,11 @@ int main(int argc, char *argv[])
 	double *query_mem = (double *)malloc(QUERYELEMS * vector_size * sizeof(double));
 	query_t *queries = (query_t *)malloc(QUERYELEMS * sizeof(query_t));
 
+	// Allocate the coordinates and the k nearest neighbors of all the queries at once (see query_buffers_t)
+	query_buffers_t query_buffers;
+	alloc_query_buffers(&query_buffers, queries, QUERYELEMS, 1);
 #if defined(SIMD)
 	int posix_res;
-        // Malloc aligned space for query.x data 
-        for (int i = 0; i < QUERYELEMS; i++)
-        {
-                posix_res = posix_memalign((void **)(&(queries[i].x)), 32, PROBDIM * sizeof(double));
-                assert(posix_res == 0);
-        }
 #endif
 
 	/* Create a handler array that will be used to separate xdata's PROBDIM vectors
@@ -121,43 +120,40 @@ int main(int argc, char *argv[])
 	double t0, t1, t2 = 0.0, t_first = 0.0, t_sum = 0.0;
 	double sse = 0.0;
 	double err_sum = 0.0;
+	knn_stats_t stats = {0, 0, 0, 0};
+
+	// per-rank hardware counters of the scan and of the prediction, if switched on by KNN_PERF (see func_perf.h)
+	perf_thread_t perf;
+	perf_init();
+	perf_thread_open(&perf);
 
 	int queryelems_blocksize = QUERYELEMS / nprocs;
-	int rank_in_charge;
 	
-	// we need an MPI_Request object per asynchronous communication call
-	MPI_Request request[nprocs - 1];
-	MPI_Status status;
+	// we need an MPI_Request object per asynchronous communication call (three messages per destination rank)
+	MPI_Request request[3 * (nprocs - 1)];
+	int nrequests = 0;
 
 	int first_query = rank * queryelems_blocksize;
 	int last_query = (rank + 1) * queryelems_blocksize - 1;
 
 	if (rank == nprocs - 1)
 		last_query = QUERYELEMS - 1;
+
+	// records of the queries under the rank's responsibility, for the binary results file
+	char *records = NULL;
+	if (resultfile != NULL)
+		records = (char *)malloc((size_t)(last_query - first_query + 1) * KNN_RECORD_SIZE);
 	
-        /* Configure the Derived Datatype for the query_t struct 
-	 * Each query_t object contains: 
-	 * - a pointer to a double vector of size PROBDIM (we don't need to send this vector, 
-	 *   so don't account its size)
-	 * - an integer array of size NNBS 
-	 * - two double arrays of size NNBS
+	/* The k nearest neighbors of the queries are stored in contiguous arrays (see query_buffers_t), so the neighbors
+	 * of each rank's block of queries are sent as plain contiguous messages, with no derived datatype.
+	 * Need enough space to receive the neighbors of our block of queries found by one other rank at a time.
 	 */
-	MPI_Datatype mpi_query_t;                                 // The name of the Derived Datatype
-        MPI_Datatype type[3] = {MPI_INT, MPI_DOUBLE, MPI_DOUBLE}; // The MPI_Datatype of each struct member
-        int blocklen[3] = {NNBS, NNBS, NNBS};                     // The size of each array (use 1 if scalar)
-        MPI_Aint disp[3];                                         // MPI Array of displacements
-
-        disp[0] = offsetof(query_t, nn_idx);
-        disp[1] = offsetof(query_t, nn_dist);
-        disp[2] = offsetof(query_t, nn_val);
-
-        MPI_Type_create_struct(3, blocklen, disp, type, &mpi_query_t);
-        MPI_Type_commit(&mpi_query_t);
-
-	// Need enough space to store all query_t structs sent by every other rank.
-	query_t *rcv_buf = (query_t *)malloc((nprocs - 1) * sizeof(query_t));
+	int local_nqueries = last_query - first_query + 1;
+	query_t *rcv_queries = (query_t *)malloc(local_nqueries * sizeof(query_t));
+	query_buffers_t rcv_buffers;
+	alloc_query_buffers(&rcv_buffers, rcv_queries, local_nqueries, 0);
 	
-	int global_block_offset = rank * local_ntrainelems;
+	int global_block_offset = trainelem_offset / vector_size; // (the last rank may hold more training elements)
 	/* Each rank is responsible for calculating the k neighbors of each query point,
 	 * using only the training elements block it has been assigned. The block's boundaries are defined as:
 	 * start = rank * local_ntrainelems * vector_size (i.e. global_train_offset) 
@@ -165,51 +161,61 @@ int main(int argc, char *argv[])
 	 * The calculation of each query point's neighbors, occurs inside compute_knn_brute_force.
 	 *
 	 * Within each Training Elemet block, each rank is responsible for :
-	 * a) Calculating the k neighbors of **all** query points
-	 * b) Sending each query that it is not responsible for, to the correct rank.
+	 * a) Calculating the k neighbors of **all** query points, one block of queries (i.e. one destination rank) at a time.
+	 *    The blocks are visited starting from the next rank's block, so that the rank's own block comes last.
+	 * b) Sending the k neighbors of each block that it is not responsible for, to the correct rank, as soon as the block is done.
 	 * c) Gathering collections of k neighbors for the subset of query points defined by [start, end].
 	 *    These collections are calculated (step a) and sent (step b) by the other ranks (i.e. from other training elements blocks).
 	 * d) Calculating the final k nearest neighbors, using the collections gathered at step (c). (reduction)
 	 */
+	MPI_Barrier(MPI_COMM_WORLD);
+	double t_bench = gettime(); // total time, with the same semantics in all variants (see print_bench_record)
 	t0 = gettime();
 
 	// (a) and (b) Calculate and send the k neighbors found in the training block for **all** query points.
+	perf_begin(&perf);
 
-	for (int i = 0; i < QUERYELEMS; i++)
+	for (int step = 1; step <= nprocs; step++)
 	{
-                if (i == first_query)
-                        t2 = gettime();
+		int dest = (rank + step) % nprocs;
+		int dest_first = dest * queryelems_blocksize;
+		int dest_nqueries = (dest == nprocs - 1) ? QUERYELEMS - dest_first : queryelems_blocksize;
+
+		for (int i = dest_first; i < dest_first + dest_nqueries; i++)
+		{
+			if (i == first_query)
+				t2 = gettime();
 
-		compute_knn_brute_force(xdata, ydata, &(queries[i]), PROBDIM, NNBS, global_block_offset, 0, local_ntrainelems);
+			compute_knn_brute_force(xdata, ydata, &(queries[i]), PROBDIM, NNBS, global_block_offset, 0, local_ntrainelems, &stats);
 
-		rank_in_charge = get_rank_in_charge_of(i, queryelems_blocksize, nprocs);
-		if (rank_in_charge != rank)
-			MPI_Isend(&(queries[i]), 1, mpi_query_t, rank_in_charge, i, MPI_COMM_WORLD, &request[rank_in_charge]);
+			if (i == first_query)
+				t_first += gettime() - t2;
+		}
 
-                if (i == first_query)
-                        t_first += gettime() - t2;
+		if (dest != rank)
+		{
+			isend_knn_block_mpi(&query_buffers, dest_first, dest_nqueries, dest, &request[nrequests]);
+			nrequests += 3;
+		}
 	}
+	perf_end(&perf, PERF_SCAN);
 
-	int rcv_buf_offset = 0;
         t2 = gettime();
-	for (int i = first_query; i <= last_query; i++)
+	for (int j = 0; j < nprocs; j++)
 	{
-		// (c) Gather the collections of k nearest neighbors sent by the other ranks. 
-		rcv_buf_offset = 0;
-		for (int j = 0; j < nprocs; j++)
-		{
-			if (j == rank)
-				continue;
+		if (j == rank)
+			continue;
 
-                        assert(rcv_buf_offset < nprocs);
-			MPI_Recv(&(rcv_buf[rcv_buf_offset++]), 1, mpi_query_t, j, i, MPI_COMM_WORLD, &status);
-		}
-		// (d) Update the k neighbors of each query points under our control using the data we received from the other ranks.
-		reduce_in_struct(&(queries[i]), rcv_buf, nprocs - 1);
+		// (c) Gather the collection of k nearest neighbors of our queries, found by rank j.
+		recv_knn_block_mpi(&rcv_buffers, local_nqueries, j);
 
-                if (i == first_query)
-                        t_first += gettime() - t2;
+		// (d) Update the k neighbors of each query points under our control using the data we received from rank j.
+		for (int i = first_query; i <= last_query; i++)
+			reduce_in_struct(&(queries[i]), &(rcv_queries[i - first_query]), 1);
 	}
+	// the neighbors of each block arrive all together, so the first query is only final when the whole block is
+	t_first += gettime() - t2;
+	MPI_Waitall(nrequests, request, MPI_STATUSES_IGNORE);
 	t1 = gettime();
 	t_sum = t1 - t0;
         
@@ -232,6 +238,7 @@ int main(int argc, char *argv[])
         /* Calculate yp and the errors/metrics for all queries under the rank's responsibility
          * We must preserve the calculated values and error metrics, when we are in DEBUG mode.
 	 */
+	perf_begin(&perf);
 	for (int i = first_query; i <= last_query; i++)
 	{
 		t0 = gettime();
@@ -245,6 +252,13 @@ int main(int argc, char *argv[])
 		if(i == first_query)
 			t_first += t1 - t0;
 
+		if (records != NULL)
+#if defined(DEBUG)
+			pack_knn_record(&(queries[i]), yp[local_idx], records + (size_t)(i - first_query) * KNN_RECORD_SIZE);
+#else
+			pack_knn_record(&(queries[i]), yp, records + (size_t)(i - first_query) * KNN_RECORD_SIZE);
+#endif
+
 #if defined(DEBUG)
 		sse += (query_ydata[i] - yp[local_idx]) * (query_ydata[i] - yp[local_idx]);
 		err[local_idx] = 100.0 * fabs((yp[local_idx] - query_ydata[i]) / query_ydata[i]);
@@ -254,6 +268,9 @@ int main(int argc, char *argv[])
 		err_sum += 100.0 * fabs((yp - query_ydata[i]) / query_ydata[i]);
 #endif
 	}
+	perf_end(&perf, PERF_PREDICT);
+	t_bench = gettime() - t_bench;
+	perf_thread_close(&perf, &stats);
 
 #if defined(DEBUG)
         // Write the output file
@@ -296,11 +313,20 @@ int main(int argc, char *argv[])
         // Collectively write data to the output text file, using the rank-specific offsets 
         MPI_File_write_at_all(f, base + global_char_offset, buf, strlen(buf), MPI_CHAR, MPI_STATUS_IGNORE);
 #endif
+
+	// Collectively write the binary results file, each rank at the fixed offset of its first query
+	if (records != NULL)
+	{
+		store_knn_results_mpi(resultfile, records, first_query, last_query - first_query + 1);
+		if (rank == 0)
+			printf("Neighbors and predictions written to %s\n", resultfile);
+	}
         
 	/* CALCULATE AND DISPLAY RESULTS */
 
 	// Reduce all metrics to the root rank (i.e. rank 0)
         MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &t_sum, &t_sum, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD); // set max time as total time
+        MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &t_bench, &t_bench, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
 	MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &t_first, &t_first, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD); // sum time for first queries
 	MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &err_sum, &err_sum, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
 	MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &sse, &sse, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
@@ -321,7 +347,9 @@ int main(int argc, char *argv[])
 		printf("Average time for 1st query = %lf secs\n", t_first / nprocs);
 		printf("Time for 2..N queries = %lf secs\n", t_sum - t_first);
 		printf("Average time/query = %lf secs\n", t_sum / QUERYELEMS);
+		print_bench_record(argv[0], nprocs, t_bench);
         }
+	perf_report_mpi(argv[0], &perf.c);
 
 	/* CLEANUP */
         // MPI_Reduce does not guarantee that a non-root process will not reach here
@@ -333,13 +361,11 @@ int main(int argc, char *argv[])
 	MPI_File_close(&f);
 #endif
 
-#if defined(SIMD)
-	for (int i = 0; i < QUERYELEMS; i++)
-		free(queries[i].x);
-#endif
+	free_query_buffers(&query_buffers);
 	free(queries);
 	free(query_ydata);
 	free(query_mem);
+	free(records);
 
 #if defined(SIMD)
 	for (int i = 0; i < local_ntrainelems; i++)
@@ -349,7 +375,8 @@ int main(int argc, char *argv[])
 	free(ydata);
 	free(mem);
 
-	free(rcv_buf);
+	free_query_buffers(&rcv_buffers);
+	free(rcv_queries);
 
 	MPI_Finalize();
 	return 0;
@@ -28,13 +28,14 @@ double find_knn_value(query_t *q, int knn)
 int main(int argc, char *argv[])
 {
 	/* Load all data from files in memory */
-	if (argc != 3)
+	if (argc != 3 && argc != 4)
 	{
-		printf("usage: %s <trainfile> <queryfile>\n", argv[0]);
+		printf("usage: %s <trainfile> <queryfile> [resultfile]\n", argv[0]);
 		exit(1);
 	}
 	char *trainfile = argv[1];
 	char *queryfile = argv[2];
+	char *resultfile = (argc == 4) ? argv[3] : NULL; // binary file of the neighbors and predictions of each query (see pack_knn_record)
 
         // MPI Init
         int rank, nprocs;
@@ -58,14 +59,11 @@ int main(int argc, char *argv[])
 	double *query_mem = (double *)malloc(QUERYELEMS * vector_size * sizeof(double));
 	query_t *queries = (query_t *)malloc(QUERYELEMS * sizeof(query_t));
 
+	// Allocate the coordinates and the k nearest neighbors of all the queries at once (see query_buffers_t)
+	query_buffers_t query_buffers;
+	alloc_query_buffers(&query_buffers, queries, QUERYELEMS, 1);
 #if defined(SIMD)
 	int posix_res;
-        // Malloc aligned space for query.x data 
-        for (int i = 0; i < QUERYELEMS; i++)
-        {
-                posix_res = posix_memalign((void **)(&(queries[i].x)), 32, PROBDIM * sizeof(double));
-                assert(posix_res == 0);
-        }
 #endif
 
 	/* Create a handler array that will be used to separate xdata's PROBDIM vectors
@@ -122,10 +120,11 @@ int main(int argc, char *argv[])
 	double err_sum = 0.0;
 
 	int queryelems_blocksize = QUERYELEMS / nprocs;
-	int rank_in_charge, pack_pos = 0;
+	int pack_pos = 0;
 	
 	// we need an MPI_Request object per asynchronous communication call
 	MPI_Request request[nprocs - 1];
+	int nrequests = 0;
 	MPI_Status status;
 
 	int first_query = rank * queryelems_blocksize;
@@ -134,26 +133,33 @@ int main(int argc, char *argv[])
 	if (rank == nprocs - 1)
 		last_query = QUERYELEMS - 1;
 
-	// Calculate the necessary sizes in order to allocate a temp buffer for use with MPI_Pack
-	int size_int_arr, size_double_arr;
-	MPI_Pack_size(NNBS, MPI_INT, MPI_COMM_WORLD, &size_int_arr);
-	MPI_Pack_size(NNBS, MPI_DOUBLE, MPI_COMM_WORLD, &size_double_arr);
-	
-	/* Each query_t object contains: 
-	 * - a pointer to a double vector of size PROBDIM (we don't need to send this vector, 
-	 *   so don't account its size)
-	 * - an integer array of size NNBS -> size_int_arr
-	 * - two double arrays of size NNBS -> 2 * size_double_arr .
-	 * Therefore, the total buffer size is equal to :
+	// records of the queries under the rank's responsibility, for the binary results file
+	char *records = NULL;
+	if (resultfile != NULL)
+		records = (char *)malloc((size_t)(last_query - first_query + 1) * KNN_RECORD_SIZE);
+
+	/* The k nearest neighbors of a block of consecutive queries are stored in three contiguous arrays
+	 * (see query_buffers_t) : an integer array of block_size * NN_IDX_STRIDE elements and two double arrays
+	 * of block_size * NN_STRIDE elements. Each block is packed into a single message.
+	 * Calculate the necessary sizes in order to allocate the buffers for use with MPI_Pack, for the largest block.
 	 */
+	int max_block_size = queryelems_blocksize + QUERYELEMS % nprocs;
+	int size_int_arr, size_double_arr;
+	MPI_Pack_size(max_block_size * NN_IDX_STRIDE, MPI_INT, MPI_COMM_WORLD, &size_int_arr);
+	MPI_Pack_size(max_block_size * NN_STRIDE, MPI_DOUBLE, MPI_COMM_WORLD, &size_double_arr);
 	int pack_buf_size = size_int_arr + 2 * size_double_arr;
 
-	// Buffer for the MPI "packets"
-	char *pack_buf = (char *)malloc(pack_buf_size * sizeof(char));
-	// Need enough space to store all query_t structs sent by every other rank.
-	query_t *rcv_buf = (query_t *)malloc((nprocs - 1) * sizeof(query_t));
+	// Buffers for the MPI "packets" : one per destination rank, since the sends are non-blocking, and one to receive
+	char *pack_buf = (char *)malloc((size_t)nprocs * pack_buf_size * sizeof(char));
+	char *rcv_pack_buf = (char *)malloc(pack_buf_size * sizeof(char));
+
+	// Need enough space to unpack the neighbors of our block of queries found by one other rank at a time.
+	int local_nqueries = last_query - first_query + 1;
+	query_t *rcv_queries = (query_t *)malloc(local_nqueries * sizeof(query_t));
+	query_buffers_t rcv_buffers;
+	alloc_query_buffers(&rcv_buffers, rcv_queries, local_nqueries, 0);
 
-	int global_block_offset = rank * local_ntrainelems;
+	int global_block_offset = trainelem_offset / vector_size; // (the last rank may hold more training elements)
 	/* Each rank is responsible for calculating the k neighbors of each query point,
 	 * using only the training elements block it has been assigned. The block's boundaries are defined as:
 	 * start = rank * local_ntrainelems * vector_size (i.e. global_train_offset) // NOT entirely correct...
@@ -161,60 +167,63 @@ int main(int argc, char *argv[])
 	 * The calculation of each query point's neighbors, occurs inside compute_knn_brute_force.
 	 *
 	 * Within each block, each rank is responsible for :
-	 * a) Calculating the k neighbors of **all** query points
-	 * b) Sending each query that it is not responsible for, to the correct rank.
+	 * a) Calculating the k neighbors of **all** query points, one block of queries (i.e. one destination rank) at a time.
+	 *    The blocks are visited starting from the next rank's block, so that the rank's own block comes last.
+	 * b) Sending the k neighbors of each block that it is not responsible for, to the correct rank, as soon as the block is done.
 	 * c) Gathering collections of k neighbors for the subset of query points defined by [query_chunk_start, query_chunk_end].
 	 *    These collections are calculated (step a) and sent (step b) by the other ranks (i.e. from other training elements blocks).
 	 * d) Calculating the final k nearest neighbors, using the collections gathered at step (c). (reduction)
 	 */
+	MPI_Barrier(MPI_COMM_WORLD);
+	double t_bench = gettime(); // total time, with the same semantics in all variants (see print_bench_record)
 	t0 = gettime();
 
 	// (a) and (b) Calculate and send the k neighbors found in the training block for **all** query points.
 
-	for (int i = 0; i < QUERYELEMS; i++)
+	for (int step = 1; step <= nprocs; step++)
 	{
-		compute_knn_brute_force(xdata, ydata, &(queries[i]), PROBDIM, NNBS, global_block_offset, 0, local_ntrainelems);
+		int dest = (rank + step) % nprocs;
+		int dest_first = dest * queryelems_blocksize;
+		int dest_nqueries = (dest == nprocs - 1) ? QUERYELEMS - dest_first : queryelems_blocksize;
+
+		for (int i = dest_first; i < dest_first + dest_nqueries; i++)
+			compute_knn_brute_force(xdata, ydata, &(queries[i]), PROBDIM, NNBS, global_block_offset, 0, local_ntrainelems, NULL);
 
-		rank_in_charge = get_rank_in_charge_of(i, queryelems_blocksize, nprocs);
                 // We use MPI_Pack to make code portable
-		if (rank_in_charge != rank)
+		if (dest != rank)
 		{
+			char *buf = &pack_buf[(size_t)dest * pack_buf_size];
 			pack_pos = 0;
-			MPI_Pack(queries[i].nn_idx, NNBS, MPI_INT, pack_buf, pack_buf_size, &pack_pos, MPI_COMM_WORLD);
-			MPI_Pack(queries[i].nn_dist, NNBS, MPI_DOUBLE, pack_buf, pack_buf_size, &pack_pos, MPI_COMM_WORLD);
-			MPI_Pack(queries[i].nn_val, NNBS, MPI_DOUBLE, pack_buf, pack_buf_size, &pack_pos, MPI_COMM_WORLD);
+			MPI_Pack(&query_buffers.nn_idx[(size_t)dest_first * NN_IDX_STRIDE], dest_nqueries * NN_IDX_STRIDE, MPI_INT, buf, pack_buf_size, &pack_pos, MPI_COMM_WORLD);
+			MPI_Pack(&query_buffers.nn_dist[(size_t)dest_first * NN_STRIDE], dest_nqueries * NN_STRIDE, MPI_DOUBLE, buf, pack_buf_size, &pack_pos, MPI_COMM_WORLD);
+			MPI_Pack(&query_buffers.nn_val[(size_t)dest_first * NN_STRIDE], dest_nqueries * NN_STRIDE, MPI_DOUBLE, buf, pack_buf_size, &pack_pos, MPI_COMM_WORLD);
 			assert(pack_pos <= pack_buf_size);
-			
+
 			// Send the "packet" message
-			MPI_Isend(pack_buf, pack_buf_size, MPI_PACKED, rank_in_charge, i, MPI_COMM_WORLD, &request[rank_in_charge]);
+			MPI_Isend(buf, pack_pos, MPI_PACKED, dest, 0, MPI_COMM_WORLD, &request[nrequests++]);
 		}
 	}
 
-	int rcv_buf_offset = 0;
-	for (int i = first_query; i <= last_query; i++)
+	for (int j = 0; j < nprocs; j++)
 	{
-		// (c) Gather the collections of k nearest neighbors sent by the other ranks.
-		rcv_buf_offset = 0;
-		for (int j = 0; j < nprocs; j++)
-		{
-			if (j == rank)
-				continue;
-
-			// Receive the "packet" message
-			// MPI_Recv(pack_buf, pack_buf_size, MPI_PACKED, j, i, MPI_COMM_WORLD, &status);
-			MPI_Recv(pack_buf, pack_buf_size, MPI_BYTE, j, i, MPI_COMM_WORLD, &status); // WTF NOW BOTH WORK
-
-			// Unpack the "packet" message	
-			pack_pos = 0;
-			MPI_Unpack(pack_buf, pack_buf_size, &pack_pos, rcv_buf[rcv_buf_offset].nn_idx, NNBS, MPI_INT, MPI_COMM_WORLD);
-			MPI_Unpack(pack_buf, pack_buf_size, &pack_pos, rcv_buf[rcv_buf_offset].nn_dist, NNBS, MPI_DOUBLE, MPI_COMM_WORLD);
-			MPI_Unpack(pack_buf, pack_buf_size, &pack_pos, rcv_buf[rcv_buf_offset].nn_val, NNBS, MPI_DOUBLE, MPI_COMM_WORLD);
-			rcv_buf_offset++;
-			assert(pack_pos <= pack_buf_size);
-		}
-		// (d) Update the k neighbors of each query points under our control using the data we received from the other ranks.
-		reduce_in_struct(&(queries[i]), rcv_buf, nprocs - 1);
+		if (j == rank)
+			continue;
+
+		// (c) Gather the collection of k nearest neighbors of our queries, found by rank j.
+		MPI_Recv(rcv_pack_buf, pack_buf_size, MPI_PACKED, j, 0, MPI_COMM_WORLD, &status);
+
+		// Unpack the "packet" message
+		pack_pos = 0;
+		MPI_Unpack(rcv_pack_buf, pack_buf_size, &pack_pos, rcv_buffers.nn_idx, local_nqueries * NN_IDX_STRIDE, MPI_INT, MPI_COMM_WORLD);
+		MPI_Unpack(rcv_pack_buf, pack_buf_size, &pack_pos, rcv_buffers.nn_dist, local_nqueries * NN_STRIDE, MPI_DOUBLE, MPI_COMM_WORLD);
+		MPI_Unpack(rcv_pack_buf, pack_buf_size, &pack_pos, rcv_buffers.nn_val, local_nqueries * NN_STRIDE, MPI_DOUBLE, MPI_COMM_WORLD);
+		assert(pack_pos <= pack_buf_size);
+
+		// (d) Update the k neighbors of each query points under our control using the data we received from rank j.
+		for (int i = first_query; i <= last_query; i++)
+			reduce_in_struct(&(queries[i]), &(rcv_queries[i - first_query]), 1);
 	}
+	MPI_Waitall(nrequests, request, MPI_STATUSES_IGNORE);
 	t1 = gettime();
 	t_sum = t1 - t0;
         
@@ -250,6 +259,13 @@ int main(int argc, char *argv[])
 		if(i == first_query)
 			t_first += t1 - t0;
 
+		if (records != NULL)
+#if defined(DEBUG)
+			pack_knn_record(&(queries[i]), yp[local_idx], records + (size_t)(i - first_query) * KNN_RECORD_SIZE);
+#else
+			pack_knn_record(&(queries[i]), yp, records + (size_t)(i - first_query) * KNN_RECORD_SIZE);
+#endif
+
 #if defined(DEBUG)
 		sse += (query_ydata[i] - yp[local_idx]) * (query_ydata[i] - yp[local_idx]);
 		err[local_idx] = 100.0 * fabs((yp[local_idx] - query_ydata[i]) / query_ydata[i]);
@@ -259,6 +275,7 @@ int main(int argc, char *argv[])
 		err_sum += 100.0 * fabs((yp - query_ydata[i]) / query_ydata[i]);
 #endif
 	}
+	t_bench = gettime() - t_bench;
 
 #if defined(DEBUG)
         // Write the output file
@@ -301,11 +318,20 @@ int main(int argc, char *argv[])
         // Collectively write data to the output text file, using the rank-specific offsets 
         MPI_File_write_at_all(f, base + global_char_offset, buf, strlen(buf), MPI_CHAR, MPI_STATUS_IGNORE);
 #endif
+
+	// Collectively write the binary results file, each rank at the fixed offset of its first query
+	if (records != NULL)
+	{
+		store_knn_results_mpi(resultfile, records, first_query, last_query - first_query + 1);
+		if (rank == 0)
+			printf("Neighbors and predictions written to %s\n", resultfile);
+	}
         
 	/* CALCULATE AND DISPLAY RESULTS */
 
 	// Reduce all metrics to the root rank (i.e. rank 0)
         MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &t_sum, &t_sum, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD); // set max time as total time
+        MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &t_bench, &t_bench, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
 	MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &t_first, &t_first, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD); // sum time for first queries
 	MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &err_sum, &err_sum, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
 	MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &sse, &sse, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
@@ -328,6 +354,7 @@ int main(int argc, char *argv[])
 		printf("Average time for 1st query = %lf secs\n", t_first / nprocs);
 		printf("Time for 2..N queries = %lf secs\n", t_sum - t_first);
 		printf("Average time/query = %lf secs\n", t_sum / QUERYELEMS);
+		print_bench_record(argv[0], nprocs, t_bench);
         }
 
 	/* CLEANUP */
@@ -340,13 +367,11 @@ int main(int argc, char *argv[])
 	MPI_File_close(&f);
 #endif
 
-#if defined(SIMD)
-	for (int i = 0; i < QUERYELEMS; i++)
-		free(queries[i].x);
-#endif
+	free_query_buffers(&query_buffers);
 	free(queries);
 	free(query_ydata);
 	free(query_mem);
+	free(records);
 
 #if defined(SIMD)
 	for (int i = 0; i < local_ntrainelems; i++)
@@ -356,8 +381,10 @@ int main(int argc, char *argv[])
 	free(ydata);
 	free(mem);
 
-	free(rcv_buf);
+	free_query_buffers(&rcv_buffers);
+	free(rcv_queries);
 	free(pack_buf);
+	free(rcv_pack_buf);
 
 	MPI_Finalize();
 	return 0;
@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+#include "func_mpi.h"
+#include <stddef.h>
+
+#ifndef PROBDIM
+#define PROBDIM 2
+#endif
+
+// number of queries that travel together around the ring of ranks
+#ifndef QUERY_BLOCK_SIZE
+#define QUERY_BLOCK_SIZE 256
+#endif
+
+static double **xdata;
+static double *ydata;
+
+double find_knn_value(query_t *q, int knn)
+{
+#if defined(SIMD)
+	__attribute__((aligned(32))) double fd[knn];	// function values for the knn neighbors
+#else
+	double fd[knn];
+#endif
+	for (int i = 0; i < knn; i++)
+		fd[i] = q->nn_val[i];
+
+	return predict_value(fd, knn);
+}
+
+int main(int argc, char *argv[])
+{
+	/* Load all data from files in memory */
+	if (argc != 3 && argc != 4)
+	{
+		printf("usage: %s <trainfile> <queryfile> [resultfile]\n", argv[0]);
+		exit(1);
+	}
+	char *trainfile = argv[1];
+	char *queryfile = argv[2];
+	char *resultfile = (argc == 4) ? argv[3] : NULL; // binary file of the neighbors and predictions of each query (see pack_knn_record)
+
+        // MPI Init
+        int rank, nprocs;
+        MPI_Init(&argc, &argv);
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+
+        int vector_size = PROBDIM + 1;
+        int local_ntrainelems = TRAINELEMS / nprocs;
+        int trainelem_offset = rank * local_ntrainelems * vector_size;
+
+        // correction for the last process : add the remaining training elements
+        if(rank == nprocs - 1)
+                local_ntrainelems += TRAINELEMS % nprocs;
+
+	int trainelems_chunk = local_ntrainelems * vector_size; // chunk size in scalar elements (i.e. doubles)
+
+	/* Each rank is the "home" of a contiguous slice of the query points, in the same way as with the training elements.
+	 * Contrary to myknn_mpi.c, no rank ever holds all QUERYELEMS queries. Each rank reads its own slice from the query file,
+	 * QUERY_BLOCK_SIZE queries at a time, so the memory needed for the queries is bounded by QUERY_BLOCK_SIZE,
+	 * regardless of the total number of queries.
+	 */
+	int local_nqueries = QUERYELEMS / nprocs;
+	int first_query = rank * local_nqueries;
+	if (rank == nprocs - 1)
+		local_nqueries += QUERYELEMS % nprocs;
+
+	// the last rank owns the largest query slice, so it defines the number of rounds all ranks must take part in
+	int max_local_nqueries = QUERYELEMS / nprocs + QUERYELEMS % nprocs;
+	int nrounds = (max_local_nqueries + QUERY_BLOCK_SIZE - 1) / QUERY_BLOCK_SIZE;
+
+	double *mem = (double *)malloc(trainelems_chunk * sizeof(double));
+	ydata = (double *)malloc(local_ntrainelems * sizeof(double));
+
+	/* Two buffers for the query blocks : the one that is being scanned and the one that is being received.
+	 * Each block holds the coordinates of its queries and their k nearest neighbors found so far, in contiguous arrays
+	 * (see query_buffers_t), so a block travels as plain contiguous messages.
+	 */
+	double *query_buf = (double *)malloc(QUERY_BLOCK_SIZE * vector_size * sizeof(double));
+	double *query_ydata = (double *)malloc(QUERY_BLOCK_SIZE * sizeof(double));
+	query_buffers_t qb[2];
+	query_t *queries[2];
+	for (int b = 0; b < 2; b++)
+	{
+		queries[b] = (query_t *)malloc(QUERY_BLOCK_SIZE * sizeof(query_t));
+		alloc_query_buffers(&qb[b], queries[b], QUERY_BLOCK_SIZE, 1);
+	}
+#if defined(SIMD)
+	int posix_res;
+#endif
+
+	/* Create a handler array that will be used to separate xdata's PROBDIM vectors
+	 * and the corresponding surrogate values, since we never need both
+	 * in order to perform a computation.
+	 */
+	xdata = (double **)malloc(local_ntrainelems * sizeof(double*));
+
+        // read a **part** of training data
+        load_binary_data_mpi(trainfile, mem, NULL, trainelems_chunk, trainelem_offset);
+
+#if defined(SIMD)
+	// Allocate new memory for the handler arrays, so that it is aligned and copy the data there
+	// Align each xdata[i] to a 32 byte boundary so you may later use SIMD
+	for (int i = 0; i < local_ntrainelems; i++)
+	{
+		posix_res = posix_memalign((void **)(&(xdata[i])), 32, PROBDIM * sizeof(double));
+		assert(posix_res == 0);
+	}
+	copy_to_aligned(mem, xdata, vector_size, PROBDIM, local_ntrainelems);
+#else
+	// Assign to the handler array, pointers to the already allocated mem
+	for (int i = 0; i < local_ntrainelems; i++)
+		xdata[i] = &mem[i * vector_size];
+#endif
+
+	/* Configure and Initialize the ydata handler arrays */
+	for (int i = 0; i < local_ntrainelems; i++)
+	{
+#if defined(SURROGATES)
+		ydata[i] = mem[i * vector_size + PROBDIM];
+#else
+		ydata[i] = 0;
+#endif
+	}
+
+	MPI_File f;
+	MPI_File_open(MPI_COMM_WORLD, queryfile, MPI_MODE_RDONLY, MPI_INFO_NULL, &f);
+
+	// the records of each query block are written as soon as the block returns home, so they are bounded by QUERY_BLOCK_SIZE too
+	MPI_File f_out;
+	char *records = NULL;
+	if (resultfile != NULL)
+	{
+		open_knn_results_mpi(resultfile, &f_out);
+		records = (char *)malloc((size_t)QUERY_BLOCK_SIZE * KNN_RECORD_SIZE);
+	}
+
+	/* COMPUTATION PART */
+	double t0, t1, t_sum = 0.0;
+	double sse = 0.0;
+	double err_sum = 0.0;
+	double y_sum = 0.0, y_sq_sum = 0.0; // needed for the variance of the query surrogate values, since no rank holds all of them
+
+	int global_block_offset = trainelem_offset / vector_size; // (the last rank may hold more training elements)
+	int next_rank = (rank + 1) % nprocs;
+	int prev_rank = (rank - 1 + nprocs) % nprocs;
+
+	/* The queries are streamed to the training elements, instead of being replicated on every rank.
+	 * In each round, every rank reads the next block of (at most) QUERY_BLOCK_SIZE queries of its own slice.
+	 * The blocks then travel around a ring of ranks : at each of the nprocs steps, each rank
+	 * a) calculates the k neighbors of the block it currently holds, using its local training element block,
+	 *    updating the k nearest neighbors found so far by the preceding ranks, and
+	 * b) forwards the block to the next rank, while receiving a block from the previous one.
+	 * After nprocs steps, each block has visited every training element block and has returned to its home rank,
+	 * which then predicts the values of its queries and computes the error metrics.
+	 */
+	MPI_Barrier(MPI_COMM_WORLD);
+	t0 = gettime();
+	for (int round = 0; round < nrounds; round++)
+	{
+		int block_first = round * QUERY_BLOCK_SIZE;
+		int nqueries = local_nqueries - block_first;
+		if (nqueries > QUERY_BLOCK_SIZE)
+			nqueries = QUERY_BLOCK_SIZE;
+		if (nqueries < 0)
+			nqueries = 0;
+
+		int cur = 0;
+		load_query_block_mpi(f, query_buf, query_ydata, queries[cur], first_query + block_first, nqueries);
+
+		int block_nqueries = nqueries;
+		for (int step = 0; step < nprocs; step++)
+		{
+			// (a) Update the k neighbors of the visiting block, using the local training element block
+			for (int i = 0; i < block_nqueries; i++)
+				compute_knn_brute_force(xdata, ydata, &(queries[cur][i]), PROBDIM, NNBS, global_block_offset, 0, local_ntrainelems, NULL);
+
+			if (nprocs == 1)
+				break;
+
+			// (b) Forward the block to the next rank and receive the block of the previous one
+			int nxt = 1 - cur, rcv_nqueries;
+			MPI_Sendrecv(&block_nqueries, 1, MPI_INT, next_rank, 0,
+				     &rcv_nqueries, 1, MPI_INT, prev_rank, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+			MPI_Sendrecv(qb[cur].x, block_nqueries * QX_STRIDE, MPI_DOUBLE, next_rank, 1,
+				     qb[nxt].x, QUERY_BLOCK_SIZE * QX_STRIDE, MPI_DOUBLE, prev_rank, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+			MPI_Sendrecv(qb[cur].nn_idx, block_nqueries * NN_IDX_STRIDE, MPI_INT, next_rank, 2,
+				     qb[nxt].nn_idx, QUERY_BLOCK_SIZE * NN_IDX_STRIDE, MPI_INT, prev_rank, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+			MPI_Sendrecv(qb[cur].nn_dist, block_nqueries * NN_STRIDE, MPI_DOUBLE, next_rank, 3,
+				     qb[nxt].nn_dist, QUERY_BLOCK_SIZE * NN_STRIDE, MPI_DOUBLE, prev_rank, 3, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+			MPI_Sendrecv(qb[cur].nn_val, block_nqueries * NN_STRIDE, MPI_DOUBLE, next_rank, 4,
+				     qb[nxt].nn_val, QUERY_BLOCK_SIZE * NN_STRIDE, MPI_DOUBLE, prev_rank, 4, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+			block_nqueries = rcv_nqueries;
+			cur = nxt;
+		}
+		assert(block_nqueries == nqueries); // the block that returned home must be our own
+
+		// Calculate yp and the errors/metrics for the queries of the block, which are under the rank's responsibility
+		for (int i = 0; i < nqueries; i++)
+		{
+			double yp = find_knn_value(&(queries[cur][i]), NNBS);
+
+			sse += (query_ydata[i] - yp) * (query_ydata[i] - yp);
+			err_sum += 100.0 * fabs((yp - query_ydata[i]) / query_ydata[i]);
+			y_sum += query_ydata[i];
+			y_sq_sum += query_ydata[i] * query_ydata[i];
+
+			if (records != NULL)
+				pack_knn_record(&(queries[cur][i]), yp, records + (size_t)i * KNN_RECORD_SIZE);
+		}
+
+		if (records != NULL)
+			write_knn_records_mpi(f_out, records, first_query + block_first, nqueries);
+	}
+	t1 = gettime();
+	t_sum = t1 - t0;
+
+	/* CALCULATE AND DISPLAY RESULTS */
+
+	// Reduce all metrics to the root rank (i.e. rank 0)
+        MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &t_sum, &t_sum, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD); // set max time as total time
+	MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &err_sum, &err_sum, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &sse, &sse, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &y_sum, &y_sum, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &y_sq_sum, &y_sq_sum, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+
+        if(rank == 0) // only rank 0 prints
+        {
+                double mse = sse / QUERYELEMS;
+                double ymean = y_sum / QUERYELEMS;
+                double var = y_sq_sum / QUERYELEMS - ymean * ymean;
+                double r2 = 1 - (mse / var);
+
+                printf("Results for %d query points\n", QUERYELEMS);
+                printf("APE = %.2f %%\n", err_sum / QUERYELEMS);
+                printf("MSE = %.6f\n", mse);
+                printf("R2 = 1 - (MSE/Var) = %.6lf\n", r2);
+
+                printf("Total Computing time = %lf secs\n", t_sum);
+		printf("Average time/query = %lf secs\n", t_sum / QUERYELEMS);
+		print_bench_record(argv[0], nprocs, t_sum);
+		printf("Query buffers per rank = %.2f KB (%d queries per block)\n",
+		       (QUERY_BLOCK_SIZE * (vector_size + 2 * (QX_STRIDE + 2 * NN_STRIDE)) * sizeof(double) + 2 * QUERY_BLOCK_SIZE * NN_IDX_STRIDE * sizeof(int)) / 1024.0,
+		       QUERY_BLOCK_SIZE);
+        }
+
+	/* CLEANUP */
+	MPI_File_close(&f);
+	if (records != NULL)
+	{
+		MPI_File_close(&f_out);
+		free(records);
+		if (rank == 0)
+			printf("Neighbors and predictions written to %s\n", resultfile);
+	}
+
+	for (int b = 0; b < 2; b++)
+	{
+		free_query_buffers(&qb[b]);
+		free(queries[b]);
+	}
+	free(query_buf);
+	free(query_ydata);
+
+#if defined(SIMD)
+	for (int i = 0; i < local_ntrainelems; i++)
+		free(xdata[i]);
+#endif
+	free(xdata);
+	free(ydata);
+	free(mem);
+
+	MPI_Finalize();
+	return 0;
+}
@@ -4,6 +4,7 @@
 #include <time.h>
 #include <omp.h>
 #include "func.h"
+#include "func_perf.h"
 
 #ifndef PROBDIM
 #define PROBDIM 2
@@ -14,9 +15,9 @@ static double *ydata;
 
 int main(int argc, char *argv[])
 {
-	if (argc != 3)
+	if (argc != 3 && argc != 4)
 	{
-		printf("usage: %s <trainfile> <queryfile>\n", argv[0]);
+		printf("usage: %s <trainfile> <queryfile> [resultfile]\n", argv[0]);
 		exit(1);
 	}
 
@@ -31,23 +32,25 @@ int main(int argc, char *argv[])
 
 	char *trainfile = argv[1];
 	char *queryfile = argv[2];
+	char *resultfile = (argc == 4) ? argv[3] : NULL; // binary file of the neighbors and predictions of each query (see pack_knn_record)
 
-	double *mem = (double *)malloc(TRAINELEMS * (PROBDIM + 1) * sizeof(double));
-	ydata = (double*)malloc(TRAINELEMS * sizeof(double));
-	double *query_mem = (double *)malloc(QUERYELEMS * (PROBDIM + 1) * sizeof(double));	
+	/* Carve the large buffers out of a single region, backed by huge pages unless KNN_PAGES selects
+	 * another scheme (see knn_pages_init), so that the scans and the top-k updates take fewer TLB misses.
+	 */
+	arena_t arena;
+	long page_faults = get_page_faults();
+	int pages_mode = knn_pages_init(&arena, knn_region_size());
+
+	double *mem = (double *)knn_alloc(TRAINELEMS * (PROBDIM + 1) * sizeof(double), 64);
+	ydata = (double *)knn_alloc(TRAINELEMS * sizeof(double), 64);
+	double *query_mem = (double *)knn_alloc(QUERYELEMS * (PROBDIM + 1) * sizeof(double), 64);
         query_t *queries = (query_t *)malloc(QUERYELEMS * sizeof(query_t));
 	
-#if defined(SIMD)
-	int posix_res;
-        // Malloc aligned space for query.x data 
-        for (int i = 0; i < QUERYELEMS; i++)
-        {
-                posix_res = posix_memalign((void **)(&(queries[i].x)), 32, PROBDIM * sizeof(double));
-                assert(posix_res == 0);
-        }
-#endif
+	// Allocate the coordinates and the k nearest neighbors of all the queries at once (see query_buffers_t)
+	query_buffers_t query_buffers;
+	alloc_query_buffers(&query_buffers, queries, QUERYELEMS, 1);
 
-	xdata = (double **)malloc(TRAINELEMS * sizeof(double *));
+	xdata = (double **)knn_alloc(TRAINELEMS * sizeof(double *), 64);
 
 	load_binary_data(trainfile, mem, NULL, TRAINELEMS*(PROBDIM+1));
 	load_binary_data(queryfile, query_mem, queries, QUERYELEMS * (PROBDIM + 1));
@@ -56,10 +59,7 @@ int main(int argc, char *argv[])
 	// Allocate new memory for the handler arrays, so that it is aligned and copy the data there
 	// Align each xdata[i] to a 32 byte boundary so you may later use SIMD
 	for (int i = 0; i < TRAINELEMS; i++)
-	{
-		posix_res = posix_memalign((void **)(&(xdata[i])), 32, PROBDIM * sizeof(double));
-		assert(posix_res == 0);
-	}
+		xdata[i] = (double *)knn_alloc(PROBDIM * sizeof(double), 32);
 	copy_to_aligned(mem, xdata, (PROBDIM+1), PROBDIM, TRAINELEMS);
 #else
 	// Assign to the handler arrays, pointers to the already allocated mem
@@ -77,7 +77,7 @@ int main(int argc, char *argv[])
 #endif
 	}
 
-	double *query_ydata = malloc(QUERYELEMS * sizeof(double));
+	double *query_ydata = (double *)knn_alloc(QUERYELEMS * sizeof(double), 64);
 
 	for (int i = 0; i < QUERYELEMS; i++)
 	{
@@ -90,18 +90,56 @@ int main(int argc, char *argv[])
 
 	assert(TRAINELEMS % train_block_size == 0);
 
+#if defined(PRUNE_REORDER)
+	// permute the dimensions, so that the pruned scan sees the largest contributions to the distance first
+	reorder_dims_by_variance(xdata, TRAINELEMS, queries, QUERYELEMS, PROBDIM);
+#endif
+
+#if defined(LBFILTER)
+	/* Summarize each training element and each query point (projections onto the principal axes
+	 * of the training set and residual norm), so that the scan may reject most candidates using
+	 * a lower bound of their distance.
+	 */
+	knn_summary_t summaries;
+	summaries.xsumm = (double *)knn_alloc((size_t)TRAINELEMS * SUMM_SIZE * sizeof(double), 64);
+	double *query_summ = (double *)knn_alloc(QUERYELEMS * SUMM_SIZE * sizeof(double), 64);
+
+	double t_summ = gettime();
+	build_summaries(&summaries, xdata, TRAINELEMS);
+	for (int i = 0; i < QUERYELEMS; i++)
+		compute_point_summary(&summaries, queries[i].x, &query_summ[i * SUMM_SIZE]);
+	t_summ = gettime() - t_summ;
+#endif
+
 #if defined(DEBUG)
 	FILE *fpout = fopen("output.knn_omp.txt","w");
 	double *yp_vals = malloc(QUERYELEMS * sizeof(double));
 	double *err_vals = malloc(QUERYELEMS * sizeof(double));
 #endif
 	
+	// page faults taken while the buffers were allocated and filled, i.e. before the scan
+	print_pages_report(pages_mode, knn_region_size(), get_page_faults() - page_faults);
+
+	char *records = NULL;
+	if (resultfile != NULL)
+		records = (char *)malloc((size_t)QUERYELEMS * KNN_RECORD_SIZE);
+
         /* COMPUTATION PART */
         double t0, t1, t_start, t_end, t_sum = 0.0, t_total;
         double sse = 0.0;
         double err_sum = 0.0;
 
 	size_t nthreads;
+	long long dist_evals = 0, dims_touched = 0, lb_rejects = 0;
+#if defined(KSWEEP)
+	// errors of the predictions with every k <= NNBS, from the same scan (see knn_sweep_t)
+	knn_sweep_t sweep;
+	sweep_init(&sweep);
+#endif
+
+	// per-thread hardware counters of the scan and of the prediction, if switched on by KNN_PERF (see func_perf.h)
+	perf_counts_t *perf_counts = (perf_counts_t *)malloc(omp_get_max_threads() * sizeof(perf_counts_t));
+	perf_init();
 
 	t_start = gettime();
         /* Parallel + Blocking Query Point k-nearest neighbors calculation.
@@ -112,14 +150,31 @@ int main(int argc, char *argv[])
          * since the k-neighbor calculation for each Query Point, does not depend
          * on the k-neighbor calculation of the other Query Points.
          */
-	#pragma omp parallel reduction(+ : sse, err_sum, t_sum) private(t0, t1) 
+	#pragma omp parallel reduction(+ : sse, err_sum, t_sum, dist_evals, dims_touched, lb_rejects) private(t0, t1) 
 	{
+		knn_stats_t stats = {0, 0, 0, 0}; // thread-local counters of the scan
+	#if defined(KSWEEP)
+		knn_sweep_t local_sweep;
+		sweep_init(&local_sweep);
+	#endif
+		perf_thread_t perf;
+		perf_thread_open(&perf);
+
+		perf_begin(&perf);
 		for (int train_offset = 0; train_offset < TRAINELEMS; train_offset += train_block_size)
 		{
 			#pragma omp for nowait
 			for (int i = 0; i < QUERYELEMS; i++)
-				compute_knn_brute_force(xdata, ydata, &(queries[i]), PROBDIM, NNBS, train_offset, 0, train_block_size);			
+#if defined(LBFILTER)
+				compute_knn_brute_force_lb(xdata, &summaries, ydata, &(queries[i]), &query_summ[i * SUMM_SIZE], PROBDIM, NNBS, train_offset, 0, train_block_size, &stats);
+#else
+				compute_knn_brute_force(xdata, ydata, &(queries[i]), PROBDIM, NNBS, train_offset, 0, train_block_size, &stats);
+#endif
 		}
+		perf_end(&perf, PERF_SCAN);
+		dist_evals += stats.dist_evals;
+		dims_touched += stats.dims_touched;
+		lb_rejects += stats.lb_rejects;
 
 		size_t tid = omp_get_thread_num();
 
@@ -152,6 +207,7 @@ int main(int argc, char *argv[])
 	#else
 		double yp;
 	#endif
+		perf_begin(&perf);
 		for (int i = start; i < end; i++) 	/* requests */
 		{
 			t0 = gettime();
@@ -164,6 +220,17 @@ int main(int argc, char *argv[])
 
                         t_sum += t1 - t0;
 
+			// each thread packs the records of its own queries, directly at their final position
+			if (records != NULL)
+		#if defined(DEBUG)
+				pack_knn_record(&(queries[i]), yp[idx], records + (size_t)i * KNN_RECORD_SIZE);
+		#else
+				pack_knn_record(&(queries[i]), yp, records + (size_t)i * KNN_RECORD_SIZE);
+		#endif
+		#if defined(KSWEEP)
+			sweep_add_query(&local_sweep, &(queries[i]), query_ydata[i]);
+		#endif
+
                 #if defined(DEBUG)
 			sse += (query_ydata[i] - yp[idx]) * (query_ydata[i] - yp[idx]);
 			err[idx] = 100.0 * fabs((yp[idx] - query_ydata[i]) / query_ydata[i]);
@@ -174,6 +241,13 @@ int main(int argc, char *argv[])
 			err_sum += 100.0 * fabs((yp - query_ydata[i]) / query_ydata[i]);
 		#endif
 		}
+		perf_end(&perf, PERF_PREDICT);
+	#if defined(KSWEEP)
+		#pragma omp critical
+		sweep_merge(&sweep, &local_sweep);
+	#endif
+		perf_thread_close(&perf, &stats);
+		perf_counts[tid] = perf.c;
 	#if defined(DEBUG)
 		idx = 0;
 		for (int i = start; i < end; i++)
@@ -201,25 +275,48 @@ int main(int argc, char *argv[])
 	printf("APE = %.2f %%\n", err_sum / QUERYELEMS);
 	printf("MSE = %.6f\n", mse);
 	printf("R2 = 1 - (MSE/Var) = %.6lf\n", r2);
+#if defined(KSWEEP)
+	print_sweep(&sweep, QUERYELEMS, var);
+#endif
 
 	printf("Total Computing time = %lf secs\n", t_total);
 	printf("Average time/query = %lf secs\n", t_total / QUERYELEMS);
-
-#if defined(SIMD)
-	for (int i = 0; i < QUERYELEMS; i++)
-		free(queries[i].x);
+	print_bench_record(argv[0], nthreads, t_total);
+#if defined(PRUNE)
+	printf("Dimensions touched/candidate = %.2f (out of %d)\n", (double)dims_touched / dist_evals, PROBDIM);
+#endif
+#if defined(LBFILTER)
+	printf("Candidates rejected by the lower bound = %.2f %% (summaries built in %lf secs)\n",
+	       100.0 * lb_rejects / ((double)TRAINELEMS * QUERYELEMS), t_summ);
 #endif
+	perf_report(argv[0], perf_counts, nthreads);
+
+	if (records != NULL)
+	{
+		store_knn_results(resultfile, records, QUERYELEMS);
+		printf("Neighbors and predictions written to %s\n", resultfile);
+		free(records);
+	}
+
+	free(perf_counts);
+	free_query_buffers(&query_buffers);
         free(queries);
-        free(query_ydata);
-	free(query_mem);
+        knn_free(query_ydata);
+	knn_free(query_mem);
 	
 #if defined(SIMD)
 	for (int i = 0; i < TRAINELEMS; i++)
-		free(xdata[i]);
+		knn_free(xdata[i]);
+#endif
+	knn_free(xdata);
+	knn_free(ydata);
+	knn_free(mem);
+
+#if defined(LBFILTER)
+	knn_free(summaries.xsumm);
+	knn_free(query_summ);
 #endif
-	free(xdata);
-	free(ydata);        
-	free(mem);
+	knn_pages_free();
 
 #if defined(DEBUG)
 	free(yp_vals);
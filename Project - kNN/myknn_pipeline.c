@@ -0,0 +1,377 @@
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+#include <omp.h>
+#include "func.h"
+
+#ifndef PROBDIM
+#define PROBDIM 2
+#endif
+
+// number of batches in flight : one being read, one being scanned and one being written
+#ifndef PIPE_SLOTS
+#define PIPE_SLOTS 3
+#endif
+
+static double **xdata;
+static double *ydata;
+
+/* A batch of consecutive queries, that moves through the stages of the pipeline :
+ *	load -> scan (one task per training partition) -> top-k merge -> predict -> output
+ * Each batch owns one of the PIPE_SLOTS slots, which is only reused once the output of its previous batch is done,
+ * so the slots are a bounded queue between the reader and the rest of the pipeline.
+ */
+typedef struct batch_s
+{
+	int n;				// number of queries of the batch (0 at the end of the stream)
+	double *buf;			// query vectors, as read from the query file
+	double *qy;			// surrogate values of the queries
+	query_t *queries;		// final k nearest neighbors
+	query_buffers_t qb;
+	query_t **part_queries;		// partial k nearest neighbors, one set per training partition
+	query_buffers_t *part_qb;
+	double *yp;			// predicted values
+	char *records;			// binary results of the batch, if there is a results file
+	double t_arrival;		// time when the reader started reading the batch
+} batch_t;
+
+typedef struct pipeline_s
+{
+	int batch_size;
+	int nparts;			// number of training partitions, scanned in parallel for each batch
+	int part_size;			// training elements per partition (a multiple of train_block_size)
+	int train_block_size;
+	FILE *fout;			// binary results file, or NULL
+	// written only by the output stage, which runs in batch order
+	long nqueries, nbatches;
+	double sse, err_sum;
+	double *latency;		// end-to-end latency of each batch
+	long latency_cap;
+} pipeline_t;
+
+// Read the next batch of queries from the stream (stage 1)
+void load_batch(FILE *fin, pipeline_t *pl, batch_t *bt)
+{
+	int vector_size = PROBDIM + 1;
+
+	bt->t_arrival = gettime();
+	bt->n = fread(bt->buf, vector_size * sizeof(double), pl->batch_size, fin);
+
+	for (int i = 0; i < bt->n; i++)
+	{
+		for (int k = 0; k < PROBDIM; k++)
+			bt->queries[i].x[k] = bt->buf[i * vector_size + k];
+#if defined(SURROGATES)
+		bt->qy[i] = bt->buf[i * vector_size + PROBDIM];
+#else
+		bt->qy[i] = 0;
+#endif
+	}
+}
+
+/* Find the k nearest neighbors of the batch within the training partition p (stage 2), in the same blocking
+ * fashion as myknn.c. The partitions of a batch are scanned by concurrent tasks, so that even a single batch
+ * keeps all the threads busy.
+ */
+void scan_partition(pipeline_t *pl, batch_t *bt, int p)
+{
+	query_t *pq = bt->part_queries[p];
+	int part_start = p * pl->part_size;
+	int part_end = (part_start + pl->part_size < TRAINELEMS) ? part_start + pl->part_size : TRAINELEMS;
+
+	for (int i = 0; i < bt->n; i++)
+		reset_query(&pq[i]);
+
+	for (int train_offset = part_start; train_offset < part_end; train_offset += pl->train_block_size)
+	{
+		int block_size = (train_offset + pl->train_block_size < part_end) ? pl->train_block_size : part_end - train_offset;
+		for (int i = 0; i < bt->n; i++)
+			compute_knn_brute_force(xdata, ydata, &pq[i], PROBDIM, NNBS, train_offset, 0, block_size, NULL);
+	}
+}
+
+// Merge the partial k nearest neighbors of the partitions into the final ones (stage 3)
+void merge_partitions(pipeline_t *pl, batch_t *bt)
+{
+	for (int i = 0; i < bt->n; i++)
+	{
+		query_t *q = &bt->queries[i];
+		int max_i;
+
+		// the partitions are merged in order, so ties are resolved as in a single scan over the whole training set
+		reset_query(q);
+		double max_d = compute_max_pos(q->nn_dist, NNBS, &max_i);
+		for (int p = 0; p < pl->nparts; p++)
+		{
+			query_t *pq = &bt->part_queries[p][i];
+			for (int j = 0; j < NNBS; j++)
+			{
+				if (pq->nn_dist[j] < max_d)
+				{
+					q->nn_idx[max_i] = pq->nn_idx[j];
+					q->nn_dist[max_i] = pq->nn_dist[j];
+					q->nn_val[max_i] = pq->nn_val[j];
+					max_d = compute_max_pos(q->nn_dist, NNBS, &max_i);
+				}
+			}
+		}
+	}
+}
+
+// Predict the value of each query of the batch and pack its record (stage 4)
+void predict_batch(pipeline_t *pl, batch_t *bt)
+{
+	for (int i = 0; i < bt->n; i++)
+	{
+		bt->yp[i] = predict_value(bt->queries[i].nn_val, NNBS);
+		if (pl->fout != NULL)
+			pack_knn_record(&bt->queries[i], bt->yp[i], bt->records + (size_t)i * KNN_RECORD_SIZE);
+	}
+}
+
+// Write the results of the batch and account for its errors and latency (stage 5, runs in batch order)
+void output_batch(pipeline_t *pl, batch_t *bt)
+{
+	if (pl->fout != NULL)
+	{
+		size_t nrecords = fwrite(bt->records, KNN_RECORD_SIZE, bt->n, pl->fout);
+		assert(nrecords == bt->n); // check that all records were actually written
+		fflush(pl->fout);
+	}
+
+	for (int i = 0; i < bt->n; i++)
+	{
+		pl->sse += (bt->qy[i] - bt->yp[i]) * (bt->qy[i] - bt->yp[i]);
+		pl->err_sum += 100.0 * fabs((bt->yp[i] - bt->qy[i]) / bt->qy[i]);
+	}
+	pl->nqueries += bt->n;
+
+	if (pl->nbatches == pl->latency_cap)
+	{
+		pl->latency_cap *= 2;
+		pl->latency = (double *)realloc(pl->latency, pl->latency_cap * sizeof(double));
+	}
+	pl->latency[pl->nbatches++] = gettime() - bt->t_arrival;
+}
+
+void alloc_batch(pipeline_t *pl, batch_t *bt)
+{
+	bt->buf = (double *)malloc((size_t)pl->batch_size * (PROBDIM + 1) * sizeof(double));
+	bt->qy = (double *)malloc(pl->batch_size * sizeof(double));
+	bt->yp = (double *)malloc(pl->batch_size * sizeof(double));
+	bt->records = (pl->fout != NULL) ? (char *)malloc((size_t)pl->batch_size * KNN_RECORD_SIZE) : NULL;
+
+	bt->queries = (query_t *)malloc(pl->batch_size * sizeof(query_t));
+	alloc_query_buffers(&bt->qb, bt->queries, pl->batch_size, 1);
+
+	// the partial neighbors share the coordinates of the final ones
+	bt->part_queries = (query_t **)malloc(pl->nparts * sizeof(query_t *));
+	bt->part_qb = (query_buffers_t *)malloc(pl->nparts * sizeof(query_buffers_t));
+	for (int p = 0; p < pl->nparts; p++)
+	{
+		bt->part_queries[p] = (query_t *)malloc(pl->batch_size * sizeof(query_t));
+		alloc_query_buffers(&bt->part_qb[p], bt->part_queries[p], pl->batch_size, 0);
+		for (int i = 0; i < pl->batch_size; i++)
+			bt->part_queries[p][i].x = bt->queries[i].x;
+	}
+}
+
+void free_batch(pipeline_t *pl, batch_t *bt)
+{
+	for (int p = 0; p < pl->nparts; p++)
+	{
+		free_query_buffers(&bt->part_qb[p]);
+		free(bt->part_queries[p]);
+	}
+	free(bt->part_qb);
+	free(bt->part_queries);
+	free_query_buffers(&bt->qb);
+	free(bt->queries);
+	free(bt->records);
+	free(bt->yp);
+	free(bt->qy);
+	free(bt->buf);
+}
+
+int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3 || argc > 5)
+	{
+		printf("usage: %s <trainfile> <queryfile|-> [batch_size] [resultfile]\n", argv[0]);
+		exit(1);
+	}
+
+	int L1d_size, train_block_size = 1;
+	get_L1d_size(&L1d_size); // get L1d cache size
+	// calculate the appropriate train block size as the previous power of 2
+	if(L1d_size > 0)
+		train_block_size = pow(2, floor(log2((L1d_size * 1000) / (PROBDIM * sizeof(double)))));
+
+	char *trainfile = argv[1];
+	char *queryfile = argv[2]; // "-" reads a (possibly endless) stream of queries from the standard input
+	pipeline_t pl;
+	pl.batch_size = (argc >= 4) ? atoi(argv[3]) : 64;
+	if (pl.batch_size <= 0)
+	{
+		printf("usage: %s <trainfile> <queryfile|-> [batch_size] [resultfile]\n", argv[0]);
+		printf("batch_size must be a positive number of queries (got \"%s\")\n", argv[3]);
+		return 1;
+	}
+	pl.fout = NULL;
+	if (argc == 5)
+	{
+		pl.fout = fopen(argv[4], "wb");
+		if (pl.fout == NULL)
+		{
+			printf("fopen(%s, \"wb\") FAILED!\n", argv[4]);
+			exit(1);
+		}
+	}
+	FILE *fin = (strcmp(queryfile, "-") == 0) ? stdin : fopen(queryfile, "rb");
+	if (fin == NULL)
+	{
+		printf("fopen(%s, \"rb\") FAILED!\n", queryfile);
+		exit(1);
+	}
+
+	/* The training set is the model of the pipeline, so it is loaded once, before the queries start flowing */
+	double *mem = (double *)malloc(TRAINELEMS * (PROBDIM + 1) * sizeof(double));
+	ydata = (double *)malloc(TRAINELEMS * sizeof(double));
+	xdata = (double **)malloc(TRAINELEMS * sizeof(double *));
+	load_binary_data(trainfile, mem, NULL, TRAINELEMS*(PROBDIM+1));
+
+#if defined(SIMD)
+	// Align each xdata[i] to a 32 byte boundary so you may later use SIMD
+	for (int i = 0; i < TRAINELEMS; i++)
+	{
+		int posix_res = posix_memalign((void **)(&(xdata[i])), 32, PROBDIM * sizeof(double));
+		assert(posix_res == 0);
+	}
+	copy_to_aligned(mem, xdata, (PROBDIM+1), PROBDIM, TRAINELEMS);
+#else
+	for (int i = 0; i < TRAINELEMS; i++)
+		xdata[i] = &mem[i*(PROBDIM + 1)];
+#endif
+
+	for (int i = 0; i < TRAINELEMS; i++)
+	{
+#if defined(SURROGATES)
+		ydata[i] = mem[i * (PROBDIM + 1) + PROBDIM];
+#else
+		ydata[i] = 0;
+#endif
+	}
+
+	// one training partition per thread, made of whole training blocks
+	int nthreads = omp_get_max_threads();
+	pl.train_block_size = train_block_size;
+	pl.part_size = (TRAINELEMS + nthreads - 1) / nthreads;
+	pl.part_size = ((pl.part_size + train_block_size - 1) / train_block_size) * train_block_size;
+	pl.nparts = (TRAINELEMS + pl.part_size - 1) / pl.part_size;
+
+	pl.nqueries = 0;
+	pl.nbatches = 0;
+	pl.sse = 0.0;
+	pl.err_sum = 0.0;
+	pl.latency_cap = 1024;
+	pl.latency = (double *)malloc(pl.latency_cap * sizeof(double));
+
+	batch_t slots[PIPE_SLOTS];
+	for (int s = 0; s < PIPE_SLOTS; s++)
+		alloc_batch(&pl, &slots[s]);
+
+	/* COMPUTATION PART */
+
+	/* The reader runs on the thread that creates the tasks. Before reading a batch into a slot, it waits for the
+	 * previous batch of the slot to leave the pipeline, so reading batch i + 2 overlaps with the scan of batch i + 1
+	 * and the output of batch i. The stages of a batch are ordered by the dependences on its slot, and the outputs
+	 * of all batches are ordered by out_order, so the results file is written in query order.
+	 */
+	char slot_dep[PIPE_SLOTS] __attribute__((unused)), out_order __attribute__((unused)); // only used as dependences
+	double t_start = gettime();
+
+	#pragma omp parallel
+	#pragma omp single
+	{
+		for (long b = 0; ; b++)
+		{
+			int s = b % PIPE_SLOTS;
+			batch_t *bt = &slots[s];
+
+			#pragma omp taskwait depend(inout: slot_dep[s])
+			load_batch(fin, &pl, bt);
+			if (bt->n == 0)
+				break;
+
+			for (int p = 0; p < pl.nparts; p++)
+			{
+				#pragma omp task depend(in: slot_dep[s]) firstprivate(bt, p)
+				scan_partition(&pl, bt, p);
+			}
+
+			#pragma omp task depend(inout: slot_dep[s]) firstprivate(bt)
+			merge_partitions(&pl, bt);
+
+			#pragma omp task depend(inout: slot_dep[s]) firstprivate(bt)
+			predict_batch(&pl, bt);
+
+			#pragma omp task depend(inout: slot_dep[s]) depend(inout: out_order) firstprivate(bt)
+			output_batch(&pl, bt);
+
+			if (bt->n < pl.batch_size) // end of the stream
+				break;
+		}
+	}
+	double t_total = gettime() - t_start;
+
+	/* CALCULATE AND DISPLAY RESULTS */
+
+	qsort(pl.latency, pl.nbatches, sizeof(double), cmp_double);
+	double lat_sum = 0.0;
+	for (long b = 0; b < pl.nbatches; b++)
+		lat_sum += pl.latency[b];
+
+	printf("Results for %ld query points, in %ld batches of %d queries (%d training partitions, %d slots)\n",
+	       pl.nqueries, pl.nbatches, pl.batch_size, pl.nparts, PIPE_SLOTS);
+	printf("APE = %.2f %%\n", pl.err_sum / pl.nqueries);
+	printf("MSE = %.6f\n", pl.sse / pl.nqueries);
+
+	printf("Total time = %lf secs (reading the queries included)\n", t_total);
+	printf("Throughput = %.1f queries/sec\n", pl.nqueries / t_total);
+	if (pl.nbatches > 0)
+		printf("Batch latency : mean = %lf secs, median = %lf secs, p95 = %lf secs\n", lat_sum / pl.nbatches,
+		       pl.latency[(pl.nbatches - 1) / 2], pl.latency[(long)ceil(0.95 * pl.nbatches) - 1]);
+	// the queries are read by the pipeline itself, so t_total includes their loading, unlike the other variants
+	if (pl.nqueries == QUERYELEMS)
+		print_bench_record(argv[0], nthreads, t_total);
+
+	/* CLEANUP */
+	if (pl.fout != NULL)
+	{
+		fclose(pl.fout);
+		printf("Neighbors and predictions written to %s\n", argv[4]);
+	}
+	if (fin != stdin)
+		fclose(fin);
+
+	for (int s = 0; s < PIPE_SLOTS; s++)
+		free_batch(&pl, &slots[s]);
+	free(pl.latency);
+
+#if defined(SIMD)
+	for (int i = 0; i < TRAINELEMS; i++)
+		free(xdata[i]);
+#endif
+	free(xdata);
+	free(ydata);
+	free(mem);
+
+	return 0;
+}
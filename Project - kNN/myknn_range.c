@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+#include <omp.h>
+#include "func.h"
+
+#ifndef PROBDIM
+#define PROBDIM 2
+#endif
+
+// size of the chunks that each thread's arena allocates for the neighbor blocks
+#define ARENA_CHUNK_SIZE (1 << 22)
+
+static double **xdata;
+
+/* Write the neighbors of all queries into a binary file, in CSR format :
+ * 	long long nqueries, long long nnz
+ * 	long long offsets[nqueries + 1]	(the neighbors of query i are the entries [offsets[i], offsets[i+1]))
+ * 	int indices[nnz]
+ * 	double distances[nnz]
+ */
+void store_csr(const char *filename, long long nqueries, long long *offsets, int *indices, double *distances)
+{
+	FILE *fp = fopen(filename, "wb");
+	if (fp == NULL)
+	{
+		printf("fopen(%s, \"wb\") FAILED!\n", filename);
+		exit(1);
+	}
+	long long nnz = offsets[nqueries];
+	size_t nelems = 0;
+	nelems += fwrite(&nqueries, sizeof(long long), 1, fp);
+	nelems += fwrite(&nnz, sizeof(long long), 1, fp);
+	nelems += fwrite(offsets, sizeof(long long), nqueries + 1, fp);
+	nelems += fwrite(indices, sizeof(int), nnz, fp);
+	nelems += fwrite(distances, sizeof(double), nnz, fp);
+	assert(nelems == 2 + (nqueries + 1) + 2 * nnz); // check that all elements were actually written
+	fclose(fp);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 4 && argc != 5)
+	{
+		printf("usage: %s <trainfile> <queryfile> <radius> [csrfile]\n", argv[0]);
+		exit(1);
+	}
+
+	omp_set_dynamic(0); // set OpenMP dynamic mode to false, i.e. use the explicitly defined number of threads
+	omp_set_num_threads(omp_get_max_threads()); // run using the maximum supported number of threads
+
+        int L1d_size, train_block_size = 1;
+	get_L1d_size(&L1d_size); // get L1d cache size
+	// calculate the appropriate train block size as the previous power of 2
+	if(L1d_size > 0)
+		train_block_size = pow(2, floor(log2((L1d_size * 1000) / (PROBDIM * sizeof(double)))));
+
+	char *trainfile = argv[1];
+	char *queryfile = argv[2];
+	double radius = atof(argv[3]);
+	char *csrfile = (argc == 5) ? argv[4] : NULL;
+
+	double *mem = (double *)malloc(TRAINELEMS * (PROBDIM + 1) * sizeof(double));
+	double *query_mem = (double *)malloc(QUERYELEMS * (PROBDIM + 1) * sizeof(double));
+        range_query_t *queries = (range_query_t *)malloc(QUERYELEMS * sizeof(range_query_t));
+
+	xdata = (double **)malloc(TRAINELEMS * sizeof(double *));
+
+	load_binary_data(trainfile, mem, NULL, TRAINELEMS*(PROBDIM+1));
+	load_binary_data(queryfile, query_mem, NULL, QUERYELEMS * (PROBDIM + 1));
+
+#if defined(SIMD)
+	// Allocate new memory for the handler arrays, so that it is aligned and copy the data there
+	// Align each xdata[i] (and each query point) to a 32 byte boundary so you may later use SIMD
+	int posix_res;
+	for (int i = 0; i < TRAINELEMS; i++)
+	{
+		posix_res = posix_memalign((void **)(&(xdata[i])), 32, PROBDIM * sizeof(double));
+		assert(posix_res == 0);
+	}
+	copy_to_aligned(mem, xdata, (PROBDIM+1), PROBDIM, TRAINELEMS);
+
+	for (int i = 0; i < QUERYELEMS; i++)
+	{
+		posix_res = posix_memalign((void **)(&(queries[i].x)), 32, PROBDIM * sizeof(double));
+		assert(posix_res == 0);
+		for (int k = 0; k < PROBDIM; k++)
+			queries[i].x[k] = query_mem[i * (PROBDIM + 1) + k];
+	}
+#else
+	// Assign to the handler arrays, pointers to the already allocated mem
+	for (int i = 0; i < TRAINELEMS; i++)
+		xdata[i] = &mem[i*(PROBDIM + 1)];
+
+	for (int i = 0; i < QUERYELEMS; i++)
+		queries[i].x = &query_mem[i * (PROBDIM + 1)];
+#endif
+
+	for (int i = 0; i < QUERYELEMS; i++)
+	{
+		queries[i].head = NULL;
+		queries[i].tail = NULL;
+		queries[i].count = 0;
+	}
+
+	assert(TRAINELEMS % train_block_size == 0);
+
+        /* COMPUTATION PART */
+        double t_start, t_scan, t_total;
+	long long dist_evals = 0;
+	size_t nthreads = 1;
+
+	long long *offsets = (long long *)malloc((QUERYELEMS + 1) * sizeof(long long));
+	int *indices = NULL;
+	double *distances = NULL;
+
+	#pragma omp parallel
+	{
+		#pragma omp single
+		nthreads = omp_get_num_threads();
+	}
+	// one arena per thread, so that appending neighbors never needs any synchronization
+	arena_t *arenas = (arena_t *)malloc(nthreads * sizeof(arena_t));
+	for (int t = 0; t < nthreads; t++)
+		arena_init(&arenas[t], ARENA_CHUNK_SIZE);
+
+	t_start = gettime();
+        /* Parallel + Blocking range search, as in myknn_omp.c : for each block of Training Points,
+         * find the neighbors of each Query Point within the current block.
+	 * The static schedule assigns each query to the same thread for every training block, so the
+	 * neighbor list of a query is only appended to by a single thread, using the thread's own arena.
+         */
+	#pragma omp parallel reduction(+ : dist_evals)
+	{
+		knn_stats_t stats = {0, 0, 0, 0}; // thread-local counters of the scan
+		arena_t *arena = &arenas[omp_get_thread_num()];
+		for (int train_offset = 0; train_offset < TRAINELEMS; train_offset += train_block_size)
+		{
+			#pragma omp for schedule(static) nowait
+			for (int i = 0; i < QUERYELEMS; i++)
+				compute_range_brute_force(xdata, &(queries[i]), radius, PROBDIM, train_offset, 0, train_block_size, arena, &stats);
+		}
+		dist_evals += stats.dist_evals;
+	}
+	t_scan = gettime() - t_start;
+
+	/* Convert the per-query lists of neighbor blocks into a single CSR structure :
+	 * the offsets are the prefix sum of the neighbor counts, and each query then copies its own blocks.
+	 */
+	offsets[0] = 0;
+	for (int i = 0; i < QUERYELEMS; i++)
+		offsets[i + 1] = offsets[i] + queries[i].count;
+
+	indices = (int *)malloc(offsets[QUERYELEMS] * sizeof(int));
+	distances = (double *)malloc(offsets[QUERYELEMS] * sizeof(double));
+
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < QUERYELEMS; i++)
+	{
+		long long pos = offsets[i];
+		for (range_block_t *b = queries[i].head; b != NULL; b = b->next)
+		{
+			for (int j = 0; j < b->n; j++)
+			{
+				indices[pos + j] = b->idx[j];
+				distances[pos + j] = b->dist[j];
+			}
+			pos += b->n;
+		}
+	}
+        t_total = gettime() - t_start;
+
+	long long nnz = offsets[QUERYELEMS], max_count = 0, empty = 0;
+	for (int i = 0; i < QUERYELEMS; i++)
+	{
+		if (queries[i].count > max_count)
+			max_count = queries[i].count;
+		if (queries[i].count == 0)
+			empty++;
+	}
+
+	printf("Results for %d query points, radius = %lf\n", QUERYELEMS, radius);
+	printf("Neighbors found = %lld (%.2f per query, max = %lld, queries without neighbors = %lld)\n",
+	       nnz, (double)nnz / QUERYELEMS, max_count, empty);
+
+	printf("Total Computing time = %lf secs\n", t_total);
+	printf("Scan time = %lf secs (%lld distance evaluations)\n", t_scan, dist_evals);
+	printf("Average time/query = %lf secs\n", t_total / QUERYELEMS);
+
+	if (csrfile != NULL)
+	{
+		store_csr(csrfile, QUERYELEMS, offsets, indices, distances);
+		printf("CSR neighbors written to %s\n", csrfile);
+	}
+
+	/* CLEANUP */
+	for (int t = 0; t < nthreads; t++)
+		arena_free(&arenas[t]);
+	free(arenas);
+	free(offsets);
+	free(indices);
+	free(distances);
+
+#if defined(SIMD)
+	for (int i = 0; i < QUERYELEMS; i++)
+		free(queries[i].x);
+	for (int i = 0; i < TRAINELEMS; i++)
+		free(xdata[i]);
+#endif
+	free(queries);
+	free(query_mem);
+	free(xdata);
+	free(mem);
+
+        return 0;
+}
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+#include <omp.h>
+#include "func.h"
+
+#ifndef PROBDIM
+#define PROBDIM 2
+#endif
+
+// number of training elements per tile (a tile pair needs a TILE_SIZE x TILE_SIZE distance buffer per thread)
+#ifndef TILE_SIZE
+#define TILE_SIZE 128
+#endif
+
+#define INF 1e99
+
+static double **xdata;
+static double *ydata;
+
+double find_knn_value(query_t *q, int knn)
+{
+#if defined(SIMD)
+	__attribute__((aligned(32))) double fd[knn];	// function values for the knn neighbors
+#else
+	double fd[knn];
+#endif
+	for (int i = 0; i < knn; i++)
+		fd[i] = q->nn_val[i];
+
+	return predict_value(fd, knn);
+}
+
+/* Offer n candidate neighbors to the k nearest neighbors of q.
+ * The i-th candidate is the training element first_idx + i, at distance dist[i * stride].
+ */
+void offer_candidates(query_t *q, int first_idx, double *dist, int stride, int n)
+{
+	int max_i;
+	double max_d = compute_max_pos(q->nn_dist, NNBS, &max_i);
+
+	for (int i = 0; i < n; i++)
+	{
+		double new_d = dist[i * stride];
+		if (new_d < max_d) // add point to the list of knns, replace element max_i
+		{
+			q->nn_idx[max_i] = first_idx + i;
+			q->nn_dist[max_i] = new_d;
+			q->nn_val[max_i] = ydata[first_idx + i];
+			max_d = compute_max_pos(q->nn_dist, NNBS, &max_i);
+		}
+	}
+}
+
+/* Process the pair of tiles (a, b) : each distance between an element of tile a and an element of tile b is
+ * computed once, and it is offered to the k nearest neighbors of both elements.
+ * For a diagonal pair (a == b), only the upper triangle is computed and the diagonal (i.e. the self-matches) is excluded.
+ */
+void process_tile_pair(query_t *points, int a, int b, double *dist)
+{
+	int a0 = a * TILE_SIZE, b0 = b * TILE_SIZE;
+	int na = (a0 + TILE_SIZE <= TRAINELEMS) ? TILE_SIZE : TRAINELEMS - a0;
+	int nb = (b0 + TILE_SIZE <= TRAINELEMS) ? TILE_SIZE : TRAINELEMS - b0;
+
+	if (a == b)
+	{
+		for (int i = 0; i < na; i++)
+		{
+			dist[i * TILE_SIZE + i] = INF;
+			for (int j = i + 1; j < na; j++)
+			{
+				dist[i * TILE_SIZE + j] = compute_dist(xdata[a0 + i], xdata[a0 + j], PROBDIM);
+				dist[j * TILE_SIZE + i] = dist[i * TILE_SIZE + j];
+			}
+		}
+		for (int i = 0; i < na; i++)
+			offer_candidates(&points[a0 + i], a0, &dist[i * TILE_SIZE], 1, na);
+		return;
+	}
+
+	for (int i = 0; i < na; i++)
+		for (int j = 0; j < nb; j++)
+			dist[i * TILE_SIZE + j] = compute_dist(xdata[a0 + i], xdata[b0 + j], PROBDIM);
+
+	// rows of the distance tile : candidates for the elements of tile a
+	for (int i = 0; i < na; i++)
+		offer_candidates(&points[a0 + i], b0, &dist[i * TILE_SIZE], 1, nb);
+
+	// columns of the distance tile : candidates for the elements of tile b
+	for (int j = 0; j < nb; j++)
+		offer_candidates(&points[b0 + j], a0, &dist[j], TILE_SIZE, na);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2)
+	{
+		printf("usage: %s <trainfile>\n", argv[0]);
+		exit(1);
+	}
+
+	omp_set_dynamic(0); // set OpenMP dynamic mode to false, i.e. use the explicitly defined number of threads
+	omp_set_num_threads(omp_get_max_threads()); // run using the maximum supported number of threads
+
+	char *trainfile = argv[1];
+
+	double *mem = (double *)malloc(TRAINELEMS * (PROBDIM + 1) * sizeof(double));
+	ydata = (double*)malloc(TRAINELEMS * sizeof(double));
+
+	/* Every training element is also a query point : its k nearest neighbors are searched among
+	 * all the other training elements (leave-one-out).
+	 */
+	query_t *points = (query_t *)malloc(TRAINELEMS * sizeof(query_t));
+	query_buffers_t point_buffers;
+	alloc_query_buffers(&point_buffers, points, TRAINELEMS, 0); // k nearest neighbors only, the coordinates are the training elements
+	xdata = (double **)malloc(TRAINELEMS * sizeof(double *));
+
+	load_binary_data(trainfile, mem, NULL, TRAINELEMS*(PROBDIM+1));
+
+#if defined(SIMD)
+	// Allocate new memory for the handler arrays, so that it is aligned and copy the data there
+	// Align each xdata[i] to a 32 byte boundary so you may later use SIMD
+	int posix_res;
+	for (int i = 0; i < TRAINELEMS; i++)
+	{
+		posix_res = posix_memalign((void **)(&(xdata[i])), 32, PROBDIM * sizeof(double));
+		assert(posix_res == 0);
+	}
+	copy_to_aligned(mem, xdata, (PROBDIM+1), PROBDIM, TRAINELEMS);
+#else
+	// Assign to the handler arrays, pointers to the already allocated mem
+	for (int i = 0; i < TRAINELEMS; i++)
+		xdata[i] = &mem[i*(PROBDIM + 1)];
+#endif
+
+	/* Configure and Initialize the ydata handler arrays */
+	for (int i = 0; i < TRAINELEMS; i++)
+	{
+#if defined(SURROGATES)
+		ydata[i] = mem[i * (PROBDIM + 1) + PROBDIM];
+#else
+		ydata[i] = 0;
+#endif
+	}
+
+	for (int i = 0; i < TRAINELEMS; i++)
+		points[i].x = xdata[i];
+
+	/* The training elements are split into ntiles tiles. Since the distance is symmetric, only the pairs
+	 * of tiles (a, b) with a <= b are processed, and each pair updates the k nearest neighbors of both tiles.
+	 *
+	 * Two threads must never update the neighbors of the same tile at the same time. Instead of locking, the pairs
+	 * are scheduled in rounds, using the round-robin ("circle") tournament schedule : within each round, every tile
+	 * appears in exactly one pair. Therefore, the pairs of a round are processed in parallel, and each thread owns the
+	 * k nearest neighbors of both of its tiles, which it updates in place, without any locks or atomics.
+	 * The implicit barrier at the end of each round hands the tiles over to the threads of the next round.
+	 * The diagonal pairs (a, a) are processed in a separate, embarrassingly parallel, first round.
+	 */
+	int ntiles = (TRAINELEMS + TILE_SIZE - 1) / TILE_SIZE;
+	int nslots = ntiles + (ntiles & 1); // the tournament needs an even number of tiles (the extra one is a "bye")
+
+	/* COMPUTATION PART */
+	double t_start, t_end, t_scan, t_total;
+	double sse = 0.0;
+	double err_sum = 0.0;
+
+	size_t nthreads = 1;
+
+	t_start = gettime();
+	#pragma omp parallel reduction(+ : sse, err_sum)
+	{
+		// thread-local distance tile
+		double *dist = (double *)malloc(TILE_SIZE * TILE_SIZE * sizeof(double));
+
+		#pragma omp single
+		nthreads = omp_get_num_threads();
+
+		#pragma omp for schedule(dynamic)
+		for (int a = 0; a < ntiles; a++)
+			process_tile_pair(points, a, a, dist);
+
+		for (int round = 0; round < nslots - 1; round++)
+		{
+			#pragma omp for schedule(dynamic)
+			for (int p = 0; p < nslots / 2; p++)
+			{
+				int a, b;
+				if (p == 0)
+				{
+					a = round;
+					b = nslots - 1;
+				}
+				else
+				{
+					a = (round + p) % (nslots - 1);
+					b = (round - p + nslots - 1) % (nslots - 1);
+				}
+
+				if (a < ntiles && b < ntiles) // skip the "bye"
+					process_tile_pair(points, a < b ? a : b, a < b ? b : a, dist);
+			}
+		}
+		free(dist);
+
+		#pragma omp master
+		t_scan = gettime() - t_start;
+
+		/* Leave-one-out prediction of every training element, using its k nearest neighbors
+		 * among the other training elements.
+		 */
+		#pragma omp for
+		for (int i = 0; i < TRAINELEMS; i++)
+		{
+			double yp = find_knn_value(&points[i], NNBS);
+			sse += (ydata[i] - yp) * (ydata[i] - yp);
+			err_sum += 100.0 * fabs((yp - ydata[i]) / ydata[i]);
+		}
+	}
+	t_end = gettime();
+	t_total = t_end - t_start;
+
+	double mse = sse / TRAINELEMS;
+	double ymean = compute_mean(ydata, TRAINELEMS);
+	double var = compute_var(ydata, TRAINELEMS, ymean);
+	double r2 = 1 - (mse / var);
+
+	printf("Leave-one-out results for %d training points (%zu threads)\n", TRAINELEMS, nthreads);
+	printf("APE = %.2f %%\n", err_sum / TRAINELEMS);
+	printf("MSE = %.6f\n", mse);
+	printf("R2 = 1 - (MSE/Var) = %.6lf\n", r2);
+
+	printf("Total Computing time = %lf secs\n", t_total);
+	printf("Self-join scan time = %lf secs (%.0f distances)\n", t_scan, (double)TRAINELEMS * (TRAINELEMS - 1) / 2);
+	printf("Average time/point = %lf secs\n", t_total / TRAINELEMS);
+
+	/* CLEANUP */
+	free_query_buffers(&point_buffers);
+	free(points);
+
+#if defined(SIMD)
+	for (int i = 0; i < TRAINELEMS; i++)
+		free(xdata[i]);
+#endif
+	free(xdata);
+	free(ydata);
+	free(mem);
+
+	return 0;
+}
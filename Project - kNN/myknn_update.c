@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <omp.h>
+
+#ifndef PROBDIM
+#define PROBDIM 2
+#endif
+
+#include "func_update.h"
+
+static train_store_t store;
+
+/* Find the k nearest neighbors of the queries [start, end) within a snapshot, in the same blocking fashion
+ * as myknn.c, and return the sum of the squared errors of their predictions.
+ */
+double run_queries(train_snapshot_t *s, query_t *queries, double *query_summ, double *query_ydata, int start, int end, int train_block_size, knn_stats_t *stats)
+{
+	double sse = 0.0;
+
+	for (int i = start; i < end; i++)
+		reset_query(&queries[i]);
+
+	for (int train_offset = 0; train_offset < s->n; train_offset += train_block_size)
+		for (int i = start; i < end; i++)
+			compute_knn_snapshot(s, &queries[i], &query_summ[i * SUMM_SIZE], NNBS, train_offset, train_block_size, stats);
+
+	for (int i = start; i < end; i++)
+	{
+		double yp = predict_value(queries[i].nn_val, NNBS);
+		sse += (query_ydata[i] - yp) * (query_ydata[i] - yp);
+	}
+	return sse;
+}
+
+int cmp_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3 || argc > 5)
+	{
+		printf("usage: %s <trainfile> <queryfile> [nbatches] [delete_percent]\n", argv[0]);
+		exit(1);
+	}
+
+	int L1d_size, train_block_size = 1;
+	get_L1d_size(&L1d_size); // get L1d cache size
+	// calculate the appropriate train block size as the previous power of 2
+	if(L1d_size > 0)
+		train_block_size = pow(2, floor(log2((L1d_size * 1000) / (PROBDIM * sizeof(double)))));
+
+	char *trainfile = argv[1];
+	char *queryfile = argv[2];
+	int nbatches = (argc >= 4) ? atoi(argv[3]) : 16;
+	int delete_percent = (argc >= 5) ? atoi(argv[4]) : 50;
+
+	/* The first half of the training file is the initial training set. The second half arrives in nbatches batches,
+	 * while the queries are running : each batch appends its rows and deletes delete_percent % as many of the
+	 * oldest training elements (i.e. a sliding window over the stream of training elements).
+	 */
+	int ninit = TRAINELEMS / 2;
+	int batch_rows = (nbatches > 0) ? (TRAINELEMS - ninit + nbatches - 1) / nbatches : 0;
+	int batch_deletes = batch_rows * delete_percent / 100;
+
+	double *mem = (double *)malloc(TRAINELEMS * (PROBDIM + 1) * sizeof(double));
+	double *query_mem = (double *)malloc(QUERYELEMS * (PROBDIM + 1) * sizeof(double));
+	query_t *queries = (query_t *)malloc(QUERYELEMS * sizeof(query_t));
+
+	// Allocate the coordinates and the k nearest neighbors of all the queries at once (see query_buffers_t)
+	query_buffers_t query_buffers;
+	alloc_query_buffers(&query_buffers, queries, QUERYELEMS, 1);
+
+	load_binary_data(trainfile, mem, NULL, TRAINELEMS*(PROBDIM+1));
+	load_binary_data(queryfile, query_mem, queries, QUERYELEMS * (PROBDIM + 1));
+
+	double *query_ydata = malloc(QUERYELEMS * sizeof(double));
+	for (int i = 0; i < QUERYELEMS; i++)
+	{
+#if defined(SURROGATES)
+		query_ydata[i] = query_mem[i * (PROBDIM + 1) + PROBDIM];
+#else
+		query_ydata[i] = 0;
+#endif
+	}
+#if !defined(SURROGATES)
+	for (int i = 0; i < TRAINELEMS; i++)
+		mem[i * (PROBDIM + 1) + PROBDIM] = 0;
+#endif
+
+	double t_init = gettime();
+	store_init(&store, mem, ninit, 2 * ninit);
+	t_init = gettime() - t_init;
+
+	double *query_summ = (double *)malloc(QUERYELEMS * SUMM_SIZE * sizeof(double));
+#if defined(LBFILTER)
+	// the summaries of the queries use the axes of the store, which never change
+	for (int i = 0; i < QUERYELEMS; i++)
+		compute_point_summary(&store.ks, queries[i].x, &query_summ[i * SUMM_SIZE]);
+#endif
+
+	/* COMPUTATION PART */
+
+	// thread 0 applies the batches, the other threads are the readers, which run the queries over and over
+	int nthreads = omp_get_max_threads() < 2 ? 2 : omp_get_max_threads();
+	if (nthreads > STORE_MAX_READERS + 1)
+		nthreads = STORE_MAX_READERS + 1;
+	int nreaders = nthreads - 1;
+
+	_Atomic long passes_done = 0;	// query passes completed by all the readers
+	_Atomic int updates_done = 0;
+	double t_update = 0.0, t_pass = 0.0, sse = 0.0;
+	long npasses = 0, nepochs_seen = 0;
+	long long dist_evals = 0, lb_rejects = 0;
+
+	double t_start = gettime();
+	#pragma omp parallel num_threads(nthreads) reduction(+ : t_pass, sse, npasses, nepochs_seen, dist_evals, lb_rejects)
+	{
+		int tid = omp_get_thread_num();
+		if (tid == 0)
+		{
+			train_batch_t batch;
+			batch.delete_ids = (int *)malloc((batch_deletes > 0 ? batch_deletes : 1) * sizeof(int));
+			int next_append = ninit, next_delete = 0;
+
+			for (int b = 0; b < nbatches; b++)
+			{
+				// let every reader complete a pass over the current snapshot, so that the updates and queries interleave
+				long target = atomic_load(&passes_done) + nreaders;
+				while (atomic_load(&passes_done) < target)
+					sched_yield();
+
+				batch.nappend = (next_append + batch_rows <= TRAINELEMS) ? batch_rows : TRAINELEMS - next_append;
+				batch.append_mem = &mem[(size_t)next_append * (PROBDIM + 1)];
+				next_append += batch.nappend;
+
+				batch.ndelete = batch_deletes;
+				for (int d = 0; d < batch_deletes; d++)
+					batch.delete_ids[d] = next_delete++;
+
+				double t0 = gettime();
+				store_apply_batch(&store, &batch);
+				t_update += gettime() - t0;
+			}
+			free(batch.delete_ids);
+			atomic_store(&updates_done, 1);
+		}
+		else
+		{
+			// each reader owns a slice of the queries
+			int r = tid - 1;
+			int start = r * (QUERYELEMS / nreaders);
+			int end = (r == nreaders - 1) ? QUERYELEMS : (r + 1) * (QUERYELEMS / nreaders);
+			knn_stats_t stats = {0, 0, 0, 0};
+			long last_epoch = -1;
+			int done;
+
+			/* Keep running passes until the updates are over. The last pass starts after the last batch, so
+			 * the results that remain in the queries are the ones of the final snapshot.
+			 */
+			do
+			{
+				done = atomic_load(&updates_done);
+
+				double t0 = gettime();
+				train_snapshot_t *s = store_enter(&store, r);
+				sse = run_queries(s, queries, query_summ, query_ydata, start, end, train_block_size, &stats);
+				if (s->epoch != last_epoch)
+					nepochs_seen++;
+				last_epoch = s->epoch;
+				store_exit(&store, r);
+				t_pass += gettime() - t0;
+
+				npasses++;
+				atomic_fetch_add(&passes_done, 1);
+			} while (!done);
+
+			dist_evals += stats.dist_evals;
+			lb_rejects += stats.lb_rejects;
+		}
+	}
+	double t_total = gettime() - t_start;
+
+	train_snapshot_t *final = atomic_load(&store.current);
+
+	/* Check the final snapshot against a full rebuild : a brute force search over the live training elements,
+	 * as if they had been reloaded from a file.
+	 */
+	int nlive = 0;
+	double **xlive = (double **)malloc(final->nalive * sizeof(double *));
+	double *ylive = (double *)malloc(final->nalive * sizeof(double));
+	int *idlive = (int *)malloc(final->nalive * sizeof(int));
+	for (int i = 0; i < final->n; i++)
+	{
+		if (atomic_load(&final->rows->del_epoch[i]) <= final->epoch)
+			continue;
+		xlive[nlive] = final->rows->xdata[i];
+		ylive[nlive] = final->rows->ydata[i];
+		idlive[nlive++] = final->rows->ids[i];
+	}
+	assert(nlive == final->nalive);
+
+	int mismatches = 0;
+	query_t check;
+	query_buffers_t check_buffers;
+	alloc_query_buffers(&check_buffers, &check, 1, 0); // the coordinates are the ones of each query
+	for (int i = 0; i < QUERYELEMS; i++)
+	{
+		int got[NNBS], expected[NNBS];
+
+		check.x = queries[i].x;
+		reset_query(&check);
+		compute_knn_brute_force(xlive, ylive, &check, PROBDIM, NNBS, 0, 0, nlive, NULL);
+
+		for (int j = 0; j < NNBS; j++)
+		{
+			got[j] = queries[i].nn_idx[j];
+			expected[j] = check.nn_idx[j] < 0 ? -1 : idlive[check.nn_idx[j]];
+		}
+		qsort(got, NNBS, sizeof(int), cmp_int);
+		qsort(expected, NNBS, sizeof(int), cmp_int);
+		for (int j = 0; j < NNBS; j++)
+			if (got[j] != expected[j])
+			{
+				mismatches++;
+				break;
+			}
+	}
+
+	/* CALCULATE AND DISPLAY RESULTS */
+
+	double mse = sse / QUERYELEMS;
+	double ymean = compute_mean(query_ydata, QUERYELEMS);
+	double var = compute_var(query_ydata, QUERYELEMS, ymean);
+	double r2 = 1 - (mse / var);
+
+	printf("Results for %d query points, on the final snapshot (epoch %ld, %d live training elements)\n", QUERYELEMS, final->epoch, final->nalive);
+	printf("MSE = %.6f\n", mse);
+	printf("R2 = 1 - (MSE/Var) = %.6lf\n", r2);
+
+	printf("Total time = %lf secs (initial load of %d training elements = %lf secs)\n", t_total, ninit, t_init);
+	if (nbatches > 0)
+		printf("Batches = %d (%d appended, %d deleted rows each), average batch time = %lf secs (%.0f rows/sec)\n",
+		       nbatches, batch_rows, batch_deletes, t_update / nbatches, nbatches * (double)(batch_rows + batch_deletes) / t_update);
+	printf("Query passes = %ld by %d readers, over %ld snapshots, average pass time = %lf secs\n", npasses, nreaders, nepochs_seen, t_pass / npasses);
+#if defined(LBFILTER)
+	printf("Candidates rejected by the lower bound = %.2f %%\n", 100.0 * lb_rejects / (double)(lb_rejects + dist_evals));
+#endif
+	printf("Retired objects = %ld, reclaimed while the queries were running = %ld\n", store.nretired, store.nfreed);
+	printf("Final snapshot vs full rebuild : %d mismatching queries\n", mismatches);
+
+	/* CLEANUP */
+	free(xlive);
+	free(ylive);
+	free(idlive);
+	free_query_buffers(&check_buffers);
+	store_free(&store);
+
+	free_query_buffers(&query_buffers);
+	free(queries);
+	free(query_ydata);
+	free(query_summ);
+	free(query_mem);
+	free(mem);
+
+	return mismatches != 0;
+}